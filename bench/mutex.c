@@ -0,0 +1,135 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ev.h>
+#include <evfibers_private/fiber.h>
+
+#define n_workers 8
+
+struct bench_arg {
+	struct fbr_mutex mutex;
+	size_t counts[n_workers];
+	ev_tstamp duration;
+	int done;
+};
+
+struct worker_arg {
+	struct bench_arg *bench;
+	int index;
+};
+
+static void worker_fiber(FBR_P_ void *_arg)
+{
+	struct worker_arg *arg = _arg;
+	struct bench_arg *bench = arg->bench;
+
+	while (!bench->done) {
+		fbr_mutex_lock(FBR_A_ &bench->mutex);
+		/* Critical section spanning a loop iteration, as if it was
+		 * waiting for some I/O */
+		fbr_cooperate(FBR_A);
+		bench->counts[arg->index]++;
+		fbr_mutex_unlock(FBR_A_ &bench->mutex);
+	}
+}
+
+static void stop_fiber(FBR_P_ void *_arg)
+{
+	struct bench_arg *bench = _arg;
+
+	fbr_sleep(FBR_A_ bench->duration);
+	bench->done = 1;
+	ev_break(fctx->__p->loop, EVBREAK_ALL);
+}
+
+static void run_mode(enum fbr_mutex_mode mode, const char *name,
+		ev_tstamp duration)
+{
+	struct fbr_context context;
+	struct bench_arg bench;
+	struct worker_arg args[n_workers];
+	fbr_id_t fibers[n_workers];
+	fbr_id_t stop;
+	size_t total = 0, min = (size_t)-1, max = 0;
+	double sum_sq = 0.;
+	ev_tstamp started, elapsed;
+	int retval;
+	int i;
+	(void)retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	memset(&bench, 0x00, sizeof(bench));
+	bench.duration = duration;
+	fbr_mutex_init(&context, &bench.mutex);
+	fbr_mutex_set_mode(&context, &bench.mutex, mode);
+
+	for (i = 0; i < n_workers; i++) {
+		args[i].bench = &bench;
+		args[i].index = i;
+		fibers[i] = fbr_create(&context, "worker", worker_fiber,
+				&args[i], 0);
+		assert(!fbr_id_isnull(fibers[i]));
+	}
+	stop = fbr_create(&context, "stop", stop_fiber, &bench, 0);
+	assert(!fbr_id_isnull(stop));
+
+	ev_now_update(EV_DEFAULT);
+	started = ev_time();
+	retval = fbr_transfer(&context, stop);
+	assert(0 == retval);
+	for (i = 0; i < n_workers; i++) {
+		retval = fbr_transfer(&context, fibers[i]);
+		assert(0 == retval);
+	}
+
+	ev_run(EV_DEFAULT, 0);
+	elapsed = ev_time() - started;
+
+	for (i = 0; i < n_workers; i++) {
+		total += bench.counts[i];
+		sum_sq += (double)bench.counts[i] * bench.counts[i];
+		if (bench.counts[i] < min)
+			min = bench.counts[i];
+		if (bench.counts[i] > max)
+			max = bench.counts[i];
+	}
+	/* Jain's fairness index: 1.0 means all workers got equal share */
+	printf("%-8s %12.0f ops/s  fairness %.3f  min %zu  max %zu\n", name,
+			total / elapsed, sum_sq > 0. ?
+			(double)total * total / (n_workers * sum_sq) : 0.,
+			min, max);
+
+	fbr_destroy(&context);
+}
+
+int main(int argc, char *argv[])
+{
+	ev_tstamp duration = 1.0;
+
+	if (argc > 1)
+		duration = atof(argv[1]);
+
+	run_mode(FBR_MUTEX_FIFO, "fifo", duration);
+	run_mode(FBR_MUTEX_HANDOFF, "handoff", duration);
+	run_mode(FBR_MUTEX_BARGING, "barging", duration);
+	return 0;
+}
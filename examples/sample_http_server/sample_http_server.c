@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <ev.h>
 #include <evfibers/fiber.h>
+#include <evfibers/listener.h>
 
 #include "http_parser.h"
 
@@ -33,11 +34,8 @@ int on_headers_complete(http_parser* parser)
 	return 0;
 }
 
-static void conn_handler(struct fbr_context *fctx, void *_arg)
+static void conn_handler(struct fbr_context *fctx, int fd, void *_arg)
 {
-	int fd = *(int *)_arg;
-	time_t now;
-	char *ct;
 	http_parser_settings settings;
 	http_parser parser;
 	char buf[BUFSIZ];
@@ -73,63 +71,55 @@ static void conn_handler(struct fbr_context *fctx, void *_arg)
 	close(fd);
 }
 
-static void acceptor(struct fbr_context *fctx, void *_arg)
+static void terminator(struct fbr_context *fctx, void *_arg)
 {
-	int fd = *(int *)_arg;
-	int client_fd;
-	socklen_t peer_len;
-	struct sockaddr_in peer_addr;
-	fbr_id_t id;
-	peer_len = sizeof(peer_addr);
-	for (;;) {
-		client_fd = fbr_accept(fctx, fd, (struct sockaddr *)&peer_addr,
-				&peer_len);
-		if (client_fd < 0)
-			err(EXIT_FAILURE, "accept failed");
-		id = fbr_create(fctx, "handler", conn_handler, &client_fd, 0);
-		if (fbr_id_isnull(id))
-			errx(EXIT_FAILURE, "unable to create a fiber");
-		fbr_transfer(fctx, id);
+	struct fbr_listener *listener = _arg;
+	struct fbr_siginfo info;
+	sigset_t set;
+	int retval;
 
-	}
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	retval = fbr_signal_wait(fctx, &set, -1., &info, 1);
+	if (-1 == retval)
+		errx(EXIT_FAILURE, "fbr_signal_wait: %s",
+				fbr_strerror(fctx, fctx->f_errno));
+	fbr_listener_destroy(listener);
+	ev_break(EV_DEFAULT, EVBREAK_ALL);
 }
 
 int main(int argc, char *argv[])
 {
 	struct sockaddr_in sar;
-	struct protoent *pe;
-	int sa, sw;
-	int port;
 	struct fbr_context fbr;
-	int retval;
-	int yes = 1;
-	fbr_id_t ticker_id;
-	fbr_id_t acceptor_id;
+	struct fbr_listener *listener;
+	unsigned workers = 0;
+	fbr_id_t terminator_id;
+
+	if (argc > 1)
+		workers = atoi(argv[1]);
 
 	fbr_init(&fbr, EV_DEFAULT);
 	signal(SIGPIPE, SIG_IGN);
 
-	pe = getprotobyname("tcp");
-	sa = socket(AF_INET, SOCK_STREAM, pe->p_proto);
-	if (0 > sa)
-		err(EXIT_FAILURE, "socket");
-	retval = setsockopt(sa, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-	if (retval)
-		err(EXIT_FAILURE, "setsockopt");
+	memset(&sar, 0x00, sizeof(sar));
 	sar.sin_family = AF_INET;
 	sar.sin_addr.s_addr = INADDR_ANY;
 	sar.sin_port = htons(12345);
-	retval = bind(sa, (struct sockaddr *)&sar, sizeof(struct sockaddr_in));
-	if (retval)
-		err(EXIT_FAILURE, "bind");
-	retval = listen(sa, 64);
-	if (retval)
-		err(EXIT_FAILURE, "listen");
-
-	acceptor_id = fbr_create(&fbr, "acceptor", acceptor, &sa, 0);
-	if (fbr_id_isnull(acceptor_id))
+	/* One SO_REUSEPORT socket, event loop and acceptor per CPU */
+	listener = fbr_listener_create((struct sockaddr *)&sar, sizeof(sar),
+			workers, FBR_LISTENER_PIN_CPU, conn_handler, NULL);
+	if (NULL == listener)
+		err(EXIT_FAILURE, "fbr_listener_create");
+
+	terminator_id = fbr_create(&fbr, "terminator", terminator, listener,
+			0);
+	if (fbr_id_isnull(terminator_id))
 		errx(EXIT_FAILURE, "unable to create a fiber");
-	fbr_transfer(&fbr, acceptor_id);
+	fbr_transfer(&fbr, terminator_id);
 
 	ev_run(EV_DEFAULT, 0);
+	fbr_destroy(&fbr);
+	return 0;
 }
@@ -144,8 +144,11 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/queue.h>
 #include <assert.h>
+#include <signal.h>
+#include <netdb.h>
 #include <ev.h>
 
 #include <evfibers/config.h>
@@ -158,6 +161,12 @@
  * Default stack size for a fiber of 64 KB.
  */
 #define FBR_STACK_SIZE (64 * 1024) /* 64 KB */
+/**
+ * Maximum number of fibers woken by fbr_cond_broadcast that may sit in the
+ * run queue at the same time. Limit is shared by all condition variables of a
+ * context.
+ */
+#define FBR_COND_BROADCAST_BATCH 32
 
 /**
  * @def fbr_assert
@@ -231,6 +240,9 @@ enum fbr_error_code {
 	FBR_EPROTOBUF,
 	FBR_EBUFFERNOSPACE,
 	FBR_EEIO,
+	FBR_ETIMEDOUT,
+	FBR_EFUTURE,
+	FBR_ECLOSED,
 };
 
 /**
@@ -290,6 +302,15 @@ struct fbr_context {
  */
 typedef void (*fbr_fiber_func_t)(FBR_P_ void *_arg);
 
+/**
+ * Joinable fiber's ``main'' function type.
+ * Same as fbr_fiber_func_t, but returns a result to be collected with
+ * fbr_join.
+ * @see fbr_create_joinable
+ * @see fbr_join
+ */
+typedef void *(*fbr_joinable_func_t)(FBR_P_ void *_arg);
+
 /**
  * (DEPRECATED) Destructor function type for the memory allocated in a fiber.
  * @param [in] ptr memory pointer for memory to be destroyed
@@ -384,6 +405,10 @@ enum fbr_ev_type {
 	FBR_EV_MUTEX, /*!< fbr_mutex event */
 	FBR_EV_COND_VAR, /*!< fbr_cond_var event */
 	FBR_EV_EIO, /*!< libeio event */
+	FBR_EV_RWLOCK, /*!< fbr_rwlock event */
+	FBR_EV_SEM, /*!< fbr_sem event */
+	FBR_EV_FUTURE, /*!< fbr_future event */
+	FBR_EV_CHAN, /*!< fbr_chan event */
 };
 
 struct fbr_ev_base;
@@ -486,6 +511,82 @@ struct fbr_ev_watcher {
 	struct fbr_ev_base ev_base;
 };
 
+/**
+ * fbr_rwlock event.
+ *
+ * This event struct can represent either shared or exclusive reader-writer
+ * lock aquisition waiting.
+ * @see fbr_ev_rwlock_init
+ * @see fbr_ev_upcast
+ * @see fbr_ev_wait
+ */
+struct fbr_ev_rwlock {
+	struct fbr_rwlock *rwlock; /*!< reader-writer lock we're interested
+				     in */
+	int exclusive; /*!< non-zero for write (exclusive) acquisition */
+	struct fbr_ev_base ev_base;
+};
+
+/**
+ * fbr_sem event.
+ *
+ * This event struct can represent semaphore permits aquisition waiting.
+ * @see fbr_ev_sem_init
+ * @see fbr_ev_upcast
+ * @see fbr_ev_wait
+ */
+struct fbr_ev_sem {
+	struct fbr_sem *sem; /*!< semaphore we're interested in */
+	unsigned count; /*!< number of permits to acquire */
+	struct fbr_ev_base ev_base;
+};
+
+struct fbr_future;
+
+/**
+ * fbr_future event.
+ *
+ * This event struct can represent waiting for a future to be completed.
+ * @see fbr_ev_future_init
+ * @see fbr_ev_upcast
+ * @see fbr_ev_wait
+ */
+struct fbr_ev_future {
+	struct fbr_future *future; /*!< future we're interested in */
+	struct fbr_ev_base ev_base;
+};
+
+struct fbr_chan;
+
+/**
+ * Channel operation.
+ * @see fbr_ev_chan
+ */
+enum fbr_chan_op {
+	FBR_CHAN_SEND = 1, /*!< send an element to a channel */
+	FBR_CHAN_RECV, /*!< receive an element from a channel */
+};
+
+/**
+ * fbr_chan event.
+ *
+ * This event struct can represent waiting for a channel send or receive to
+ * complete. Once the event has arrived, the element has been transferred,
+ * unless the closed flag is set.
+ * @see fbr_ev_chan_init
+ * @see fbr_ev_upcast
+ * @see fbr_ev_wait
+ * @see fbr_select
+ */
+struct fbr_ev_chan {
+	struct fbr_chan *chan; /*!< channel we're interested in */
+	enum fbr_chan_op op; /*!< operation to perform */
+	void *elem; /*!< element to send or buffer to receive into */
+	int closed; /*!< set if the event has arrived because the channel is
+		      closed */
+	struct fbr_ev_base ev_base;
+};
+
 /**
  * fbr_mutex event.
  *
@@ -512,6 +613,20 @@ struct fbr_ev_cond_var {
 	struct fbr_ev_base ev_base;
 };
 
+/**
+ * Mutex ownership transfer modes.
+ * @see fbr_mutex_set_mode
+ */
+enum fbr_mutex_mode {
+	FBR_MUTEX_FIFO = 0, /*!< unlock passes ownership to the first waiter,
+			      which is resumed upon the next loop iteration */
+	FBR_MUTEX_HANDOFF, /*!< unlock passes ownership to the first waiter and
+			     switches to it immediately */
+	FBR_MUTEX_BARGING, /*!< unlock frees the mutex and wakes the first
+			     waiter, any fiber may take the mutex before the
+			     waiter gets to run */
+};
+
 /**
  * Mutex structure.
  *
@@ -522,9 +637,36 @@ struct fbr_ev_cond_var {
 struct fbr_mutex {
 	fbr_id_t locked_by;
 	struct fbr_id_tailq pending;
+	enum fbr_mutex_mode mode;
 	TAILQ_ENTRY(fbr_mutex) entries;
 };
 
+/**
+ * Reader-writer lock structure.
+ *
+ * This structure represent a reader-writer lock.
+ * @see fbr_rwlock_init
+ * @see fbr_rwlock_destroy
+ */
+struct fbr_rwlock {
+	fbr_id_t writer; /*!< fiber holding the lock exclusively */
+	unsigned readers; /*!< number of fibers holding the lock shared */
+	struct fbr_id_tailq rd_pending;
+	struct fbr_id_tailq wr_pending;
+};
+
+/**
+ * Counting semaphore structure.
+ *
+ * This structure represent a counting semaphore.
+ * @see fbr_sem_init
+ * @see fbr_sem_destroy
+ */
+struct fbr_sem {
+	unsigned value; /*!< number of available permits */
+	struct fbr_id_tailq pending;
+};
+
 /**
  * Conditional variable structure.
  *
@@ -537,6 +679,32 @@ struct fbr_cond_var {
 	struct fbr_id_tailq waiting;
 };
 
+/**
+ * Wait group structure.
+ *
+ * This structure represent a wait group.
+ * @see fbr_waitgroup_init
+ * @see fbr_waitgroup_destroy
+ */
+struct fbr_waitgroup {
+	unsigned counter; /*!< number of outstanding tasks */
+	struct fbr_cond_var cond;
+};
+
+/**
+ * Barrier structure.
+ *
+ * This structure represent a barrier.
+ * @see fbr_barrier_init
+ * @see fbr_barrier_destroy
+ */
+struct fbr_barrier {
+	unsigned count; /*!< number of fibers to wait for */
+	unsigned waiting; /*!< number of fibers waiting at the moment */
+	unsigned generation;
+	struct fbr_cond_var cond;
+};
+
 /**
  * Virtual ring buffer implementation.
  *
@@ -554,8 +722,26 @@ struct fbr_vrb {
 	size_t ptr_size;
 	void *data_ptr;
 	void *space_ptr;
+	int fd; /*!< backing file, kept open for resizable vrbs only */
+	unsigned flags; /*!< fbr_vrb_flags in effect */
+};
+
+/**
+ * Concurrent reservation of a fbr_buffer region.
+ *
+ * Filled in by fbr_buffer_reserve and owned by the buffer until committed.
+ * @see fbr_buffer_reserve
+ * @see fbr_buffer_reserve_commit
+ */
+struct fbr_buffer_rsv {
+	void *ptr; /*!< start of the reserved region */
+	size_t size; /*!< size of the reserved region */
+	int committed; //Private
+	TAILQ_ENTRY(fbr_buffer_rsv) entries; //Private
 };
 
+TAILQ_HEAD(fbr_buffer_rsv_tailq, fbr_buffer_rsv);
+
 /**
  * Inter-fiber communication pipe.
  *
@@ -570,12 +756,36 @@ struct fbr_buffer {
 	struct fbr_vrb vrb;
 	size_t prepared_bytes;
 	size_t waiting_bytes;
+	size_t reserved_bytes;
+	struct fbr_buffer_rsv_tailq reservations;
 	struct fbr_cond_var committed_cond;
 	struct fbr_mutex write_mutex;
 	struct fbr_cond_var bytes_freed_cond;
 	struct fbr_mutex read_mutex;
 };
 
+struct fbr_ipc_hdr;
+
+/**
+ * Inter-process communication pipe.
+ *
+ * Same as fbr_buffer, but the ring and its indices live in shared memory, so
+ * that a fiber in one process may write to it while a fiber in another
+ * process reads from it.
+ * @see fbr_ipc_buffer_init
+ * @see struct fbr_buffer
+ */
+struct fbr_ipc_buffer {
+	struct fbr_vrb vrb; /*!< mirrored shared ring, data pointers unused */
+	struct fbr_ipc_hdr *hdr;
+	int data_fd[2]; /*!< woken up by writer: read end, write end */
+	int space_fd[2]; /*!< woken up by reader: read end, write end */
+	size_t prepared_bytes;
+	size_t waiting_bytes;
+	struct fbr_mutex write_mutex;
+	struct fbr_mutex read_mutex;
+};
+
 struct fbr_mq;
 
 /**
@@ -653,6 +863,60 @@ void fbr_ev_watcher_init(FBR_P_ struct fbr_ev_watcher *ev, ev_watcher *w);
 void fbr_ev_mutex_init(FBR_P_ struct fbr_ev_mutex *ev,
 		struct fbr_mutex *mutex);
 
+/**
+ * Initializer for reader-writer lock event.
+ * @param [in] rwlock reader-writer lock to acquire
+ * @param [in] exclusive non-zero to acquire the lock for writing
+ *
+ * This functions properly initializes fbr_ev_rwlock struct. You should not do
+ * it manually. Once the event has arrived, the lock is held by the waiting
+ * fiber and should be released with fbr_rwlock_unlock.
+ * @see fbr_ev_rwlock
+ * @see fbr_ev_wait
+ */
+void fbr_ev_rwlock_init(FBR_P_ struct fbr_ev_rwlock *ev,
+		struct fbr_rwlock *rwlock, int exclusive);
+
+/**
+ * Initializer for semaphore event.
+ * @param [in] sem semaphore to acquire permits from
+ * @param [in] count number of permits to acquire
+ *
+ * This functions properly initializes fbr_ev_sem struct. You should not do
+ * it manually. Once the event has arrived, the permits are held by the
+ * waiting fiber and should be returned with fbr_sem_release.
+ * @see fbr_ev_sem
+ * @see fbr_ev_wait
+ */
+void fbr_ev_sem_init(FBR_P_ struct fbr_ev_sem *ev, struct fbr_sem *sem,
+		unsigned count);
+
+/**
+ * Initializer for future event.
+ * @param [in] future future to wait for
+ *
+ * This functions properly initializes fbr_ev_future struct. You should not do
+ * it manually. The caller must hold a reference to the future while waiting.
+ * @see fbr_ev_future
+ * @see fbr_ev_wait
+ */
+void fbr_ev_future_init(FBR_P_ struct fbr_ev_future *ev,
+		struct fbr_future *future);
+
+/**
+ * Initializer for channel event.
+ * @param [in] chan channel to operate on
+ * @param [in] op FBR_CHAN_SEND or FBR_CHAN_RECV
+ * @param [in] elem element to send or buffer to receive into, elem_size bytes
+ *
+ * This functions properly initializes fbr_ev_chan struct. You should not do
+ * it manually. The element buffer must stay valid while waiting.
+ * @see fbr_ev_chan
+ * @see fbr_select
+ */
+void fbr_ev_chan_init(FBR_P_ struct fbr_ev_chan *ev, struct fbr_chan *chan,
+		enum fbr_chan_op op, void *elem);
+
 /**
  * Initializer for conditional variable event.
  *
@@ -746,6 +1010,23 @@ void fbr_destroy(FBR_P);
  */
 void fbr_enable_backtraces(FBR_P, int enabled);
 
+/**
+ * Enables/Disables huge pages for fiber stacks.
+ * @param [in] enabled should new stacks be backed by huge pages?
+ *
+ * Stacks of fibers created afterwards are mapped with explicit huge pages
+ * (MAP_HUGETLB), their size being rounded up to the huge page size. If no
+ * huge pages are reserved, stacks are mapped with regular pages advised to
+ * be backed by transparent huge pages (MADV_HUGEPAGE) instead. Stacks of
+ * already created fibers, including reclaimed ones waiting to be reused, are
+ * not affected.
+ *
+ * This only pays off with large stacks, as every stack then occupies at
+ * least one huge page. Disabled by default.
+ * @see fbr_create
+ */
+void fbr_enable_huge_page_stacks(FBR_P_ int enabled);
+
 /**
  * Analog of strerror but for the library errno.
  * @param [in] code Error code to describe
@@ -858,6 +1139,43 @@ void fbr_log_d(FBR_P_ const char *format, ...)
 fbr_id_t fbr_create(FBR_P_ const char *name, fbr_fiber_func_t func, void *arg,
 		size_t stack_size);
 
+/**
+ * Creates a new joinable fiber.
+ * @param [in] name fiber name, used for identification it
+ * backtraces, etc.
+ * @param [in] func function used as a fiber's ``main''.
+ * @param [in] arg user supplied argument to a fiber.
+ * @param [in] stack_size stack size (0 for default).
+ * @return Pointer to the created fiber.
+ *
+ * Same as fbr_create, except that once func returns, the fiber is not
+ * reclaimed right away. It stays around holding the value returned by func
+ * until some fiber collects it with fbr_join, which reclaims the fiber.
+ * Reclaiming a finished fiber explicitly (or along with its parent) discards
+ * the result.
+ * @see fbr_join
+ * @see fbr_create
+ */
+fbr_id_t fbr_create_joinable(FBR_P_ const char *name, fbr_joinable_func_t func,
+		void *arg, size_t stack_size);
+
+/**
+ * Waits for a joinable fiber to finish and collects its result.
+ * @param [in] id joinable fiber id
+ * @param [out] result receives the value returned by the fiber (may be NULL)
+ * @param [in] timeout in seconds to wait, negative value means forever
+ * @return 0 on success, -1 with f_errno set upon failure
+ *
+ * The fiber is reclaimed once its result is collected, so only one fiber can
+ * join it.
+ *
+ * FBR_ENOFIBER is reported if the fiber does not exist (or has been reclaimed
+ * while waiting), FBR_EINVAL is reported if it was not created joinable or is
+ * the calling fiber itself, FBR_ETIMEDOUT is reported upon timeout.
+ * @see fbr_create_joinable
+ */
+int fbr_join(FBR_P_ fbr_id_t id, void **result, ev_tstamp timeout);
+
 /**
  * Retrieve a name of the fiber.
  * @param [in] id identificator of a fiber
@@ -1047,6 +1365,10 @@ void fbr_cooperate(FBR_P);
  *
  * When a fiber is reclaimed, this memory will be freed. Prior to that a
  * destructor will be called if any specified.
+ *
+ * Memory is bump-allocated from chunks owned by the fiber, which are all
+ * freed at once when it is reclaimed; only chunks with a destructor are
+ * visited one by one.
  * @see fbr_calloc
  * @see fbr_alloc_set_destructor
  * @see fbr_alloc_destructor_func_t
@@ -1090,6 +1412,11 @@ void *fbr_calloc(FBR_P_ unsigned int nmemb, size_t size);
  * @param [in] ptr chunk address
  *
  * Explicitly frees a fiber pool chunk calling the destructor if any.
+ *
+ * Freeing the most recent allocation of a fiber gives its memory back right
+ * away. Otherwise memory is given back once everything allocated next to it
+ * in the same arena chunk is freed as well, which for allocations larger than
+ * a chunk is right away. The rest is given back when the fiber is reclaimed.
  * @see fbr_alloc
  * @see fbr_calloc
  * @see fbr_alloc_set_destructor
@@ -1100,7 +1427,8 @@ void fbr_free(FBR_P_ void *ptr);
  * (DEPRECATED) Explicitly frees allocated memory chunk.
  * @param [in] ptr chunk address
  *
- * Explicitly frees a fiber pool chunk without calling the destructor.
+ * Explicitly frees a fiber pool chunk without calling the destructor. Memory
+ * is given back as with fbr_free.
  * @see fbr_alloc
  * @see fbr_calloc
  * @see fbr_alloc_set_destructor
@@ -1399,6 +1727,59 @@ ssize_t fbr_send(FBR_P_ int sockfd, const void *buf, size_t len, int flags);
  */
 int fbr_accept(FBR_P_ int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 
+/**
+ * Accepts a batch of connections on a listening socket.
+ * @param [in] sockfd file descriptor to accept on
+ * @param [out] fds array receiving client socket fds
+ * @param [in] max maximum number of connections to accept (the budget)
+ * @return number of accepted connections on success, -1 in case of error and
+ * errno set
+ *
+ * This function waits until at least one connection is pending and then
+ * keeps accepting until the backlog is drained or max connections have been
+ * accepted, so a burst of connections is served within a single wake up.
+ * Client sockets are already in non-blocking mode and have close-on-exec
+ * flag set (accept4 is used where available), so there is no need to call
+ * fbr_fd_nonblock on them.
+ *
+ * Backlog can only be drained on a non-blocking listening socket, for a
+ * blocking one at most one connection is accepted per call.
+ *
+ * Possible errno values are described in accept man page.
+ * @see fbr_accept_spawn
+ */
+int fbr_accept_many(FBR_P_ int sockfd, int *fds, size_t max);
+
+/**
+ * Connection handler function pointer type.
+ * @param [in] fd client socket fd, the handler is responsible for closing it
+ * @param [in] arg user supplied argument
+ * @see fbr_accept_spawn
+ */
+typedef void (*fbr_accept_handler_t)(FBR_P_ int fd, void *arg);
+
+/**
+ * Accepts a batch of connections and spawns a handler fiber for each one.
+ * @param [in] sockfd file descriptor to accept on
+ * @param [in] budget maximum number of connections to accept
+ * @param [in] name name of handler fibers
+ * @param [in] handler connection handler
+ * @param [in] arg argument passed to handler
+ * @param [in] stack_size stack size of handler fibers (0 for default)
+ * @return number of spawned handlers on success, -1 in case of error and
+ * f_errno set (FBR_ESYSTEM leaves the accept error in errno)
+ *
+ * Connections are accepted as with fbr_accept_many, in batches of at most 64
+ * descriptors; only the first batch waits for a connection to arrive, later
+ * ones just drain the backlog. Every handler fiber is
+ * created as a child of the calling fiber and is transferred to immediately,
+ * so it runs until it blocks for the first time before the next one is
+ * spawned. Typical acceptor fiber just calls this function in a loop.
+ * @see fbr_accept_many
+ */
+int fbr_accept_spawn(FBR_P_ int sockfd, size_t budget, const char *name,
+		fbr_accept_handler_t handler, void *arg, size_t stack_size);
+
 /**
  * Puts current fiber to sleep.
  * @param [in] seconds maximum number of seconds to sleep
@@ -1418,6 +1799,46 @@ ev_tstamp fbr_sleep(FBR_P_ ev_tstamp seconds);
  */
 void fbr_async_wait(FBR_P_ ev_async *w);
 
+/**
+ * Coalesced signal delivery record.
+ * @see fbr_signal_wait
+ */
+struct fbr_siginfo {
+	int signo; /*!< signal number */
+	unsigned count; /*!< number of deliveries coalesced since the last
+			  report */
+};
+
+/**
+ * Waits for one of the signals from a set to be delivered.
+ * @param [in] set set of signals to wait for
+ * @param [in] timeout maximum number of seconds to wait, negative value means
+ * no timeout
+ * @param [out] info array receiving one record per pending signal
+ * @param [in] n number of records info can hold
+ * @return number of records stored in info, -1 upon failure with f_errno set
+ *
+ * Signals are watched via ev_signal, so libev takes care of the actual
+ * handler installation (and uses signalfd where available). Watchers are
+ * started lazily on the first wait for a given signal and stay active until
+ * fbr_destroy, so that signals arriving between two waits are not lost. The
+ * event loop is kept alive only while some fiber is actually waiting.
+ *
+ * Deliveries of the same signal are coalesced into a single record with a
+ * counter, and all pending signals from the set are reported at once, so a
+ * storm of SIGCHLD or SIGHUP results in a single wake up of the waiting
+ * fiber. Since libev does not pass siginfo_t to its callbacks, the sender
+ * details are not available.
+ *
+ * If several fibers wait for the same signal, the first one to run consumes
+ * it.
+ *
+ * FBR_ETIMEDOUT is reported if nothing has arrived within the timeout,
+ * FBR_EINVAL is reported for a signal that can not be caught.
+ */
+int fbr_signal_wait(FBR_P_ const sigset_t *set, ev_tstamp timeout,
+		struct fbr_siginfo *info, size_t n);
+
 /**
  * Prints fiber call stack to stderr.
  *
@@ -1440,6 +1861,32 @@ void fbr_dump_stack(FBR_P_ fbr_logutil_func_t log);
  */
 void fbr_mutex_init(FBR_P_ struct fbr_mutex *mutex);
 
+/**
+ * Sets mutex ownership transfer mode.
+ * @param [in] mutex pointer to a mutex
+ * @param [in] mode new mode
+ *
+ * FBR_MUTEX_FIFO (the default) is strictly fair: the mutex is passed to the
+ * first waiter upon unlock, but stays idle until the waiter is resumed upon
+ * the next event loop iteration.
+ *
+ * FBR_MUTEX_HANDOFF is fair as well, but the unlocking fiber switches to the
+ * new owner right away and continues once the owner yields. This removes the
+ * idle gap at the cost of the unlocking fiber being delayed. When the fiber
+ * call stack is almost exhausted, FIFO behaviour is used instead.
+ *
+ * FBR_MUTEX_BARGING favours throughput: the mutex becomes free upon unlock and
+ * the first waiter is woken up, but the unlocking fiber (or any other one) may
+ * take the mutex again before the waiter runs. The waiter that lost the race
+ * is put back at the head of the queue. Waiters may starve in this mode.
+ *
+ * Mode should be changed only while there are no waiters.
+ *
+ * @see fbr_mutex_unlock
+ */
+void fbr_mutex_set_mode(FBR_P_ struct fbr_mutex *mutex,
+		enum fbr_mutex_mode mode);
+
 /**
  * Locks a mutex.
  * @param [in] mutex pointer to a mutex
@@ -1474,7 +1921,8 @@ int fbr_mutex_trylock(FBR_P_ struct fbr_mutex *mutex);
  * @param [in] mutex pointer to a mutex
  *
  * Unlocks the given mutex. An other fiber that is waiting for it (if any) will
- * be called upon next libev loop iteration.
+ * be called upon next libev loop iteration, or right away for a mutex in
+ * FBR_MUTEX_HANDOFF mode.
  *
  * @see fbr_mutex_init
  * @see fbr_mutex_lock
@@ -1497,132 +1945,695 @@ void fbr_mutex_unlock(FBR_P_ struct fbr_mutex *mutex);
 void fbr_mutex_destroy(FBR_P_ struct fbr_mutex *mutex);
 
 /**
- * Initializes a conditional variable.
+ * Initializes a reader-writer lock.
+ * @param [in] rwlock a reader-writer lock structure to initialize
  *
- * Conditional variable is useful primitive for fiber synchronisation. A set of
- * fibers may be waiting until certain condition is met. Another fiber can
- * trigger this condition for one or all waiting fibers.
+ * Reader-writer lock allows any number of fibers to hold it for reading at the
+ * same time, while holding it for writing is exclusive. It is useful for read
+ * mostly shared state, where fbr_mutex would needlessly serialize readers.
  *
- * @see fbr_cond_destroy
- * @see fbr_cond_wait
- * @see fbr_cond_broadcast
- * @see fbr_cond_signal
+ * Writers are preferred: once a writer is waiting, new readers are queued
+ * behind it. Upon release, the lock goes to the first waiting writer if any,
+ * otherwise all waiting readers get it at once. Waiters are resumed upon the
+ * next event loop iteration.
+ *
+ * @see fbr_rwlock_rdlock
+ * @see fbr_rwlock_wrlock
+ * @see fbr_rwlock_unlock
+ * @see fbr_rwlock_destroy
+ * @see fbr_ev_rwlock_init
  */
-void fbr_cond_init(FBR_P_ struct fbr_cond_var *cond);
+void fbr_rwlock_init(FBR_P_ struct fbr_rwlock *rwlock);
 
 /**
- * Destroys a conditional variable.
+ * Locks a reader-writer lock for reading.
+ * @param [in] rwlock pointer to a reader-writer lock
  *
- * This just frees used resources. No signals are sent to waiting fibers.
+ * Calling fiber is suspended while the lock is held or awaited by a writer.
  *
- * @see fbr_cond_init
- * @see fbr_cond_wait
- * @see fbr_cond_broadcast
- * @see fbr_cond_signal
+ * @see fbr_rwlock_init
+ * @see fbr_rwlock_unlock
  */
-void fbr_cond_destroy(FBR_P_ struct fbr_cond_var *cond);
+void fbr_rwlock_rdlock(FBR_P_ struct fbr_rwlock *rwlock);
 
 /**
- * Waits until condition is met.
+ * Locks a reader-writer lock for reading with timeout.
+ * @param [in] rwlock pointer to a reader-writer lock
+ * @param [in] timeout in seconds to wait for the lock
+ * @return 0 on success, -1 with f_errno set to FBR_ETIMEDOUT upon timeout
  *
- * Current fiber is suspended until a signal is sent via fbr_cond_signal or
- * fbr_cond_broadcast to the corresponding conditional variable.
- *
- * A mutex must be acquired by the calling fiber prior to waiting for a
- * condition. Internally mutex is released and reacquired again before
- * returning. Upon successful return calling fiber will hold the mutex.
+ * @see fbr_rwlock_rdlock
+ */
+int fbr_rwlock_rdlock_wto(FBR_P_ struct fbr_rwlock *rwlock,
+		ev_tstamp timeout);
+
+/**
+ * Tries to lock a reader-writer lock for reading.
+ * @param [in] rwlock pointer to a reader-writer lock
+ * @return 1 if lock was successful, 0 otherwise
  *
- * @see fbr_cond_init
- * @see fbr_cond_destroy
- * @see fbr_cond_broadcast
- * @see fbr_cond_signal
+ * @see fbr_rwlock_rdlock
  */
-int fbr_cond_wait(FBR_P_ struct fbr_cond_var *cond, struct fbr_mutex *mutex);
+int fbr_rwlock_tryrdlock(FBR_P_ struct fbr_rwlock *rwlock);
 
 /**
- * Broadcasts a signal to all fibers waiting for condition.
+ * Locks a reader-writer lock for writing.
+ * @param [in] rwlock pointer to a reader-writer lock
  *
- * All fibers waiting for a condition will be added to run queue (and will
- * eventually be run, one per event loop iteration).
+ * Calling fiber is suspended while the lock is held by anyone else.
  *
- * @see fbr_cond_init
- * @see fbr_cond_destroy
- * @see fbr_cond_wait
- * @see fbr_cond_signal
+ * @see fbr_rwlock_init
+ * @see fbr_rwlock_unlock
  */
-void fbr_cond_broadcast(FBR_P_ struct fbr_cond_var *cond);
+void fbr_rwlock_wrlock(FBR_P_ struct fbr_rwlock *rwlock);
 
 /**
- * Signals to first fiber waiting for a condition.
+ * Locks a reader-writer lock for writing with timeout.
+ * @param [in] rwlock pointer to a reader-writer lock
+ * @param [in] timeout in seconds to wait for the lock
+ * @return 0 on success, -1 with f_errno set to FBR_ETIMEDOUT upon timeout
  *
- * Exactly one fiber (first one) waiting for a condition will be added to run
- * queue (and will eventually be run, one per event loop iteration).
- *
- * @see fbr_cond_init
- * @see fbr_cond_destroy
- * @see fbr_cond_wait
- * @see fbr_cond_signal
+ * @see fbr_rwlock_wrlock
  */
-void fbr_cond_signal(FBR_P_ struct fbr_cond_var *cond);
+int fbr_rwlock_wrlock_wto(FBR_P_ struct fbr_rwlock *rwlock,
+		ev_tstamp timeout);
 
 /**
- * Initializes memory mappings.
- * @param [in] vrb a pointer to fbr_vrb
- * @param [in] size length of the data
- * @param [in] file_pattern file name patterm for underlying mmap storage
- * @returns 0 on succes, -1 on error.
+ * Tries to lock a reader-writer lock for writing.
+ * @param [in] rwlock pointer to a reader-writer lock
+ * @return 1 if lock was successful, 0 otherwise
  *
- * This function mmaps adjacent virtual memory regions of required size which
- * correspond to the same physical memory region. Also it adds two page-sized
- * regions on the left and on the right with PROT_NONE access as a guards.
+ * @see fbr_rwlock_wrlock
+ */
+int fbr_rwlock_trywrlock(FBR_P_ struct fbr_rwlock *rwlock);
+
+/**
+ * Unlocks a reader-writer lock.
+ * @param [in] rwlock pointer to a reader-writer lock
  *
- * It does mmaps on the same file, which is unlinked and closed afterwards, so
- * it will not pollute file descriptor space of a process and the filesystem.
+ * Releases either shared or exclusive hold of the calling fiber.
  *
- * @see struct fbr_vrb
- * @see fbr_vrb_destroy
+ * @see fbr_rwlock_init
+ * @see fbr_rwlock_rdlock
+ * @see fbr_rwlock_wrlock
  */
-int fbr_vrb_init(struct fbr_vrb *vrb, size_t size, const char *file_pattern);
+void fbr_rwlock_unlock(FBR_P_ struct fbr_rwlock *rwlock);
 
+/**
+ * Destroys a reader-writer lock.
+ * @param [in] rwlock pointer to a reader-writer lock
+ *
+ * @see fbr_rwlock_init
+ */
+void fbr_rwlock_destroy(FBR_P_ struct fbr_rwlock *rwlock);
 
 /**
- * Destroys mappings.
- * @param [in] vrb a pointer to fbr_vrb
+ * Initializes a counting semaphore.
+ * @param [in] sem a semaphore structure to initialize
+ * @param [in] value initial number of permits
  *
- * This function unmaps all the mappings done by fbr_vrb_init.
+ * Semaphore is handy to limit concurrency, e.g. the number of requests in
+ * flight to some backend.
  *
- * @see fbr_vrb_init
+ * Waiters are served in FIFO order: upon release, permits are granted to
+ * waiters from the head of the queue as long as their requests fit into the
+ * available permits, the rest are not woken up at all. Granted waiters are
+ * resumed upon the next event loop iteration.
+ *
+ * @see fbr_sem_acquire
+ * @see fbr_sem_release
+ * @see fbr_sem_destroy
+ * @see fbr_ev_sem_init
  */
-void fbr_vrb_destroy(struct fbr_vrb *vrb);
+void fbr_sem_init(FBR_P_ struct fbr_sem *sem, unsigned value);
 
 /**
- * Retrieves data length.
- * @param [in] vrb a pointer to fbr_vrb
- * @returns length of the data area.
+ * Acquires semaphore permits.
+ * @param [in] sem pointer to a semaphore
+ * @param [in] count number of permits to acquire
  *
- * @see struct fbr_vrb
+ * Calling fiber is suspended until count permits become available.
+ *
+ * @see fbr_sem_init
+ * @see fbr_sem_release
  */
-static inline size_t fbr_vrb_data_len(struct fbr_vrb *vrb)
-{
-	return vrb->space_ptr - vrb->data_ptr;
-}
+void fbr_sem_acquire(FBR_P_ struct fbr_sem *sem, unsigned count);
 
 /**
- * Retrieves space length.
- * @param [in] vrb a pointer to fbr_vrb
- * @returns length of the space area.
+ * Acquires semaphore permits with timeout.
+ * @param [in] sem pointer to a semaphore
+ * @param [in] count number of permits to acquire
+ * @param [in] timeout in seconds to wait for the permits
+ * @return 0 on success, -1 with f_errno set to FBR_ETIMEDOUT upon timeout
  *
- * @see struct fbr_vrb
+ * @see fbr_sem_acquire
  */
-static inline size_t fbr_vrb_space_len(struct fbr_vrb *vrb)
-{
-	return vrb->data_ptr + vrb->ptr_size - vrb->space_ptr;
-}
+int fbr_sem_acquire_wto(FBR_P_ struct fbr_sem *sem, unsigned count,
+		ev_tstamp timeout);
 
 /**
- * Retrieves total buffer capacity.
- * @param [in] vrb a pointer to fbr_vrb
- * @returns maximum length of data this vrb can hold.
+ * Tries to acquire semaphore permits.
+ * @param [in] sem pointer to a semaphore
+ * @param [in] count number of permits to acquire
+ * @return 1 if permits were acquired, 0 otherwise
+ *
+ * Does not succeed while there are waiters queued, even if the permits are
+ * available, to keep the waiters from starving.
+ *
+ * @see fbr_sem_acquire
+ */
+int fbr_sem_try_acquire(FBR_P_ struct fbr_sem *sem, unsigned count);
+
+/**
+ * Releases semaphore permits.
+ * @param [in] sem pointer to a semaphore
+ * @param [in] count number of permits to release
+ *
+ * @see fbr_sem_init
+ * @see fbr_sem_acquire
+ */
+void fbr_sem_release(FBR_P_ struct fbr_sem *sem, unsigned count);
+
+/**
+ * Destroys a counting semaphore.
+ * @param [in] sem pointer to a semaphore
+ *
+ * @see fbr_sem_init
+ */
+void fbr_sem_destroy(FBR_P_ struct fbr_sem *sem);
+
+/**
+ * Initializes a wait group.
+ * @param [in] wg a wait group structure to initialize
+ *
+ * Wait group lets a fiber wait until a set of tasks (usually carried out by
+ * other fibers) is complete. The counter of outstanding tasks is incremented
+ * with fbr_waitgroup_add and decremented with fbr_waitgroup_done, waiters are
+ * woken up once it drops to zero.
+ *
+ * @see fbr_waitgroup_add
+ * @see fbr_waitgroup_done
+ * @see fbr_waitgroup_wait
+ * @see fbr_waitgroup_destroy
+ */
+void fbr_waitgroup_init(FBR_P_ struct fbr_waitgroup *wg);
+
+/**
+ * Adds outstanding tasks to a wait group.
+ * @param [in] wg pointer to a wait group
+ * @param [in] n number of tasks to add
+ *
+ * @see fbr_waitgroup_done
+ */
+void fbr_waitgroup_add(FBR_P_ struct fbr_waitgroup *wg, unsigned n);
+
+/**
+ * Marks one task of a wait group as complete.
+ * @param [in] wg pointer to a wait group
+ *
+ * Wakes up all the waiters when the last task is done.
+ *
+ * @see fbr_waitgroup_add
+ * @see fbr_waitgroup_wait
+ */
+void fbr_waitgroup_done(FBR_P_ struct fbr_waitgroup *wg);
+
+/**
+ * Waits for all tasks of a wait group to complete.
+ * @param [in] wg pointer to a wait group
+ * @param [in] timeout in seconds to wait, negative value means forever
+ * @return 0 on success, -1 with f_errno set to FBR_ETIMEDOUT upon timeout
+ *
+ * Returns immediately if there are no outstanding tasks.
+ *
+ * @see fbr_waitgroup_add
+ * @see fbr_waitgroup_done
+ */
+int fbr_waitgroup_wait(FBR_P_ struct fbr_waitgroup *wg, ev_tstamp timeout);
+
+/**
+ * Destroys a wait group.
+ * @param [in] wg pointer to a wait group
+ *
+ * @see fbr_waitgroup_init
+ */
+void fbr_waitgroup_destroy(FBR_P_ struct fbr_waitgroup *wg);
+
+/**
+ * Initializes a barrier.
+ * @param [in] barrier a barrier structure to initialize
+ * @param [in] count number of fibers to synchronize
+ *
+ * Barrier holds fibers calling fbr_barrier_wait until count of them have
+ * arrived, then releases all of them at once. Barrier is reusable: the next
+ * count calls form the next round.
+ *
+ * Note that a fiber reclaimed while waiting at the barrier still counts as
+ * arrived.
+ *
+ * @see fbr_barrier_wait
+ * @see fbr_barrier_destroy
+ */
+void fbr_barrier_init(FBR_P_ struct fbr_barrier *barrier, unsigned count);
+
+/**
+ * Waits at a barrier.
+ * @param [in] barrier pointer to a barrier
+ * @return 1 for the fiber that completed the round, 0 for the others
+ *
+ * The value returned allows a single fiber to perform some work on behalf of
+ * the whole round, similar to PTHREAD_BARRIER_SERIAL_THREAD.
+ *
+ * @see fbr_barrier_init
+ */
+int fbr_barrier_wait(FBR_P_ struct fbr_barrier *barrier);
+
+/**
+ * Destroys a barrier.
+ * @param [in] barrier pointer to a barrier
+ *
+ * @see fbr_barrier_init
+ */
+void fbr_barrier_destroy(FBR_P_ struct fbr_barrier *barrier);
+
+/**
+ * Maximum number of released futures kept by a fiber context for reuse.
+ */
+#define FBR_FUTURE_POOL_SIZE 256
+
+/**
+ * Creates a future.
+ * @return new future with a reference count of one
+ *
+ * Future is a placeholder for a result of some operation (usually carried out
+ * by another fiber) that is completed exactly once, either with a value or
+ * with an error. Any number of fibers may wait for it.
+ *
+ * Released futures are kept by the fiber context for reuse (up to
+ * FBR_FUTURE_POOL_SIZE of them), so that creating one in a hot path does not
+ * allocate.
+ *
+ * @see fbr_future_retain
+ * @see fbr_future_release
+ * @see fbr_future_set
+ * @see fbr_future_wait
+ */
+struct fbr_future *fbr_future_create(FBR_P);
+
+/**
+ * Acquires a reference to a future.
+ * @param [in] future the future
+ *
+ * Typically the fiber completing the future and every fiber waiting for it
+ * hold a reference.
+ *
+ * @see fbr_future_release
+ */
+void fbr_future_retain(FBR_P_ struct fbr_future *future);
+
+/**
+ * Releases a reference to a future.
+ * @param [in] future the future
+ *
+ * The future is recycled once the last reference is released.
+ *
+ * @see fbr_future_retain
+ */
+void fbr_future_release(FBR_P_ struct fbr_future *future);
+
+/**
+ * Completes a future with a value.
+ * @param [in] future the future
+ * @param [in] value the result
+ * @return 0 on success, -1 with f_errno set to FBR_EINVAL if the future has
+ * already been completed
+ *
+ * All waiting fibers are woken up.
+ *
+ * @see fbr_future_set_error
+ * @see fbr_future_wait
+ */
+int fbr_future_set(FBR_P_ struct fbr_future *future, void *value);
+
+/**
+ * Completes a future with an error.
+ * @param [in] future the future
+ * @param [in] error application defined non-zero error code
+ * @return 0 on success, -1 with f_errno set to FBR_EINVAL if the future has
+ * already been completed or error is zero
+ *
+ * All waiting fibers are woken up.
+ *
+ * @see fbr_future_set
+ * @see fbr_future_error
+ */
+int fbr_future_set_error(FBR_P_ struct fbr_future *future, int error);
+
+/**
+ * Checks whether a future has been completed.
+ * @param [in] future the future
+ * @return 1 if completed, 0 otherwise
+ */
+int fbr_future_is_ready(FBR_P_ struct fbr_future *future);
+
+/**
+ * Returns the error a future has been completed with.
+ * @param [in] future the future
+ * @return error passed to fbr_future_set_error, 0 otherwise
+ */
+int fbr_future_error(FBR_P_ struct fbr_future *future);
+
+/**
+ * Waits for a future to be completed.
+ * @param [in] future the future
+ * @param [out] value receives the result (may be NULL)
+ * @param [in] timeout in seconds to wait, negative value means forever
+ * @return 0 on success, -1 with f_errno set upon failure
+ *
+ * Returns immediately if the future has already been completed.
+ *
+ * FBR_EFUTURE is reported if the future has been completed with an error (it
+ * can be obtained with fbr_future_error), FBR_ETIMEDOUT is reported upon
+ * timeout.
+ *
+ * @see fbr_future_set
+ * @see fbr_ev_future_init
+ */
+int fbr_future_wait(FBR_P_ struct fbr_future *future, void **value,
+		ev_tstamp timeout);
+
+/**
+ * Creates a channel.
+ * @param [in] elem_size size of a channel element in bytes
+ * @param [in] capacity number of elements buffered, 0 for an unbuffered
+ * channel
+ * @return pointer to the channel, NULL with f_errno set to FBR_EINVAL if
+ * elem_size is zero or the ring size does not fit into size_t
+ *
+ * Elements are copied by value into a ring of capacity elements allocated
+ * along with the channel, so passing messages does not allocate. On an
+ * unbuffered channel a sender and a receiver meet: the element is copied
+ * directly from one fiber to another.
+ *
+ * @see fbr_chan_send
+ * @see fbr_chan_recv
+ * @see fbr_select
+ * @see fbr_chan_destroy
+ */
+struct fbr_chan *fbr_chan_create(FBR_P_ size_t elem_size, size_t capacity);
+
+/**
+ * Sends an element to a channel.
+ * @param [in] chan the channel
+ * @param [in] elem element to copy, elem_size bytes
+ * @return 0 on success, -1 with f_errno set to FBR_ECLOSED if the channel is
+ * closed
+ *
+ * Blocks while the channel is full (or, for an unbuffered channel, until a
+ * receiver takes the element).
+ *
+ * @see fbr_chan_try_send
+ * @see fbr_select
+ */
+int fbr_chan_send(FBR_P_ struct fbr_chan *chan, const void *elem);
+
+/**
+ * Sends an element to a channel without blocking.
+ * @param [in] chan the channel
+ * @param [in] elem element to copy, elem_size bytes
+ * @return 1 if the element has been sent, 0 if sending would block, -1 with
+ * f_errno set to FBR_ECLOSED if the channel is closed
+ * @see fbr_chan_send
+ */
+int fbr_chan_try_send(FBR_P_ struct fbr_chan *chan, const void *elem);
+
+/**
+ * Receives an element from a channel.
+ * @param [in] chan the channel
+ * @param [out] elem buffer of elem_size bytes to receive into
+ * @return 0 on success, -1 with f_errno set to FBR_ECLOSED if the channel is
+ * closed and drained
+ *
+ * Elements sent before the channel has been closed are still delivered.
+ *
+ * @see fbr_chan_try_recv
+ * @see fbr_select
+ */
+int fbr_chan_recv(FBR_P_ struct fbr_chan *chan, void *elem);
+
+/**
+ * Receives an element from a channel without blocking.
+ * @param [in] chan the channel
+ * @param [out] elem buffer of elem_size bytes to receive into
+ * @return 1 if an element has been received, 0 if receiving would block, -1
+ * with f_errno set to FBR_ECLOSED if the channel is closed and drained
+ * @see fbr_chan_recv
+ */
+int fbr_chan_try_recv(FBR_P_ struct fbr_chan *chan, void *elem);
+
+/**
+ * Returns the number of elements buffered in a channel.
+ * @param [in] chan the channel
+ */
+size_t fbr_chan_len(FBR_P_ struct fbr_chan *chan);
+
+/**
+ * Closes a channel.
+ * @param [in] chan the channel
+ *
+ * All blocked senders fail with FBR_ECLOSED, blocked receivers fail as well
+ * once buffered elements are drained. Closing a closed channel is a no-op.
+ *
+ * @see fbr_ev_chan
+ */
+void fbr_chan_close(FBR_P_ struct fbr_chan *chan);
+
+/**
+ * Destroys a channel.
+ * @param [in] chan the channel
+ *
+ * No fiber may be waiting on the channel.
+ */
+void fbr_chan_destroy(FBR_P_ struct fbr_chan *chan);
+
+/**
+ * Waits for the first of several events.
+ * @param [in] events array of event base pointers terminated by NULL
+ * @param [in] timeout in seconds to wait, negative value means forever, zero
+ * means just poll
+ * @return index of the arrived event, -1 with f_errno set upon failure
+ *
+ * This is fbr_ev_wait with the semantics of a Go select statement: events are
+ * typically channel sends and receives (see fbr_ev_chan_init), but may be
+ * any other events, e.g. watchers for sockets or timers. At most one channel
+ * operation is performed per call; if several events are ready at once, the
+ * first one in the array wins.
+ *
+ * FBR_ETIMEDOUT is reported if nothing has arrived within the timeout,
+ * FBR_EINVAL is reported if one of the events is invalid.
+ * @see fbr_ev_chan
+ * @see fbr_ev_wait
+ */
+int fbr_select(FBR_P_ struct fbr_ev_base *events[], ev_tstamp timeout);
+
+/**
+ * Initializes a conditional variable.
+ *
+ * Conditional variable is useful primitive for fiber synchronisation. A set of
+ * fibers may be waiting until certain condition is met. Another fiber can
+ * trigger this condition for one or all waiting fibers.
+ *
+ * @see fbr_cond_destroy
+ * @see fbr_cond_wait
+ * @see fbr_cond_broadcast
+ * @see fbr_cond_signal
+ */
+void fbr_cond_init(FBR_P_ struct fbr_cond_var *cond);
+
+/**
+ * Destroys a conditional variable.
+ *
+ * This just frees used resources. No signals are sent to waiting fibers.
+ *
+ * @see fbr_cond_init
+ * @see fbr_cond_wait
+ * @see fbr_cond_broadcast
+ * @see fbr_cond_signal
+ */
+void fbr_cond_destroy(FBR_P_ struct fbr_cond_var *cond);
+
+/**
+ * Waits until condition is met.
+ *
+ * Current fiber is suspended until a signal is sent via fbr_cond_signal or
+ * fbr_cond_broadcast to the corresponding conditional variable.
+ *
+ * A mutex must be acquired by the calling fiber prior to waiting for a
+ * condition. Internally mutex is released and reacquired again before
+ * returning. Upon successful return calling fiber will hold the mutex.
+ *
+ * @see fbr_cond_init
+ * @see fbr_cond_destroy
+ * @see fbr_cond_broadcast
+ * @see fbr_cond_signal
+ */
+int fbr_cond_wait(FBR_P_ struct fbr_cond_var *cond, struct fbr_mutex *mutex);
+
+/**
+ * Waits until condition is met or timeout expires.
+ * @param [in] cond conditional variable
+ * @param [in] mutex mutex held by the calling fiber (may be NULL)
+ * @param [in] timeout in seconds to wait for the condition
+ * @return 0 on success, -1 with f_errno set upon failure
+ *
+ * Same as fbr_cond_wait, but gives up after timeout seconds. The mutex is
+ * reacquired before returning in both cases.
+ *
+ * FBR_ETIMEDOUT is reported upon timeout, FBR_EINVAL is reported if the mutex
+ * is not locked.
+ *
+ * @see fbr_cond_wait
+ */
+int fbr_cond_wait_wto(FBR_P_ struct fbr_cond_var *cond,
+		struct fbr_mutex *mutex, ev_tstamp timeout);
+
+/**
+ * Broadcasts a signal to all fibers waiting for condition.
+ *
+ * All fibers waiting for a condition will be added to run queue (and will
+ * eventually be run, one per event loop iteration).
+ *
+ * To avoid flooding the run queue when there are lots of waiters, at most
+ * FBR_COND_BROADCAST_BATCH of them are queued at once, and each woken fiber
+ * queues the next one when it runs. All the fibers are considered signaled at
+ * the time of the broadcast nonetheless, and the condition variable may be
+ * destroyed right after this function returns.
+ *
+ * @see fbr_cond_init
+ * @see fbr_cond_destroy
+ * @see fbr_cond_wait
+ * @see fbr_cond_signal
+ */
+void fbr_cond_broadcast(FBR_P_ struct fbr_cond_var *cond);
+
+/**
+ * Signals to first fiber waiting for a condition.
+ *
+ * Exactly one fiber (first one) waiting for a condition will be added to run
+ * queue (and will eventually be run, one per event loop iteration).
+ *
+ * @see fbr_cond_init
+ * @see fbr_cond_destroy
+ * @see fbr_cond_wait
+ * @see fbr_cond_signal
+ */
+void fbr_cond_signal(FBR_P_ struct fbr_cond_var *cond);
+
+/**
+ * Signals to a number of fibers waiting for a condition.
+ * @param [in] cond conditional variable
+ * @param [in] n maximum number of fibers to wake up
+ *
+ * Up to n first fibers waiting for a condition will be added to run queue.
+ *
+ * @see fbr_cond_signal
+ * @see fbr_cond_broadcast
+ */
+void fbr_cond_signal_n(FBR_P_ struct fbr_cond_var *cond, unsigned n);
+
+/**
+ * Initializes memory mappings.
+ * @param [in] vrb a pointer to fbr_vrb
+ * @param [in] size length of the data
+ * @param [in] file_pattern file name patterm for underlying mmap storage
+ * @returns 0 on succes, -1 on error.
+ *
+ * This function mmaps adjacent virtual memory regions of required size which
+ * correspond to the same physical memory region. Also it adds two page-sized
+ * regions on the left and on the right with PROT_NONE access as a guards.
+ *
+ * It does mmaps on the same anonymous memory file obtained via memfd_create,
+ * which is closed afterwards, so it will not pollute file descriptor space of
+ * a process. Only if memfd_create is not available, a file is created with
+ * file_pattern (e.g. under /dev/shm) and unlinked right away.
+ *
+ * @see struct fbr_vrb
+ * @see fbr_vrb_init_flags
+ * @see fbr_vrb_destroy
+ */
+int fbr_vrb_init(struct fbr_vrb *vrb, size_t size, const char *file_pattern);
+
+/**
+ * Flags for fbr_vrb_init_flags.
+ */
+enum fbr_vrb_flags {
+	FBR_VRB_HUGETLB = 1 << 0, /*!< back the mappings with explicit huge
+				    pages (memfd MFD_HUGETLB) when available,
+				    transparent ones otherwise */
+	FBR_VRB_RESIZABLE = 1 << 1, /*!< keep the backing file descriptor open
+				      so that fbr_vrb_resize works in place */
+};
+
+/**
+ * Initializes memory mappings with flags.
+ * @param [in] vrb a pointer to fbr_vrb
+ * @param [in] size length of the data
+ * @param [in] file_pattern file name patterm for underlying mmap storage
+ * @param [in] flags bitwise OR of fbr_vrb_flags
+ * @returns 0 on succes, -1 on error.
+ *
+ * Same as fbr_vrb_init. With FBR_VRB_HUGETLB, size is rounded up to the huge
+ * page size and the mappings are huge page aligned. If no huge pages can be
+ * obtained, regular pages are used instead, advised to be backed by
+ * transparent huge pages (MADV_HUGEPAGE) should the kernel allow it for
+ * shared memory.
+ *
+ * FBR_VRB_RESIZABLE trades a file descriptor per vrb for cheap resizing.
+ *
+ * @see fbr_vrb_init
+ */
+int fbr_vrb_init_flags(struct fbr_vrb *vrb, size_t size,
+		const char *file_pattern, unsigned flags);
+
+
+/**
+ * Destroys mappings.
+ * @param [in] vrb a pointer to fbr_vrb
+ *
+ * This function unmaps all the mappings done by fbr_vrb_init.
+ *
+ * @see fbr_vrb_init
+ */
+void fbr_vrb_destroy(struct fbr_vrb *vrb);
+
+/**
+ * Retrieves data length.
+ * @param [in] vrb a pointer to fbr_vrb
+ * @returns length of the data area.
+ *
+ * @see struct fbr_vrb
+ */
+static inline size_t fbr_vrb_data_len(struct fbr_vrb *vrb)
+{
+	return vrb->space_ptr - vrb->data_ptr;
+}
+
+/**
+ * Retrieves space length.
+ * @param [in] vrb a pointer to fbr_vrb
+ * @returns length of the space area.
+ *
+ * @see struct fbr_vrb
+ */
+static inline size_t fbr_vrb_space_len(struct fbr_vrb *vrb)
+{
+	return vrb->data_ptr + vrb->ptr_size - vrb->space_ptr;
+}
+
+/**
+ * Retrieves total buffer capacity.
+ * @param [in] vrb a pointer to fbr_vrb
+ * @returns maximum length of data this vrb can hold.
  *
  * @see struct fbr_vrb
  */
@@ -1718,10 +2729,6 @@ static inline void fbr_vrb_reset(struct fbr_vrb *vrb)
 	vrb->space_ptr = vrb->lower_ptr;
 }
 
-/* Private function */
-int fbr_vrb_resize_do(struct fbr_vrb *vrb, size_t new_size,
-		const char *file_pattern);
-
 /**
  * Resizes a vrb.
  * @param [in] vrb a pointer to fbr_vrb
@@ -1729,32 +2736,22 @@ int fbr_vrb_resize_do(struct fbr_vrb *vrb, size_t new_size,
  * @param [in] file_pattern file name patterm for underlying mmap storage
  * @returns 0 on succes, -1 on error.
  *
- * This function does new mappings and copies the data over. Old mappings will
- * be destroyed and all pointers to old data will be invalid after this
- * operation.
+ * The vrb both grows and shrinks, but never below the length of data it holds.
+ *
+ * A resizable vrb (see FBR_VRB_RESIZABLE) resizes its backing file and maps
+ * it again, so the data stays in place. Only the part of the data wrapped
+ * around the end of the ring is moved when growing, and only when shrinking
+ * past the data it is copied. Otherwise this function does new mappings and
+ * copies the data over.
+ *
+ * Either way old mappings will be destroyed and all pointers to old data will
+ * be invalid after this operation.
  *
  * @see struct fbr_vrb
  * @see fbr_vrb_init
  */
-static inline int fbr_vrb_resize(struct fbr_vrb *vrb, size_t new_size,
-		const char *file_pattern)
-{
-	struct fbr_vrb tmp;
-	int rv;
-	if (fbr_vrb_capacity(vrb) >= new_size)
-		return 0;
-	memcpy(&tmp, vrb, sizeof(tmp));
-	rv = fbr_vrb_init(vrb, new_size, file_pattern);
-	if (rv) {
-		memcpy(vrb, &tmp, sizeof(tmp));
-		return rv;
-	}
-	memcpy(fbr_vrb_space_ptr(vrb), fbr_vrb_data_ptr(&tmp),
-			fbr_vrb_data_len(&tmp));
-	fbr_vrb_give(vrb, fbr_vrb_data_len(&tmp));
-	fbr_vrb_destroy(&tmp);
-	return 0;
-}
+int fbr_vrb_resize(struct fbr_vrb *vrb, size_t new_size,
+		const char *file_pattern);
 
 
 /**
@@ -1767,9 +2764,55 @@ static inline int fbr_vrb_resize(struct fbr_vrb *vrb, size_t new_size,
  * read what you have written. The buffer will occupy size rounded up to page
  * size in physical memory, while occupying twice this size in virtual process
  * memory due to usage of two mirrored adjacent mmaps.
+ *
+ * Mappings of destroyed buffers are pooled by the fiber context, so that
+ * initializing a buffer of the same capacity reuses them instead of mapping
+ * new ones.
+ * @see fbr_buffer_pool_set_max
+ * @see fbr_buffer_init_flags
  */
 int fbr_buffer_init(FBR_P_ struct fbr_buffer *buffer, size_t size);
 
+/**
+ * Initializes a circular buffer with pipe semantics and vrb flags.
+ * @param [in] buffer fbr_buffer structure to initialize
+ * @param [in] size size hint for the buffer
+ * @param [in] flags bitwise OR of fbr_vrb_flags
+ * @returns 0 on succes, -1 upon failure with f_errno set.
+ *
+ * Same as fbr_buffer_init. Buffers which are expected to be resized should be
+ * created with FBR_VRB_RESIZABLE.
+ * @see fbr_vrb_init_flags
+ * @see fbr_buffer_resize
+ */
+int fbr_buffer_init_flags(FBR_P_ struct fbr_buffer *buffer, size_t size,
+		unsigned flags);
+
+/**
+ * Default limit of memory pooled for reuse by destroyed buffers.
+ * @see fbr_buffer_pool_set_max
+ */
+#define FBR_BUFFER_POOL_MAX_BYTES (32 * 1024 * 1024)
+
+/**
+ * Limits memory pooled for reuse by destroyed buffers.
+ * @param [in] max_bytes maximum total capacity of pooled buffers, 0 disables
+ * pooling
+ *
+ * Pooled buffers exceeding the new limit are unmapped right away.
+ * @see fbr_buffer_pool_trim
+ */
+void fbr_buffer_pool_set_max(FBR_P_ size_t max_bytes);
+
+/**
+ * Unmaps pooled buffers.
+ * @param [in] max_bytes total capacity of pooled buffers to keep
+ *
+ * Least recently pooled buffers of each capacity are unmapped first.
+ * @see fbr_buffer_pool_set_max
+ */
+void fbr_buffer_pool_trim(FBR_P_ size_t max_bytes);
+
 /**
  * Amount of bytes filled with data.
  * @param [in] buffer a pointer to fbr_buffer
@@ -1789,11 +2832,13 @@ static inline size_t fbr_buffer_bytes(FBR_PU_ struct fbr_buffer *buffer)
  * @returns number of free bytes in the buffer
  *
  * This function can be used to check if fbr_buffer_alloc_prepare will block.
+ * Bytes held by outstanding reservations are not free.
  * @see fbr_buffer_bytes
+ * @see fbr_buffer_reserve
  */
 static inline size_t fbr_buffer_free_bytes(FBR_PU_ struct fbr_buffer *buffer)
 {
-	return fbr_vrb_space_len(&buffer->vrb);
+	return fbr_vrb_space_len(&buffer->vrb) - buffer->reserved_bytes;
 }
 
 /**
@@ -1916,15 +2961,53 @@ void *fbr_buffer_alloc_prepare(FBR_P_ struct fbr_buffer *buffer, size_t size);
 void fbr_buffer_alloc_commit(FBR_P_ struct fbr_buffer *buffer);
 
 /**
- * Aborts a chunk of memory in the buffer.
+ * Aborts a chunk of memory in the buffer.
+ * @param [in] buffer a pointer to fbr_buffer
+ *
+ * This function aborts prepared chunk of memory previously reserved. It will
+ * not be committed and the next fiber may reuse it for it's own purposes.
+ * @see fbr_buffer_alloc_prepare
+ * @see fbr_buffer_alloc_commit
+ */
+void fbr_buffer_alloc_abort(FBR_P_ struct fbr_buffer *buffer);
+
+/**
+ * Reserves a chunk of memory without excluding other writers.
+ * @param [in] buffer a pointer to fbr_buffer
+ * @param [in] rsv reservation to fill in
+ * @param [in] size required size
+ * @returns pointer to memory reserved for commit, NULL upon failure with
+ * f_errno set.
+ *
+ * Unlike fbr_buffer_alloc_prepare this function does not keep the write mutex
+ * locked until commit, so any number of fibers may hold disjoint reservations
+ * at the same time and fill them in any order. Reservations are laid out in
+ * the order they were made and become visible to readers in that order: a
+ * committed reservation is published only once all reservations made before
+ * it are committed as well.
+ *
+ * Blocks current fiber until size free bytes are available. Every reservation
+ * must eventually be committed, as later reservations can not be published
+ * before it. fbr_buffer_alloc_prepare and fbr_buffer_resize wait until there
+ * are no outstanding reservations.
+ *
+ * FBR_EINVAL is reported if size exceeds buffer capacity.
+ * @see fbr_buffer_reserve_commit
+ */
+void *fbr_buffer_reserve(FBR_P_ struct fbr_buffer *buffer,
+		struct fbr_buffer_rsv *rsv, size_t size);
+
+/**
+ * Commits a reservation.
  * @param [in] buffer a pointer to fbr_buffer
+ * @param [in] rsv reservation obtained with fbr_buffer_reserve
  *
- * This function aborts prepared chunk of memory previously reserved. It will
- * not be committed and the next fiber may reuse it for it's own purposes.
- * @see fbr_buffer_alloc_prepare
- * @see fbr_buffer_alloc_commit
+ * Publishes this and all following committed reservations, provided that no
+ * earlier reservation is still outstanding. Never blocks.
+ * @see fbr_buffer_reserve
  */
-void fbr_buffer_alloc_abort(FBR_P_ struct fbr_buffer *buffer);
+void fbr_buffer_reserve_commit(FBR_P_ struct fbr_buffer *buffer,
+		struct fbr_buffer_rsv *rsv);
 
 /**
  * Aborts a chunk of memory in the buffer.
@@ -1963,17 +3046,63 @@ void fbr_buffer_read_advance(FBR_P_ struct fbr_buffer *buffer);
  */
 void fbr_buffer_read_discard(FBR_P_ struct fbr_buffer *buffer);
 
+/**
+ * Reads from a file descriptor directly into the buffer.
+ * @param [in] buffer a pointer to fbr_buffer
+ * @param [in] fd file descriptor to read from
+ * @param [in] max maximum number of bytes to read
+ * @param [in] timeout in seconds to wait for fd to become readable, negative
+ * value means forever
+ * @returns number of bytes read (0 upon end of file), -1 upon failure with
+ * f_errno set.
+ *
+ * Waits until there is free space in the buffer, then does a single read(2)
+ * of at most max bytes straight into the free space, which is contiguous
+ * thanks to the mirrored mapping, and commits what has been read.
+ *
+ * This function acquires the write mutex for the duration of the call.
+ *
+ * FBR_ETIMEDOUT is reported if fd has not become readable within the timeout,
+ * FBR_ESYSTEM is reported if read(2) fails (consult errno).
+ * @see fbr_buffer_write_to_fd
+ */
+ssize_t fbr_buffer_read_from_fd(FBR_P_ struct fbr_buffer *buffer, int fd,
+		size_t max, ev_tstamp timeout);
+
+/**
+ * Writes data from the buffer directly to a file descriptor.
+ * @param [in] buffer a pointer to fbr_buffer
+ * @param [in] fd file descriptor to write to
+ * @param [in] max maximum number of bytes to write
+ * @param [in] timeout in seconds to wait for fd to become writable, negative
+ * value means forever
+ * @returns number of bytes written, -1 upon failure with f_errno set.
+ *
+ * Waits until there is data in the buffer, then does a single write(2) of at
+ * most max bytes straight from the data area and frees what has been written.
+ *
+ * This function acquires the read mutex for the duration of the call.
+ *
+ * FBR_ETIMEDOUT is reported if fd has not become writable within the timeout,
+ * FBR_ESYSTEM is reported if write(2) fails (consult errno).
+ * @see fbr_buffer_read_from_fd
+ */
+ssize_t fbr_buffer_write_to_fd(FBR_P_ struct fbr_buffer *buffer, int fd,
+		size_t max, ev_tstamp timeout);
+
 /**
  * Resizes the buffer.
  * @param [in] buffer a pointer to fbr_buffer
  * @param [in] size a new buffer length
  * @returns 0 on success, -1 on error.
  *
- * This function allocates new memory mapping of sufficient size and copies the
- * content of a buffer into it. Old mapping is destroyed.
+ * The buffer grows or shrinks, but never below the length of data it holds.
+ * See fbr_vrb_resize for details: buffers created with FBR_VRB_RESIZABLE are
+ * resized in place, others get a new memory mapping with the content of a
+ * buffer copied into it.
  *
- * This operation is expensive and involves several syscalls, so it is
- * beneficiary to allocate a buffer of siffucuent size from the start.
+ * This operation involves several syscalls, so it is beneficiary to allocate
+ * a buffer of siffucuent size from the start.
  *
  * This function acquires both read and write mutex, and may block until read
  * or write operation has finished.
@@ -2086,16 +3215,622 @@ static inline int fbr_buffer_can_write(FBR_P_ struct fbr_buffer *buffer,
 	return fbr_buffer_free_bytes(FBR_A_ buffer) >= size;
 }
 
+/**
+ * Initializes a buffer shared between processes.
+ * @param [in] ipc fbr_ipc_buffer structure to initialize
+ * @param [in] size size hint for the buffer
+ * @returns 0 on succes, -1 upon failure with f_errno set.
+ *
+ * Intended to be initialized before fork(2), after which one process writes
+ * to the buffer and the other one reads from it, each using its own fiber
+ * context. Any number of fibers of the writing process may write, as may any
+ * number of fibers of the reading process read; having writers or readers in
+ * both processes is not supported.
+ *
+ * Data is copied into the shared mapping once, by the writer, and read in
+ * place by the reader. The read and write indices are updated atomically in
+ * the shared memory, a fiber waiting for data or space parks on an eventfd
+ * (a pipe where eventfd is not available) watched by its event loop, which the
+ * other side signals only when it is known to be parked.
+ *
+ * FBR_EBUFFERMMAP is reported if shared memory can not be set up, FBR_ESYSTEM
+ * if wakeup descriptors can not be created.
+ * @see fbr_ipc_buffer_destroy
+ */
+int fbr_ipc_buffer_init(FBR_P_ struct fbr_ipc_buffer *ipc, size_t size);
+
+/**
+ * Destroys a buffer shared between processes.
+ * @param [in] ipc a pointer to fbr_ipc_buffer
+ *
+ * Unmaps the buffer and closes its descriptors in the calling process only;
+ * each of the processes should destroy its copy.
+ */
+void fbr_ipc_buffer_destroy(FBR_P_ struct fbr_ipc_buffer *ipc);
+
+/**
+ * Total capacity of a buffer shared between processes.
+ * @param [in] ipc a pointer to fbr_ipc_buffer
+ * @returns maximum number of bytes the buffer may contain.
+ */
+size_t fbr_ipc_buffer_size(FBR_P_ struct fbr_ipc_buffer *ipc);
+
+/**
+ * Amount of bytes filled with data.
+ * @param [in] ipc a pointer to fbr_ipc_buffer
+ * @returns number of bytes written to the buffer
+ */
+size_t fbr_ipc_buffer_bytes(FBR_P_ struct fbr_ipc_buffer *ipc);
+
+/**
+ * Amount of free bytes.
+ * @param [in] ipc a pointer to fbr_ipc_buffer
+ * @returns number of free bytes in the buffer
+ */
+size_t fbr_ipc_buffer_free_bytes(FBR_P_ struct fbr_ipc_buffer *ipc);
+
+/**
+ * Prepares a chunk of memory to be committed to buffer.
+ * @param [in] ipc a pointer to fbr_ipc_buffer
+ * @param [in] size required size
+ * @returns pointer to memory reserved for commit, NULL upon failure with
+ * f_errno set.
+ *
+ * Blocks current fiber until size bytes are free. Other writer fibers are
+ * blocked until this one commits or aborts.
+ *
+ * FBR_EINVAL is reported if size exceeds buffer capacity.
+ * @see fbr_buffer_alloc_prepare
+ * @see fbr_ipc_buffer_alloc_commit
+ * @see fbr_ipc_buffer_alloc_abort
+ */
+void *fbr_ipc_buffer_alloc_prepare(FBR_P_ struct fbr_ipc_buffer *ipc,
+		size_t size);
+
+/**
+ * Commits a chunk of memory to the buffer.
+ * @param [in] ipc a pointer to fbr_ipc_buffer
+ *
+ * Makes the chunk visible to the reading process, waking it up if it waits.
+ * @see fbr_ipc_buffer_alloc_prepare
+ */
+void fbr_ipc_buffer_alloc_commit(FBR_P_ struct fbr_ipc_buffer *ipc);
+
+/**
+ * Aborts a chunk of memory in the buffer.
+ * @param [in] ipc a pointer to fbr_ipc_buffer
+ * @see fbr_ipc_buffer_alloc_prepare
+ */
+void fbr_ipc_buffer_alloc_abort(FBR_P_ struct fbr_ipc_buffer *ipc);
+
+/**
+ * Reserves a chunk of data for reading.
+ * @param [in] ipc a pointer to fbr_ipc_buffer
+ * @param [in] size number of bytes required
+ * @returns read address containing size bytes, NULL upon failure with f_errno
+ * set.
+ *
+ * Blocks current fiber until size bytes are available. Other reader fibers
+ * are blocked until this one advances or discards.
+ *
+ * FBR_EINVAL is reported if size exceeds buffer capacity.
+ * @see fbr_buffer_read_address
+ * @see fbr_ipc_buffer_read_advance
+ * @see fbr_ipc_buffer_read_discard
+ */
+void *fbr_ipc_buffer_read_address(FBR_P_ struct fbr_ipc_buffer *ipc,
+		size_t size);
+
+/**
+ * Confirms a read of chunk of memory in the buffer.
+ * @param [in] ipc a pointer to fbr_ipc_buffer
+ *
+ * Frees the chunk for the writing process, waking it up if it waits.
+ * @see fbr_ipc_buffer_read_address
+ */
+void fbr_ipc_buffer_read_advance(FBR_P_ struct fbr_ipc_buffer *ipc);
+
+/**
+ * Discards a read of chunk of memory in the buffer.
+ * @param [in] ipc a pointer to fbr_ipc_buffer
+ * @see fbr_ipc_buffer_read_address
+ */
+void fbr_ipc_buffer_read_discard(FBR_P_ struct fbr_ipc_buffer *ipc);
+
+/**
+ * Creates a message queue of pointers.
+ * @param [in] size minimum capacity, rounded up to a power of two
+ * @param [in] flags reserved
+ * @return pointer to the queue, NULL with f_errno set to FBR_EINVAL if the
+ * rounded up capacity does not fit into memory
+ *
+ * Waiting fibers are only woken up when the queue goes from empty to
+ * non-empty or from full to non-full.
+ */
 struct fbr_mq *fbr_mq_create(FBR_P_ size_t size, int flags);
 void fbr_mq_push(struct fbr_mq *mq, void *obj);
 int fbr_mq_try_push(struct fbr_mq *mq, void *obj);
+
+/**
+ * Pushes a batch of pointers to a message queue.
+ * @param [in] mq message queue
+ * @param [in] objs array of pointers to push
+ * @param [in] n number of pointers in objs
+ * @return number of pointers pushed
+ *
+ * Waits until there is some room in the queue, then pushes as many of objs
+ * as fit (at least one, unless n is 0), waking up consumers at most once.
+ */
+size_t fbr_mq_push_n(struct fbr_mq *mq, void **objs, size_t n);
 void fbr_mq_wait_push(struct fbr_mq *mq);
 void *fbr_mq_pop(struct fbr_mq *mq);
 int fbr_mq_try_pop(struct fbr_mq *mq, void **obj);
+
+/**
+ * Pops a batch of pointers from a message queue.
+ * @param [in] mq message queue
+ * @param [out] objs array receiving up to n pointers
+ * @param [in] n size of objs
+ * @return number of pointers popped
+ *
+ * Waits until the queue is non-empty, then pops up to n pointers, waking up
+ * producers at most once.
+ */
+size_t fbr_mq_pop_n(struct fbr_mq *mq, void **objs, size_t n);
 void fbr_mq_wait_pop(struct fbr_mq *mq);
 void fbr_mq_clear(struct fbr_mq *mq, int wake_up_writers);
 void fbr_mq_destroy(struct fbr_mq *mq);
 
+struct fbr_xmq;
+
+/**
+ * Creates a cross-thread message queue of pointers.
+ * @param [in] size capacity, rounded up to a power of two
+ * @return pointer to the queue, NULL with f_errno set to FBR_EINVAL if the
+ * rounded up capacity does not fit into memory
+ *
+ * Unlike fbr_mq, this queue can be pushed to from any thread, while a single
+ * fiber of the context it has been created in consumes it. The queue is
+ * bounded and lock-free: a push costs one compare-and-swap. The consumer
+ * fiber parks on an ev_async watcher when the queue is empty, and only a
+ * push which finds it parked pays for the wakeup.
+ *
+ * @see fbr_xmq_push
+ * @see fbr_xmq_pop
+ * @see fbr_xmq_destroy
+ */
+struct fbr_xmq *fbr_xmq_create(FBR_P_ size_t size);
+
+/**
+ * Pushes a pointer to a cross-thread message queue.
+ * @param [in] xmq cross-thread message queue
+ * @param [in] obj pointer to push
+ * @return 0 on success, -1 if the queue is full
+ *
+ * May be called from any thread, never blocks.
+ */
+int fbr_xmq_push(struct fbr_xmq *xmq, void *obj);
+
+/**
+ * Pops a pointer from a cross-thread message queue.
+ * @param [in] xmq cross-thread message queue
+ * @return popped pointer
+ *
+ * Waits until the queue is non-empty. Must be called from a fiber of the
+ * context the queue has been created in, only one fiber may consume a queue.
+ */
+void *fbr_xmq_pop(struct fbr_xmq *xmq);
+
+/**
+ * Pops a pointer from a cross-thread message queue without waiting.
+ * @param [in] xmq cross-thread message queue
+ * @param [out] obj popped pointer
+ * @return 0 on success, -1 if the queue is empty
+ */
+int fbr_xmq_try_pop(struct fbr_xmq *xmq, void **obj);
+
+/**
+ * Pops a batch of pointers from a cross-thread message queue.
+ * @param [in] xmq cross-thread message queue
+ * @param [out] objs array receiving up to n pointers
+ * @param [in] n size of objs
+ * @return number of pointers popped
+ *
+ * Waits until the queue is non-empty, then pops up to n pointers.
+ */
+size_t fbr_xmq_pop_n(struct fbr_xmq *xmq, void **objs, size_t n);
+
+/**
+ * Destroys a cross-thread message queue.
+ * @param [in] xmq cross-thread message queue
+ *
+ * No thread may be pushing to the queue any more. Pointers left in the queue
+ * are discarded.
+ */
+void fbr_xmq_destroy(struct fbr_xmq *xmq);
+
+struct fbr_xbuffer;
+
+/**
+ * Creates a cross-thread buffer.
+ * @param [in] size size hint for the buffer
+ * @return pointer to the buffer, NULL upon failure with f_errno set.
+ *
+ * A single-producer/single-consumer variant of fbr_buffer for streaming
+ * bytes from a fiber of one thread to a fiber of another one, each running
+ * its own fiber context. Read and write indices are atomics on separate cache
+ * lines, no locks are taken. A side which has to wait parks its fiber on an
+ * ev_async watcher of its own loop, and the other side only signals it when
+ * it actually is parked.
+ *
+ * Exactly one fiber may write to the buffer and exactly one fiber may read
+ * from it at any given time.
+ *
+ * FBR_EBUFFERMMAP is reported if the ring can not be mapped.
+ * @see fbr_xbuffer_alloc_prepare
+ * @see fbr_xbuffer_read_address
+ * @see fbr_xbuffer_destroy
+ */
+struct fbr_xbuffer *fbr_xbuffer_create(FBR_P_ size_t size);
+
+/**
+ * Total capacity of a cross-thread buffer.
+ * @param [in] xbuffer cross-thread buffer
+ * @return maximum number of bytes the buffer may contain
+ */
+size_t fbr_xbuffer_size(struct fbr_xbuffer *xbuffer);
+
+/**
+ * Amount of bytes filled with data.
+ * @param [in] xbuffer cross-thread buffer
+ * @return number of committed bytes: a lower bound for the reader, which may
+ * miss the latest commits, and an upper bound for the writer, which may miss
+ * the latest reads
+ */
+size_t fbr_xbuffer_bytes(struct fbr_xbuffer *xbuffer);
+
+/**
+ * Amount of free bytes.
+ * @param [in] xbuffer cross-thread buffer
+ * @return number of free bytes: a lower bound for the writer, which may miss
+ * the latest reads, and an upper bound for the reader, which may miss the
+ * latest commits
+ */
+size_t fbr_xbuffer_free_bytes(struct fbr_xbuffer *xbuffer);
+
+/**
+ * Prepares a chunk of memory to be committed to a cross-thread buffer.
+ * @param [in] xbuffer cross-thread buffer
+ * @param [in] size required size
+ * @returns pointer to memory reserved for commit, NULL upon failure with
+ * f_errno set.
+ *
+ * Waits until size bytes are free. May only be called by the writing fiber.
+ *
+ * FBR_EINVAL is reported if size exceeds buffer capacity.
+ * @see fbr_xbuffer_alloc_commit
+ */
+void *fbr_xbuffer_alloc_prepare(FBR_P_ struct fbr_xbuffer *xbuffer,
+		size_t size);
+
+/**
+ * Commits a chunk of memory to a cross-thread buffer.
+ * @param [in] xbuffer cross-thread buffer
+ *
+ * Publishes the chunk to the reader, waking it up if it waits.
+ * @see fbr_xbuffer_alloc_prepare
+ */
+void fbr_xbuffer_alloc_commit(struct fbr_xbuffer *xbuffer);
+
+/**
+ * Reserves a chunk of data of a cross-thread buffer for reading.
+ * @param [in] xbuffer cross-thread buffer
+ * @param [in] size number of bytes required
+ * @returns read address containing size bytes, NULL upon failure with f_errno
+ * set.
+ *
+ * Waits until size bytes are committed. May only be called by the reading
+ * fiber.
+ *
+ * FBR_EINVAL is reported if size exceeds buffer capacity.
+ * @see fbr_xbuffer_read_advance
+ */
+void *fbr_xbuffer_read_address(FBR_P_ struct fbr_xbuffer *xbuffer,
+		size_t size);
+
+/**
+ * Confirms a read of chunk of memory in a cross-thread buffer.
+ * @param [in] xbuffer cross-thread buffer
+ *
+ * Frees the chunk for the writer, waking it up if it waits.
+ * @see fbr_xbuffer_read_address
+ */
+void fbr_xbuffer_read_advance(struct fbr_xbuffer *xbuffer);
+
+/**
+ * Destroys a cross-thread buffer.
+ * @param [in] xbuffer cross-thread buffer
+ *
+ * Neither side may be using the buffer any more.
+ */
+void fbr_xbuffer_destroy(struct fbr_xbuffer *xbuffer);
+
+/**
+ * Size of a memory segment of fbr_iobuf chains, including its header.
+ */
+#define FBR_IOBUF_SEG_SIZE 16384
+
+/**
+ * Maximum number of released fbr_iobuf segments (and, separately, chain
+ * nodes) cached by a context for reuse.
+ */
+#define FBR_IOBUF_POOL_SIZE 256
+
+struct fbr_iobuf_node;
+TAILQ_HEAD(fbr_iobuf_node_tailq, fbr_iobuf_node);
+
+/**
+ * Scatter-gather chain of buffer segments.
+ *
+ * A chain is a list of views into reference counted fixed size memory
+ * segments (FBR_IOBUF_SEG_SIZE). Data is copied once when appended, all the
+ * other operations (concatenation, splitting, cloning, trimming) move or
+ * share views without touching the data. Unlike fbr_buffer it has no
+ * capacity limit, and unlike fbr_buffer it is not an inter-fiber
+ * communication mechanism: a chain is owned by one fiber at a time.
+ *
+ * Released segments are cached by the context (up to FBR_IOBUF_POOL_SIZE).
+ * @see fbr_iobuf_init
+ * @see fbr_iobuf_iov
+ */
+struct fbr_iobuf {
+	struct fbr_iobuf_node_tailq nodes;
+	size_t len;
+	int n_nodes;
+};
+
+/**
+ * Initializes an empty chain.
+ * @param [in] iobuf chain to initialize
+ * @see fbr_iobuf_destroy
+ */
+void fbr_iobuf_init(FBR_P_ struct fbr_iobuf *iobuf);
+
+/**
+ * Destroys a chain.
+ * @param [in] iobuf chain to destroy
+ *
+ * Releases all segment references of the chain, which is left empty and may
+ * be reused.
+ */
+void fbr_iobuf_destroy(FBR_P_ struct fbr_iobuf *iobuf);
+
+/**
+ * Length of a chain.
+ * @param [in] iobuf chain
+ * @returns number of bytes in the chain
+ */
+static inline size_t fbr_iobuf_len(struct fbr_iobuf *iobuf)
+{
+	return iobuf->len;
+}
+
+/**
+ * Appends a copy of data to a chain.
+ * @param [in] iobuf chain
+ * @param [in] data data to append
+ * @param [in] len length of data
+ *
+ * Fills the room left in the last segment first, provided that no other
+ * chain has appended to it since, then takes as many new segments as needed.
+ */
+void fbr_iobuf_append(FBR_P_ struct fbr_iobuf *iobuf, const void *data,
+		size_t len);
+
+/**
+ * Moves the contents of one chain to the end of another.
+ * @param [in] iobuf chain to append to
+ * @param [in] other chain to move from, left empty
+ */
+void fbr_iobuf_concat(FBR_P_ struct fbr_iobuf *iobuf,
+		struct fbr_iobuf *other);
+
+/**
+ * Splits a chain in two.
+ * @param [in] iobuf chain to split
+ * @param [in] at number of bytes to keep in iobuf
+ * @param [out] tail initialized chain receiving the bytes past at
+ * @returns 0 on success, -1 upon failure with f_errno set.
+ *
+ * A segment straddling the split point ends up shared by both chains.
+ *
+ * FBR_EINVAL is reported if at exceeds chain length.
+ */
+int fbr_iobuf_split(FBR_P_ struct fbr_iobuf *iobuf, size_t at,
+		struct fbr_iobuf *tail);
+
+/**
+ * Clones a chain.
+ * @param [in] iobuf chain to clone
+ * @param [out] clone initialized chain receiving a copy of iobuf
+ *
+ * Both chains share all the segments afterwards, no data is copied.
+ */
+void fbr_iobuf_clone(FBR_P_ struct fbr_iobuf *iobuf, struct fbr_iobuf *clone);
+
+/**
+ * Drops bytes from the start of a chain.
+ * @param [in] iobuf chain
+ * @param [in] len number of bytes to drop, the whole chain at most
+ *
+ * Typically used to consume bytes written with writev(2).
+ */
+void fbr_iobuf_trim_front(FBR_P_ struct fbr_iobuf *iobuf, size_t len);
+
+/**
+ * Drops bytes from the end of a chain.
+ * @param [in] iobuf chain
+ * @param [in] len number of bytes to drop, the whole chain at most
+ */
+void fbr_iobuf_trim_back(FBR_P_ struct fbr_iobuf *iobuf, size_t len);
+
+/**
+ * Copies bytes from the start of a chain without consuming them.
+ * @param [in] iobuf chain
+ * @param [out] buf destination
+ * @param [in] len number of bytes to copy
+ * @returns number of bytes copied, less than len if the chain is shorter.
+ *
+ * Useful for parsing a frame header which may span segments.
+ */
+size_t fbr_iobuf_peek(struct fbr_iobuf *iobuf, void *buf, size_t len);
+
+/**
+ * Fills an iovec array with views of a chain.
+ * @param [in] iobuf chain
+ * @param [out] iov array to fill
+ * @param [in] iovcnt size of iov
+ * @returns number of iov elements filled.
+ *
+ * The result may be passed to writev(2) or sendmsg(2) directly, followed by
+ * fbr_iobuf_trim_front with the number of bytes written. If the chain
+ * consists of more than iovcnt views, only the first iovcnt are filled in.
+ */
+int fbr_iobuf_iov(struct fbr_iobuf *iobuf, struct iovec *iov, int iovcnt);
+
+struct fbr_conn_pool;
+struct fbr_conn;
+
+/**
+ * Creates a pool of outbound connections.
+ * @param [in] max_conns maximum number of connections per address (both idle
+ * and lent out)
+ * @param [in] idle_timeout number of seconds an idle connection is kept in
+ * the pool before being closed
+ * @return the pool on success, NULL upon failure with f_errno set
+ *
+ * Pool keeps connected TCP sockets keyed by remote address and lends them out
+ * to fibers, so that the connection handshake is paid only once per
+ * connection instead of once per request.
+ * @see fbr_conn_pool_get
+ * @see fbr_conn_pool_put
+ * @see fbr_conn_pool_destroy
+ */
+struct fbr_conn_pool *fbr_conn_pool_create(FBR_P_ size_t max_conns,
+		ev_tstamp idle_timeout);
+
+/**
+ * Borrows a connection to the given address from the pool.
+ * @param [in] pool the pool
+ * @param [in] addr remote address
+ * @param [in] addrlen size of addr
+ * @param [in] timeout maximum number of seconds to wait for a free slot and to
+ * establish a connection, negative value means no timeout
+ * @return connection on success, NULL upon failure with f_errno set
+ *
+ * Most recently returned idle connection is preferred. Before it is lent out,
+ * it's checked not to be closed by the peer and not to have any unread data
+ * pending; connections failing the check are closed. If there are no idle
+ * connections and the limit for the address is not reached, a new non-blocking
+ * connection is established. Otherwise the calling fiber is suspended until
+ * some other fiber returns a connection.
+ *
+ * FBR_ETIMEDOUT is reported if timeout expires, FBR_ESYSTEM is reported with
+ * errno set if connection can not be established.
+ * @see fbr_conn_pool_put
+ * @see fbr_conn_fd
+ */
+struct fbr_conn *fbr_conn_pool_get(FBR_P_ struct fbr_conn_pool *pool,
+		const struct sockaddr *addr, socklen_t addrlen,
+		ev_tstamp timeout);
+
+/**
+ * Returns the socket of a borrowed connection.
+ * @param [in] conn connection
+ * @return socket file descriptor
+ */
+int fbr_conn_fd(struct fbr_conn *conn);
+
+/**
+ * Returns a borrowed connection to the pool.
+ * @param [in] pool the pool
+ * @param [in] conn connection obtained from fbr_conn_pool_get
+ * @param [in] reuse if zero, the connection is closed instead of being kept
+ * for reuse (i.e. after an I/O error or a protocol violation)
+ *
+ * One fiber waiting for a connection to the same address is woken up.
+ * @see fbr_conn_pool_get
+ */
+void fbr_conn_pool_put(FBR_P_ struct fbr_conn_pool *pool,
+		struct fbr_conn *conn, int reuse);
+
+/**
+ * Closes all idle connections and destroys the pool.
+ * @param [in] pool the pool
+ *
+ * All borrowed connections must be returned before the pool is destroyed.
+ */
+void fbr_conn_pool_destroy(FBR_P_ struct fbr_conn_pool *pool);
+
+/**
+ * Default number of seconds successful name resolution results are cached
+ * for.
+ * @see fbr_getaddrinfo_set_ttl
+ */
+#define FBR_DNS_POSITIVE_TTL 30.
+/**
+ * Default number of seconds failed (non-existent name) name resolution
+ * results are cached for.
+ * @see fbr_getaddrinfo_set_ttl
+ */
+#define FBR_DNS_NEGATIVE_TTL 5.
+
+/**
+ * Fiber friendly getaddrinfo.
+ * @param [in] node as in getaddrinfo(3)
+ * @param [in] service as in getaddrinfo(3)
+ * @param [in] hints as in getaddrinfo(3)
+ * @param [out] res result list, to be freed with fbr_freeaddrinfo
+ * @return 0 on success, EAI_* error code otherwise (errno is set for
+ * EAI_SYSTEM), see getaddrinfo(3)
+ *
+ * Name resolution is performed by a small pool of resolver threads owned by
+ * the fiber context (started upon the first call), so only the calling fiber
+ * is suspended while the event loop keeps running. Concurrent lookups of the
+ * same name share a single request.
+ *
+ * Results are cached within the context: successful ones for
+ * FBR_DNS_POSITIVE_TTL seconds, non-existent names for FBR_DNS_NEGATIVE_TTL
+ * seconds. Temporary failures are not cached. Since getaddrinfo does not
+ * expose record TTLs, these are fixed and can be changed with
+ * fbr_getaddrinfo_set_ttl.
+ * @see fbr_freeaddrinfo
+ */
+int fbr_getaddrinfo(FBR_P_ const char *node, const char *service,
+		const struct addrinfo *hints, struct addrinfo **res);
+
+/**
+ * Frees the result of fbr_getaddrinfo.
+ * @param [in] res result list
+ *
+ * Note that plain freeaddrinfo must not be used for the list returned by
+ * fbr_getaddrinfo.
+ */
+void fbr_freeaddrinfo(FBR_P_ struct addrinfo *res);
+
+/**
+ * Sets name resolution cache TTLs.
+ * @param [in] positive_ttl number of seconds successful results are cached
+ * for, 0 disables caching of them
+ * @param [in] negative_ttl number of seconds non-existent name results are
+ * cached for, 0 disables caching of them
+ *
+ * Only affects results obtained after the call.
+ * @see fbr_getaddrinfo
+ */
+void fbr_getaddrinfo_set_ttl(FBR_P_ ev_tstamp positive_ttl,
+		ev_tstamp negative_ttl);
+
 /**
  * Gets fiber user data pointer.
  * @param [in] id fiber id
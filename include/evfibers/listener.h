@@ -0,0 +1,97 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#ifndef _FBR_LISTENER_H_
+#define _FBR_LISTENER_H_
+/**
+ * @file evfibers/listener.h
+ * This file contains API for the sharded multi-threaded TCP listener.
+ *
+ * Listener runs a number of worker threads, each one with its own event loop,
+ * fiber context and acceptor fiber. Every worker accepts on its own
+ * SO_REUSEPORT socket, so the kernel spreads incoming connections among
+ * workers and there is no shared accept queue to contend on.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <evfibers/fiber.h>
+
+/**
+ * Maximum number of connections a worker accepts per wake up.
+ */
+#define FBR_LISTENER_BUDGET 64
+
+/**
+ * Listener flags.
+ * @see fbr_listener_create
+ */
+enum fbr_listener_flags {
+	FBR_LISTENER_PIN_CPU = 1 << 0, /*!< pin worker threads to CPUs */
+};
+
+struct fbr_listener;
+
+/**
+ * Creates a sharded listener and starts its workers.
+ * @param [in] addr address to listen on, port 0 selects a random port which
+ * is shared by all workers
+ * @param [in] addrlen size of addr
+ * @param [in] workers number of worker threads, 0 means number of online CPUs
+ * @param [in] flags bitwise OR of fbr_listener_flags
+ * @param [in] handler connection handler
+ * @param [in] arg argument passed to handler
+ * @return listener on success, NULL in case of error and errno set
+ *
+ * Handler is the same as one used with fbr_accept_spawn in a single-threaded
+ * server: it is called in a fresh fiber for every connection and owns the
+ * client socket, which is in non-blocking mode. Note that it runs in the
+ * worker thread and gets the fiber context of that worker, so anything
+ * shared via arg has to be thread-safe.
+ *
+ * If SO_REUSEPORT is not supported by the platform, all workers accept on a
+ * single shared socket.
+ * @see fbr_listener_destroy
+ * @see fbr_accept_spawn
+ */
+struct fbr_listener *fbr_listener_create(const struct sockaddr *addr,
+		socklen_t addrlen, unsigned workers, int flags,
+		fbr_accept_handler_t handler, void *arg);
+
+/**
+ * Retrieves the address the listener is bound to.
+ * @param [in] listener listener
+ * @param [out] addr address buffer
+ * @param [in,out] addrlen size of addr
+ * @return 0 on success, -1 in case of error and errno set
+ *
+ * Useful to find out the port when listener was created with port 0.
+ */
+int fbr_listener_sockname(struct fbr_listener *listener,
+		struct sockaddr *addr, socklen_t *addrlen);
+
+/**
+ * Stops all workers and frees the listener.
+ * @param [in] listener listener
+ *
+ * Waits for worker threads to finish. Connection handlers still running in
+ * the workers are reclaimed along with the worker fiber contexts.
+ * @see fbr_listener_create
+ */
+void fbr_listener_destroy(struct fbr_listener *listener);
+
+#endif
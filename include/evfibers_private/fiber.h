@@ -23,6 +23,9 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netdb.h>
 #include <sys/queue.h>
 #include <evfibers/fiber.h>
 #include <evfibers_private/trace.h>
@@ -129,15 +132,35 @@
 	} while (0)
 
 
+struct fbr_fiber;
+
+/* Header of fbr_alloc'ed memory, bumped out of the arena of its fiber */
 struct mem_pool {
 	void *ptr;
+	struct fbr_fiber *fiber;
+	struct fbr_arena_chunk *chunk;
+	size_t size;
 	fbr_alloc_destructor_func_t destructor;
 	void *destructor_context;
+	/* Linked into the fiber pool only while destructor is set */
 	LIST_ENTRY(mem_pool) entries;
 };
 
 LIST_HEAD(mem_pool_list, mem_pool);
 
+#define FBR_ARENA_CHUNK_SIZE 4096
+#define FBR_ARENA_ALIGN 16
+
+struct fbr_arena_chunk {
+	struct fbr_arena_chunk *next;
+	struct fbr_arena_chunk *prev;
+	size_t size;
+	size_t used;
+	/* Entries bumped and not freed yet */
+	size_t live;
+	char data[] __attribute__((aligned(FBR_ARENA_ALIGN)));
+};
+
 TAILQ_HEAD(fiber_destructor_tailq, fbr_destructor);
 LIST_HEAD(fiber_list, fbr_fiber);
 
@@ -149,6 +172,7 @@ struct fbr_fiber {
 	coro_context ctx;
 	char *stack;
 	size_t stack_size;
+	int stack_mapped;
 	struct {
 		struct fbr_ev_base **waiting;
 		int arrived;
@@ -157,6 +181,7 @@ struct fbr_fiber {
 	struct fiber_list children;
 	struct fbr_fiber *parent;
 	struct mem_pool_list pool;
+	struct fbr_arena_chunk *arena;
 	struct {
 		LIST_ENTRY(fbr_fiber) reclaimed;
 		LIST_ENTRY(fbr_fiber) children;
@@ -167,15 +192,129 @@ struct fbr_fiber {
 	int no_reclaim;
 	int want_reclaim;
 	struct fbr_cond_var reclaim_cond;
+	fbr_joinable_func_t joinable_func;
+	int finished;
+	void *result;
+	struct fbr_cond_var join_cond;
 };
 
 TAILQ_HEAD(mutex_tailq, fbr_mutex);
 
+struct dns_entry {
+	char *key;
+	unsigned hash;
+	/* Request parameters, read by resolver threads */
+	char *node;
+	char *service;
+	struct addrinfo hints;
+	int has_hints;
+	/* Result, written by resolver threads */
+	int error;
+	int sys_errno;
+	struct addrinfo *result;
+
+	int pending;
+	int hashed;
+	int in_lru;
+	unsigned refs;
+	ev_tstamp expires;
+	struct fbr_cond_var cond;
+	LIST_ENTRY(dns_entry) hash_entries;
+	TAILQ_ENTRY(dns_entry) lru_entries;
+	TAILQ_ENTRY(dns_entry) queue_entries;
+};
+
+LIST_HEAD(dns_entry_list, dns_entry);
+TAILQ_HEAD(dns_entry_tailq, dns_entry);
+
+#define FBR_RESOLVER_THREADS 4
+#define FBR_DNS_CACHE_BUCKETS 256
+#define FBR_DNS_CACHE_SIZE 1024
+
+struct fbr_resolver {
+	struct fbr_context *fctx;
+	pthread_t threads[FBR_RESOLVER_THREADS];
+	unsigned n_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stop;
+	/* Both queues are protected by the lock */
+	struct dns_entry_tailq queue;
+	struct dns_entry_tailq done;
+	unsigned in_flight;
+	ev_async done_async;
+	/* The cache is accessed from the loop thread only */
+	struct dns_entry_list buckets[FBR_DNS_CACHE_BUCKETS];
+	struct dns_entry_tailq lru;
+	unsigned n_cached;
+};
+
 struct fbr_stack_item {
 	struct fbr_fiber *fiber;
 	struct trace_info tinfo;
 };
 
+struct fbr_future {
+	unsigned refs;
+	int ready;
+	int error;
+	void *value;
+	struct fbr_id_tailq waiting;
+	SLIST_ENTRY(fbr_future) entries;
+};
+
+SLIST_HEAD(fbr_future_slist, fbr_future);
+
+struct fbr_iobuf_seg {
+	unsigned refs;
+	size_t used;
+	SLIST_ENTRY(fbr_iobuf_seg) entries;
+	char data[];
+};
+
+SLIST_HEAD(fbr_iobuf_seg_slist, fbr_iobuf_seg);
+
+#define FBR_IOBUF_SEG_DATA_SIZE \
+	(FBR_IOBUF_SEG_SIZE - offsetof(struct fbr_iobuf_seg, data))
+
+struct fbr_iobuf_node {
+	struct fbr_iobuf_seg *seg;
+	size_t off;
+	size_t len;
+	TAILQ_ENTRY(fbr_iobuf_node) entries;
+	SLIST_ENTRY(fbr_iobuf_node) free_entries;
+};
+
+SLIST_HEAD(fbr_iobuf_node_slist, fbr_iobuf_node);
+
+struct fbr_chan {
+	size_t elem_size;
+	size_t capacity;
+	size_t head;
+	size_t count;
+	int closed;
+	struct fbr_id_tailq senders;
+	struct fbr_id_tailq receivers;
+	unsigned char *ring;
+};
+
+/* Lives in the first bytes of the pooled mapping itself */
+struct vrb_pool_item {
+	struct fbr_vrb vrb;
+	TAILQ_ENTRY(vrb_pool_item) entries;
+};
+
+TAILQ_HEAD(vrb_pool_item_tailq, vrb_pool_item);
+
+struct vrb_pool_bucket {
+	size_t capacity;
+	unsigned flags;
+	struct vrb_pool_item_tailq items;
+	LIST_ENTRY(vrb_pool_bucket) entries;
+};
+
+LIST_HEAD(vrb_pool_bucket_list, vrb_pool_bucket);
+
 struct fbr_context_private {
 	struct fbr_stack_item stack[FBR_CALL_STACK_SIZE];
 	struct fbr_stack_item *sp;
@@ -183,10 +322,27 @@ struct fbr_context_private {
 	struct fiber_list reclaimed;
 	struct ev_async pending_async;
 	struct fbr_id_tailq pending_fibers;
+	struct fbr_id_tailq cond_woken;
 	int backtraces_enabled;
+	int huge_page_stacks;
 	uint64_t last_id;
 	uint64_t key_free_mask;
 	const char *buffer_file_pattern;
+	ev_signal signals[NSIG];
+	unsigned signals_pending[NSIG];
+	struct fbr_cond_var signals_cond;
+	struct fbr_resolver *resolver;
+	ev_tstamp dns_positive_ttl;
+	ev_tstamp dns_negative_ttl;
+	struct fbr_future_slist free_futures;
+	size_t n_free_futures;
+	struct fbr_iobuf_seg_slist free_iobuf_segs;
+	size_t n_free_iobuf_segs;
+	struct fbr_iobuf_node_slist free_iobuf_nodes;
+	size_t n_free_iobuf_nodes;
+	struct vrb_pool_bucket_list vrb_pool;
+	size_t vrb_pool_bytes;
+	size_t vrb_pool_max_bytes;
 
 	struct ev_loop *loop;
 };
@@ -194,12 +350,92 @@ struct fbr_context_private {
 struct fbr_mq {
 	struct fbr_context *fctx;
 	void **rb;
-	unsigned head;
-	unsigned tail;
-	unsigned max;
+	size_t head;
+	size_t tail;
+	size_t mask;
 	int flags;
 	struct fbr_cond_var bytes_available_cond;
 	struct fbr_cond_var bytes_freed_cond;
 };
 
+struct fbr_xmq_slot {
+	size_t seq;
+	void *obj;
+};
+
+#define FBR_XMQ_CACHELINE 64
+
+struct fbr_xmq {
+	struct fbr_context *fctx;
+	struct ev_loop *loop;
+	struct fbr_xmq_slot *slots;
+	size_t mask;
+	/* Consumer side */
+	size_t head __attribute__((aligned(FBR_XMQ_CACHELINE)));
+	ev_async async;
+	/* Producer side, shared between threads */
+	size_t tail __attribute__((aligned(FBR_XMQ_CACHELINE)));
+	int parked __attribute__((aligned(FBR_XMQ_CACHELINE)));
+};
+
+struct fbr_xbuffer_side {
+	struct ev_loop *loop;
+	ev_async async;
+	int parked;
+};
+
+struct fbr_xbuffer {
+	struct fbr_vrb vrb;
+	size_t capacity;
+	/* Producer side */
+	size_t head __attribute__((aligned(FBR_XMQ_CACHELINE)));
+	size_t prepared_bytes;
+	struct fbr_xbuffer_side writer;
+	/* Consumer side */
+	size_t tail __attribute__((aligned(FBR_XMQ_CACHELINE)));
+	size_t waiting_bytes;
+	struct fbr_xbuffer_side reader;
+};
+
+/* Lives in the mapping shared by both processes, past the ring */
+struct fbr_ipc_hdr {
+	uint64_t capacity;
+	/* Written by the producer */
+	uint64_t head __attribute__((aligned(FBR_XMQ_CACHELINE)));
+	int writer_parked;
+	/* Written by the consumer */
+	uint64_t tail __attribute__((aligned(FBR_XMQ_CACHELINE)));
+	int reader_parked;
+};
+
+struct conn_bucket;
+
+struct fbr_conn {
+	int fd;
+	struct conn_bucket *bucket;
+	ev_tstamp idle_since;
+	TAILQ_ENTRY(fbr_conn) entries;
+};
+
+TAILQ_HEAD(conn_tailq, fbr_conn);
+
+struct conn_bucket {
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	struct conn_tailq idle;
+	size_t n_total;
+	struct fbr_cond_var slot_cond;
+	LIST_ENTRY(conn_bucket) entries;
+};
+
+LIST_HEAD(conn_bucket_list, conn_bucket);
+
+struct fbr_conn_pool {
+	struct fbr_context *fctx;
+	size_t max_conns;
+	ev_tstamp idle_timeout;
+	struct conn_bucket_list buckets;
+	ev_timer reaper;
+};
+
 #endif
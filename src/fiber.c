@@ -16,17 +16,25 @@
 
  ********************************************************************/
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <evfibers/config.h>
 
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <limits.h>
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
 #include <err.h>
+#include <pthread.h>
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
 #ifdef HAVE_VALGRIND_H
 #include <valgrind/valgrind.h>
 #else
@@ -130,19 +138,129 @@ static void pending_async_cb(EV_P_ ev_async *w, _unused_ int revents)
 	}
 }
 
+static struct fbr_arena_chunk *arena_chunk_new(FBR_P_ size_t size)
+{
+	struct fbr_arena_chunk *chunk;
+	chunk = malloc(sizeof(struct fbr_arena_chunk) + size);
+	if (NULL == chunk) {
+		fbr_log_e(FBR_A_ "libevfibers: unable to allocate %zu bytes\n",
+				sizeof(struct fbr_arena_chunk) + size);
+		abort();
+	}
+	chunk->next = NULL;
+	chunk->prev = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	chunk->live = 0;
+	return chunk;
+}
+
+/* Offset of user memory of the entry bumped next. User memory right after the
+ * header is aligned as malloc'ed one */
+static size_t arena_entry_off(size_t used)
+{
+	return (used + sizeof(struct mem_pool) + FBR_ARENA_ALIGN - 1) /
+		FBR_ARENA_ALIGN * FBR_ARENA_ALIGN;
+}
+
+static struct mem_pool *arena_bump(struct fbr_arena_chunk *chunk, size_t size)
+{
+	size_t off;
+	struct mem_pool *pool_entry;
+	if (NULL == chunk)
+		return NULL;
+	off = arena_entry_off(chunk->used);
+	if (off > chunk->size || size > chunk->size - off)
+		return NULL;
+	chunk->used = off + size;
+	chunk->live++;
+	pool_entry = (struct mem_pool *)(chunk->data + off) - 1;
+	pool_entry->chunk = chunk;
+	pool_entry->size = size;
+	return pool_entry;
+}
+
+/* Rewinds the bump pointer if the entry is the last one in its chunk. Once
+ * all the entries of a chunk are freed, in whatever order, the current chunk
+ * is reused from the start and any other one is freed, which is always the
+ * case for the dedicated chunk of an oversized entry */
+static void arena_unbump(struct fbr_fiber *fiber, struct mem_pool *pool_entry)
+{
+	struct fbr_arena_chunk *chunk = pool_entry->chunk;
+	size_t end = (char *)(pool_entry + 1) - chunk->data + pool_entry->size;
+
+	assert(chunk->live > 0);
+	if (--chunk->live > 0) {
+		if (arena_entry_off(end) == arena_entry_off(chunk->used))
+			chunk->used = (char *)pool_entry - chunk->data;
+		return;
+	}
+	chunk->used = 0;
+	if (chunk == fiber->arena)
+		return;
+	chunk->prev->next = chunk->next;
+	if (chunk->next)
+		chunk->next->prev = chunk->prev;
+	free(chunk);
+}
+
+/* Frees the whole arena at once, optionally keeping a regular chunk for the
+ * next fiber to reuse this one */
+static void arena_reset(struct fbr_fiber *fiber, int keep)
+{
+	struct fbr_arena_chunk *chunk, *next, *kept = NULL;
+	for (chunk = fiber->arena; chunk; chunk = next) {
+		next = chunk->next;
+		if (keep && NULL == kept && FBR_ARENA_CHUNK_SIZE == chunk->size) {
+			kept = chunk;
+			continue;
+		}
+		free(chunk);
+	}
+	if (kept) {
+		kept->next = NULL;
+		kept->prev = NULL;
+		kept->used = 0;
+		kept->live = 0;
+	}
+	fiber->arena = kept;
+}
+
 static void *allocate_in_fiber(FBR_P_ size_t size, struct fbr_fiber *in)
 {
 	struct mem_pool *pool_entry;
-	pool_entry = malloc(size + sizeof(struct mem_pool));
+	struct fbr_arena_chunk *chunk;
+	size_t need = sizeof(struct mem_pool) + FBR_ARENA_ALIGN + size;
+
+	pool_entry = arena_bump(in->arena, size);
 	if (NULL == pool_entry) {
-		fbr_log_e(FBR_A_ "libevfibers: unable to allocate %zu bytes\n",
-				size + sizeof(struct mem_pool));
-		abort();
+		if (need > FBR_ARENA_CHUNK_SIZE) {
+			/* Goes behind the current chunk, which might still
+			 * have room for smaller ones */
+			chunk = arena_chunk_new(FBR_A_ need);
+			if (in->arena) {
+				chunk->next = in->arena->next;
+				chunk->prev = in->arena;
+				if (chunk->next)
+					chunk->next->prev = chunk;
+				in->arena->next = chunk;
+			} else {
+				in->arena = chunk;
+			}
+		} else {
+			chunk = arena_chunk_new(FBR_A_ FBR_ARENA_CHUNK_SIZE);
+			chunk->next = in->arena;
+			if (in->arena)
+				in->arena->prev = chunk;
+			in->arena = chunk;
+		}
+		pool_entry = arena_bump(chunk, size);
+		assert(pool_entry);
 	}
 	pool_entry->ptr = pool_entry;
+	pool_entry->fiber = in;
 	pool_entry->destructor = NULL;
 	pool_entry->destructor_context = NULL;
-	LIST_INSERT_HEAD(&in->pool, pool_entry, entries);
 	return pool_entry + 1;
 }
 
@@ -201,8 +319,10 @@ void fbr_init(FBR_P_ struct ev_loop *loop)
 	LIST_INIT(&fctx->__p->reclaimed);
 	LIST_INIT(&fctx->__p->root.children);
 	LIST_INIT(&fctx->__p->root.pool);
+	fctx->__p->root.arena = NULL;
 	TAILQ_INIT(&fctx->__p->root.destructors);
 	TAILQ_INIT(&fctx->__p->pending_fibers);
+	TAILQ_INIT(&fctx->__p->cond_woken);
 
 	root = &fctx->__p->root;
 	strncpy(root->name, "root", FBR_MAX_FIBER_NAME - 1);
@@ -222,9 +342,26 @@ void fbr_init(FBR_P_ struct ev_loop *loop)
 	fctx->__p->loop = loop;
 	fctx->__p->pending_async.data = fctx;
 	fctx->__p->backtraces_enabled = 0;
+	fctx->__p->huge_page_stacks = 0;
 	memset(&fctx->__p->key_free_mask, 0xFF,
 			sizeof(fctx->__p->key_free_mask));
 	ev_async_init(&fctx->__p->pending_async, pending_async_cb);
+	memset(fctx->__p->signals, 0x00, sizeof(fctx->__p->signals));
+	memset(fctx->__p->signals_pending, 0x00,
+			sizeof(fctx->__p->signals_pending));
+	fbr_cond_init(FBR_A_ &fctx->__p->signals_cond);
+	fctx->__p->resolver = NULL;
+	fctx->__p->dns_positive_ttl = FBR_DNS_POSITIVE_TTL;
+	fctx->__p->dns_negative_ttl = FBR_DNS_NEGATIVE_TTL;
+	SLIST_INIT(&fctx->__p->free_futures);
+	fctx->__p->n_free_futures = 0;
+	SLIST_INIT(&fctx->__p->free_iobuf_segs);
+	fctx->__p->n_free_iobuf_segs = 0;
+	SLIST_INIT(&fctx->__p->free_iobuf_nodes);
+	fctx->__p->n_free_iobuf_nodes = 0;
+	LIST_INIT(&fctx->__p->vrb_pool);
+	fctx->__p->vrb_pool_bytes = 0;
+	fctx->__p->vrb_pool_max_bytes = FBR_BUFFER_POOL_MAX_BYTES;
 
 	buffer_pattern = getenv("FBR_BUFFER_FILE_PATTERN");
 	if (buffer_pattern)
@@ -254,6 +391,12 @@ const char *fbr_strerror(_unused_ FBR_P_ enum fbr_error_code code)
 			return "Not enough space in the buffer";
 		case FBR_EEIO:
 			return "libeio request error";
+		case FBR_ETIMEDOUT:
+			return "Timed out";
+		case FBR_EFUTURE:
+			return "Future completed with an error";
+		case FBR_ECLOSED:
+			return "Channel is closed";
 	}
 	return "Unknown error";
 }
@@ -316,20 +459,64 @@ static void reclaim_children(FBR_P_ struct fbr_fiber *fiber)
 
 static void fbr_free_in_fiber(_unused_ FBR_P_ _unused_ struct fbr_fiber *fiber,
 		void *ptr, int destructor);
+static void resolver_destroy(FBR_P);
+
+static void stack_free(struct fbr_fiber *fiber)
+{
+	if (fiber->stack_mapped)
+		munmap(fiber->stack, fiber->stack_size);
+	else
+		free(fiber->stack);
+}
 
 void fbr_destroy(FBR_P)
 {
 	struct fbr_fiber *fiber, *x;
 	struct mem_pool *p, *x2;
+	struct fbr_future *future;
+	struct fbr_iobuf_seg *seg;
+	struct fbr_iobuf_node *node;
+	int signo;
 
 	reclaim_children(FBR_A_ &fctx->__p->root);
 
+	for (signo = 1; signo < NSIG; signo++) {
+		if (!ev_is_active(&fctx->__p->signals[signo]))
+			continue;
+		/* Signal watchers are unreferenced, see signal_watch */
+		ev_ref(fctx->__p->loop);
+		ev_signal_stop(fctx->__p->loop, &fctx->__p->signals[signo]);
+	}
+
+	resolver_destroy(FBR_A);
+
+	while (!SLIST_EMPTY(&fctx->__p->free_futures)) {
+		future = SLIST_FIRST(&fctx->__p->free_futures);
+		SLIST_REMOVE_HEAD(&fctx->__p->free_futures, entries);
+		free(future);
+	}
+
+	while (!SLIST_EMPTY(&fctx->__p->free_iobuf_segs)) {
+		seg = SLIST_FIRST(&fctx->__p->free_iobuf_segs);
+		SLIST_REMOVE_HEAD(&fctx->__p->free_iobuf_segs, entries);
+		free(seg);
+	}
+	while (!SLIST_EMPTY(&fctx->__p->free_iobuf_nodes)) {
+		node = SLIST_FIRST(&fctx->__p->free_iobuf_nodes);
+		SLIST_REMOVE_HEAD(&fctx->__p->free_iobuf_nodes, free_entries);
+		free(node);
+	}
+
+	fbr_buffer_pool_trim(FBR_A_ 0);
+
 	LIST_FOREACH_SAFE(p, &fctx->__p->root.pool, entries, x2) {
 		fbr_free_in_fiber(FBR_A_ &fctx->__p->root, p + 1, 1);
 	}
+	arena_reset(&fctx->__p->root, 0);
 
 	LIST_FOREACH_SAFE(fiber, &fctx->__p->reclaimed, entries.reclaimed, x) {
-		free(fiber->stack);
+		stack_free(fiber);
+		arena_reset(fiber, 0);
 		free(fiber);
 	}
 
@@ -345,6 +532,11 @@ void fbr_enable_backtraces(FBR_P_ int enabled)
 
 }
 
+void fbr_enable_huge_page_stacks(FBR_P_ int enabled)
+{
+	fctx->__p->huge_page_stacks = enabled ? 1 : 0;
+}
+
 static void cancel_ev(_unused_ FBR_P_ struct fbr_ev_base *ev)
 {
 	fbr_destructor_remove(FBR_A_ &ev->item.dtor, 1 /* call it */);
@@ -406,11 +598,17 @@ static void fbr_free_in_fiber(_unused_ FBR_P_ _unused_ struct fbr_fiber *fiber,
 				"fiber memory pool entry", ptr);
 		if (!RUNNING_ON_VALGRIND)
 			abort();
+		return;
+	}
+	pool_entry->ptr = NULL;
+	if (pool_entry->destructor) {
+		LIST_REMOVE(pool_entry, entries);
+		if (destructor)
+			pool_entry->destructor(FBR_A_ ptr,
+					pool_entry->destructor_context);
 	}
-	LIST_REMOVE(pool_entry, entries);
-	if (destructor && pool_entry->destructor)
-		pool_entry->destructor(FBR_A_ ptr, pool_entry->destructor_context);
-	free(pool_entry);
+	/* Anything not given back here goes away along with the arena */
+	arena_unbump(pool_entry->fiber, pool_entry);
 }
 
 static void fiber_cleanup(FBR_P_ struct fbr_fiber *fiber)
@@ -425,6 +623,7 @@ static void fiber_cleanup(FBR_P_ struct fbr_fiber *fiber)
 	LIST_FOREACH_SAFE(p, &fiber->pool, entries, x) {
 		fbr_free_in_fiber(FBR_A_ fiber, p + 1, 1);
 	}
+	arena_reset(fiber, 1);
 }
 
 static void filter_fiber_stack(FBR_P_ struct fbr_fiber *fiber)
@@ -448,6 +647,8 @@ static int do_reclaim(FBR_P_ struct fbr_fiber *fiber)
 	reclaim_children(FBR_A_ fiber);
 	fiber_cleanup(FBR_A_ fiber);
 	fiber->id = fctx->__p->last_id++;
+	/* Joiners find out that the fiber is gone */
+	fbr_cond_broadcast(FBR_A_ &fiber->join_cond);
 #if 0
 	LIST_FOREACH(f, &fctx->__p->reclaimed, entries.reclaimed) {
 		assert(f != fiber);
@@ -544,6 +745,15 @@ static void call_wrapper(FBR_P)
 	int retval;
 	struct fbr_fiber *fiber = CURRENT_FIBER;
 
+	if (fiber->joinable_func) {
+		fiber->result = fiber->joinable_func(FBR_A_ fiber->func_arg);
+		fiber->finished = 1;
+		fbr_cond_broadcast(FBR_A_ &fiber->join_cond);
+		/* Reclaimed by fbr_join once the result is collected */
+		for (;;)
+			fbr_yield(FBR_A);
+	}
+
 	fiber->func(FBR_A_ fiber->func_arg);
 
 	retval = do_reclaim(FBR_A_ fiber);
@@ -568,12 +778,201 @@ static void item_dtor(_unused_ FBR_P_ void *arg)
 	}
 }
 
+static void mutex_release(FBR_P_ struct fbr_mutex *mutex, int may_switch);
+static void transfer_later(FBR_P_ struct fbr_id_tailq_i *item);
+static int chan_try(FBR_P_ struct fbr_ev_chan *e_chan);
+
+static void mutex_item_dtor(FBR_P_ void *arg)
+{
+	struct fbr_id_tailq_i *item = arg;
+	struct fbr_mutex *mutex;
+
+	item_dtor(FBR_A_ arg);
+	if (!item->ev->arrived || fbr_id_eq(item->id, CURRENT_FIBER_ID))
+		return;
+	/* Waiter is reclaimed after being woken up, but before it got to run,
+	 * so the wake up has to be passed on */
+	mutex = fbr_ev_upcast(item->ev, fbr_ev_mutex)->mutex;
+	if (fbr_id_eq(mutex->locked_by, item->id) ||
+			fbr_id_isnull(mutex->locked_by))
+		mutex_release(FBR_A_ mutex, 0);
+}
+
+/* In barging mode a woken waiter has to take the mutex itself and might lose
+ * the race, in which case it is queued again at the head of the waiters */
+static int mutex_ev_confirm(FBR_P_ struct fbr_ev_base *ev)
+{
+	struct fbr_mutex *mutex = fbr_ev_upcast(ev, fbr_ev_mutex)->mutex;
+	struct fbr_id_tailq_i *item = &ev->item;
+
+	if (fbr_id_eq(mutex->locked_by, CURRENT_FIBER_ID))
+		return 1;
+	if (fbr_id_isnull(mutex->locked_by)) {
+		mutex->locked_by = CURRENT_FIBER_ID;
+		return 1;
+	}
+	if (item->head)
+		TAILQ_REMOVE(item->head, item, entries);
+	TAILQ_INSERT_HEAD(&mutex->pending, item, entries);
+	item->head = &mutex->pending;
+	return 0;
+}
+
+static int rwlock_try(struct fbr_rwlock *rwlock, int exclusive, fbr_id_t id)
+{
+	if (!fbr_id_isnull(rwlock->writer))
+		return 0;
+	if (exclusive) {
+		if (rwlock->readers > 0)
+			return 0;
+		rwlock->writer = id;
+		return 1;
+	}
+	/* Writer preference: readers queue behind waiting writers */
+	if (!TAILQ_EMPTY(&rwlock->wr_pending))
+		return 0;
+	rwlock->readers++;
+	return 1;
+}
+
+static void rwlock_grant(FBR_P_ struct fbr_rwlock *rwlock)
+{
+	struct fbr_id_tailq_i *item;
+	struct fbr_fiber *fiber = NULL;
+
+	if (!fbr_id_isnull(rwlock->writer))
+		return;
+
+	while (0 == rwlock->readers && !TAILQ_EMPTY(&rwlock->wr_pending)) {
+		item = TAILQ_FIRST(&rwlock->wr_pending);
+		TAILQ_REMOVE(&rwlock->wr_pending, item, entries);
+		item->head = NULL;
+		if (-1 == fbr_id_unpack(FBR_A_ &fiber, item->id)) {
+			fbr_log_e(FBR_A_ "libevfibers: unexpected error trying"
+					" to find a fiber by id: %s",
+					fbr_strerror(FBR_A_ fctx->f_errno));
+			continue;
+		}
+		rwlock->writer = item->id;
+		post_ev(FBR_A_ fiber, item->ev);
+		transfer_later(FBR_A_ item);
+		return;
+	}
+	if (!TAILQ_EMPTY(&rwlock->wr_pending))
+		return;
+
+	while (!TAILQ_EMPTY(&rwlock->rd_pending)) {
+		item = TAILQ_FIRST(&rwlock->rd_pending);
+		TAILQ_REMOVE(&rwlock->rd_pending, item, entries);
+		item->head = NULL;
+		if (-1 == fbr_id_unpack(FBR_A_ &fiber, item->id)) {
+			fbr_log_e(FBR_A_ "libevfibers: unexpected error trying"
+					" to find a fiber by id: %s",
+					fbr_strerror(FBR_A_ fctx->f_errno));
+			continue;
+		}
+		rwlock->readers++;
+		post_ev(FBR_A_ fiber, item->ev);
+		transfer_later(FBR_A_ item);
+	}
+}
+
+static void rwlock_item_dtor(FBR_P_ void *arg)
+{
+	struct fbr_id_tailq_i *item = arg;
+	struct fbr_ev_rwlock *e_rwlock;
+	struct fbr_rwlock *rwlock;
+
+	item_dtor(FBR_A_ arg);
+	e_rwlock = fbr_ev_upcast(item->ev, fbr_ev_rwlock);
+	rwlock = e_rwlock->rwlock;
+	if (!item->ev->arrived) {
+		/* Removal of a waiting writer may let the readers queued behind
+		 * it in */
+		rwlock_grant(FBR_A_ rwlock);
+		return;
+	}
+	if (fbr_id_eq(item->id, CURRENT_FIBER_ID))
+		return;
+	/* Waiter is reclaimed after being granted the lock, but before it got
+	 * to run, so the lock has to be passed on */
+	if (e_rwlock->exclusive)
+		rwlock->writer = FBR_ID_NULL;
+	else
+		rwlock->readers--;
+	rwlock_grant(FBR_A_ rwlock);
+}
+
+static void sem_grant(FBR_P_ struct fbr_sem *sem)
+{
+	struct fbr_id_tailq_i *item;
+	struct fbr_ev_sem *e_sem;
+	struct fbr_fiber *fiber = NULL;
+
+	while (!TAILQ_EMPTY(&sem->pending)) {
+		item = TAILQ_FIRST(&sem->pending);
+		e_sem = fbr_ev_upcast(item->ev, fbr_ev_sem);
+		/* Strict FIFO: nobody overtakes a waiter that does not fit */
+		if (e_sem->count > sem->value)
+			return;
+		TAILQ_REMOVE(&sem->pending, item, entries);
+		item->head = NULL;
+		if (-1 == fbr_id_unpack(FBR_A_ &fiber, item->id)) {
+			fbr_log_e(FBR_A_ "libevfibers: unexpected error trying"
+					" to find a fiber by id: %s",
+					fbr_strerror(FBR_A_ fctx->f_errno));
+			continue;
+		}
+		sem->value -= e_sem->count;
+		post_ev(FBR_A_ fiber, item->ev);
+		transfer_later(FBR_A_ item);
+	}
+}
+
+static void sem_item_dtor(FBR_P_ void *arg)
+{
+	struct fbr_id_tailq_i *item = arg;
+	struct fbr_ev_sem *e_sem = fbr_ev_upcast(item->ev, fbr_ev_sem);
+
+	item_dtor(FBR_A_ arg);
+	/* Waiter is reclaimed after being granted the permits, but before it
+	 * got to run, so they are returned */
+	if (item->ev->arrived && !fbr_id_eq(item->id, CURRENT_FIBER_ID))
+		e_sem->sem->value += e_sem->count;
+	/* Removal of a waiter that did not fit may unblock the ones behind */
+	sem_grant(FBR_A_ e_sem->sem);
+}
+
+static void cond_item_dtor(FBR_P_ void *arg)
+{
+	struct fbr_id_tailq_i *item = arg;
+	struct fbr_id_tailq *woken = &fctx->__p->cond_woken;
+	int queued;
+
+	/* Condition variable itself may be gone after the broadcast, so it is
+	 * not looked at here */
+	queued = item->ev->arrived && item->head != woken;
+	item_dtor(FBR_A_ arg);
+	/* Fiber woken by a broadcast is done with the run queue, let the next
+	 * one in */
+	if (queued && !TAILQ_EMPTY(woken)) {
+		item = TAILQ_FIRST(woken);
+		TAILQ_REMOVE(woken, item, entries);
+		transfer_later(FBR_A_ item);
+	}
+}
+
 static enum ev_action_hint prepare_ev(FBR_P_ struct fbr_ev_base *ev)
 {
 	struct fbr_ev_watcher *e_watcher;
 	struct fbr_ev_mutex *e_mutex;
 	struct fbr_ev_cond_var *e_cond;
+	struct fbr_ev_rwlock *e_rwlock;
+	struct fbr_ev_sem *e_sem;
+	struct fbr_ev_future *e_future;
+	struct fbr_ev_chan *e_chan;
 	struct fbr_id_tailq_i *item = &ev->item;
+	struct fbr_id_tailq *head;
 
 	ev->arrived = 0;
 	ev->item.dtor.func = item_dtor;
@@ -602,6 +1001,7 @@ static enum ev_action_hint prepare_ev(FBR_P_ struct fbr_ev_base *ev)
 		ev->data = item;
 		TAILQ_INSERT_TAIL(&e_mutex->mutex->pending, item, entries);
 		item->head = &e_mutex->mutex->pending;
+		ev->item.dtor.func = mutex_item_dtor;
 		break;
 	case FBR_EV_COND_VAR:
 		e_cond = fbr_ev_upcast(ev, fbr_ev_cond_var);
@@ -615,9 +1015,62 @@ static enum ev_action_hint prepare_ev(FBR_P_ struct fbr_ev_base *ev)
 		ev->data = item;
 		TAILQ_INSERT_TAIL(&e_cond->cond->waiting, item, entries);
 		item->head = &e_cond->cond->waiting;
+		ev->item.dtor.func = cond_item_dtor;
 		if (e_cond->mutex)
 			fbr_mutex_unlock(FBR_A_ e_cond->mutex);
 		break;
+	case FBR_EV_RWLOCK:
+		e_rwlock = fbr_ev_upcast(ev, fbr_ev_rwlock);
+		if (rwlock_try(e_rwlock->rwlock, e_rwlock->exclusive,
+					CURRENT_FIBER_ID))
+			return EV_AH_ARRIVED;
+		id_tailq_i_set(FBR_A_ item, CURRENT_FIBER);
+		item->ev = ev;
+		ev->data = item;
+		head = e_rwlock->exclusive ? &e_rwlock->rwlock->wr_pending :
+			&e_rwlock->rwlock->rd_pending;
+		TAILQ_INSERT_TAIL(head, item, entries);
+		item->head = head;
+		ev->item.dtor.func = rwlock_item_dtor;
+		break;
+	case FBR_EV_SEM:
+		e_sem = fbr_ev_upcast(ev, fbr_ev_sem);
+		if (TAILQ_EMPTY(&e_sem->sem->pending) &&
+				e_sem->count <= e_sem->sem->value) {
+			e_sem->sem->value -= e_sem->count;
+			return EV_AH_ARRIVED;
+		}
+		id_tailq_i_set(FBR_A_ item, CURRENT_FIBER);
+		item->ev = ev;
+		ev->data = item;
+		TAILQ_INSERT_TAIL(&e_sem->sem->pending, item, entries);
+		item->head = &e_sem->sem->pending;
+		ev->item.dtor.func = sem_item_dtor;
+		break;
+	case FBR_EV_FUTURE:
+		e_future = fbr_ev_upcast(ev, fbr_ev_future);
+		if (e_future->future->ready)
+			return EV_AH_ARRIVED;
+		id_tailq_i_set(FBR_A_ item, CURRENT_FIBER);
+		item->ev = ev;
+		ev->data = item;
+		TAILQ_INSERT_TAIL(&e_future->future->waiting, item, entries);
+		item->head = &e_future->future->waiting;
+		break;
+	case FBR_EV_CHAN:
+		e_chan = fbr_ev_upcast(ev, fbr_ev_chan);
+		e_chan->closed = 0;
+		/* Only one channel operation may complete per wait */
+		if (!CURRENT_FIBER->ev.arrived && chan_try(FBR_A_ e_chan))
+			return EV_AH_ARRIVED;
+		id_tailq_i_set(FBR_A_ item, CURRENT_FIBER);
+		item->ev = ev;
+		ev->data = item;
+		head = FBR_CHAN_SEND == e_chan->op ? &e_chan->chan->senders :
+			&e_chan->chan->receivers;
+		TAILQ_INSERT_TAIL(head, item, entries);
+		item->head = head;
+		break;
 	case FBR_EV_EIO:
 #ifdef FBR_EIO_ENABLED
 		/* NOP */
@@ -646,6 +1099,10 @@ static void finish_ev(FBR_P_ struct fbr_ev_base *ev)
 		ev_set_cb(e_watcher->w, ev_abort_cb);
 		break;
 	case FBR_EV_MUTEX:
+	case FBR_EV_RWLOCK:
+	case FBR_EV_SEM:
+	case FBR_EV_FUTURE:
+	case FBR_EV_CHAN:
 		/* NOP */
 		break;
 	case FBR_EV_EIO:
@@ -698,6 +1155,28 @@ int fbr_ev_wait_to(FBR_P_ struct fbr_ev_base *events[], ev_tstamp timeout)
 	return n_events;
 }
 
+static void ev_wait_arrived(FBR_P_ struct fbr_ev_base *events[])
+{
+	struct fbr_fiber *fiber = CURRENT_FIBER;
+	int i;
+
+	for (;;) {
+		while (0 == fiber->ev.arrived)
+			fbr_yield(FBR_A);
+
+		fiber->ev.arrived = 0;
+		for (i = 0; NULL != events[i]; i++) {
+			if (events[i]->arrived && FBR_EV_MUTEX == events[i]->type)
+				events[i]->arrived = mutex_ev_confirm(FBR_A_
+						events[i]);
+			if (events[i]->arrived)
+				fiber->ev.arrived = 1;
+		}
+		if (fiber->ev.arrived)
+			return;
+	}
+}
+
 int fbr_ev_wait(FBR_P_ struct fbr_ev_base *events[])
 {
 	struct fbr_fiber *fiber = CURRENT_FIBER;
@@ -722,8 +1201,7 @@ int fbr_ev_wait(FBR_P_ struct fbr_ev_base *events[])
 		}
 	}
 
-	while (0 == fiber->ev.arrived)
-		fbr_yield(FBR_A);
+	ev_wait_arrived(FBR_A_ events);
 
 	for (i = 0; NULL != events[i]; i++) {
 		if (events[i]->arrived) {
@@ -754,8 +1232,7 @@ int fbr_ev_wait_one(FBR_P_ struct fbr_ev_base *one)
 		return_error(-1, FBR_EINVAL);
 	}
 
-	while (0 == fiber->ev.arrived)
-		fbr_yield(FBR_A);
+	ev_wait_arrived(FBR_A_ events);
 
 finish:
 	finish_ev(FBR_A_ one);
@@ -1418,6 +1895,155 @@ int fbr_accept(FBR_P_ int sockfd, struct sockaddr *addr, socklen_t *addrlen)
 	return r;
 }
 
+static int accept_nonblock(int sockfd)
+{
+#ifdef HAVE_ACCEPT4
+	return accept4(sockfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	int fd;
+	int flags;
+
+	fd = accept(sockfd, NULL, NULL);
+	if (-1 == fd)
+		return -1;
+	flags = fcntl(fd, F_GETFL, 0);
+	if (-1 == flags || -1 == fcntl(fd, F_SETFL, flags | O_NONBLOCK) ||
+			-1 == fcntl(fd, F_SETFD, FD_CLOEXEC)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+#endif
+}
+
+/* Accepts whatever is already queued, errno tells why it stopped short of
+ * max */
+static size_t accept_drain(int sockfd, int *fds, size_t max)
+{
+	size_t n = 0;
+	int r;
+
+	while (n < max) {
+		r = accept_nonblock(sockfd);
+		if (-1 != r) {
+			fds[n++] = r;
+			continue;
+		}
+		if (EINTR == errno || ECONNABORTED == errno || EPROTO == errno)
+			continue;
+		break;
+	}
+	return n;
+}
+
+int fbr_accept_many(FBR_P_ int sockfd, int *fds, size_t max)
+{
+	int flags;
+	int nonblock;
+	int waited = 0;
+	size_t n = 0;
+	ev_io io;
+	struct fbr_ev_watcher watcher;
+	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
+
+	if (0 == max) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	flags = fcntl(sockfd, F_GETFL, 0);
+	if (-1 == flags)
+		return -1;
+	nonblock = (0 != (flags & O_NONBLOCK));
+	/* Draining the backlog is only possible on a non-blocking socket */
+	if (!nonblock)
+		max = 1;
+
+	ev_io_init(&io, NULL, sockfd, EV_READ);
+	dtor.func = watcher_io_dtor;
+	dtor.arg = &io;
+
+	for (;;) {
+		if (nonblock || waited) {
+			n = accept_drain(sockfd, fds, max);
+			/* Either the backlog is drained or an error will be
+			 * reported upon the next call */
+			if (n > 0)
+				break;
+			if (EAGAIN != errno && EWOULDBLOCK != errno)
+				return -1;
+		}
+
+		ev_io_start(fctx->__p->loop, &io);
+		fbr_destructor_add(FBR_A_ &dtor);
+		fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
+		fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+		fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
+		waited = 1;
+	}
+
+	return n;
+}
+
+struct accept_spawn_arg {
+	fbr_accept_handler_t handler;
+	void *arg;
+	int fd;
+};
+
+static void accept_spawn_wrapper(FBR_P_ void *_arg)
+{
+	/* Spawning fiber's stack frame is gone after the first yield */
+	struct accept_spawn_arg arg = *(struct accept_spawn_arg *)_arg;
+
+	arg.handler(FBR_A_ arg.fd, arg.arg);
+}
+
+#define FBR_ACCEPT_SPAWN_BATCH 64
+
+int fbr_accept_spawn(FBR_P_ int sockfd, size_t budget, const char *name,
+		fbr_accept_handler_t handler, void *arg, size_t stack_size)
+{
+	int fds[FBR_ACCEPT_SPAWN_BATCH];
+	int n, i, retval;
+	int total = 0;
+	size_t batch;
+	fbr_id_t id;
+	struct accept_spawn_arg spawn_arg;
+
+	if (0 == budget || NULL == handler || budget > INT_MAX)
+		return_error(-1, FBR_EINVAL);
+
+	spawn_arg.handler = handler;
+	spawn_arg.arg = arg;
+	while (budget > 0) {
+		batch = min(budget, (size_t)FBR_ACCEPT_SPAWN_BATCH);
+		if (0 == total) {
+			/* Only the first batch may wait for connections */
+			n = fbr_accept_many(FBR_A_ sockfd, fds, batch);
+			if (-1 == n)
+				return_error(-1, FBR_ESYSTEM);
+		} else {
+			/* An error, if any, is reported upon the next call */
+			n = (int)accept_drain(sockfd, fds, batch);
+		}
+
+		for (i = 0; i < n; i++) {
+			spawn_arg.fd = fds[i];
+			id = fbr_create(FBR_A_ name, accept_spawn_wrapper,
+					&spawn_arg, stack_size);
+			retval = fbr_transfer(FBR_A_ id);
+			assert(0 == retval);
+			(void)retval;
+		}
+		total += n;
+		budget -= n;
+		if ((size_t)n < batch)
+			break;
+	}
+	return total;
+}
+
 ev_tstamp fbr_sleep(FBR_P_ ev_tstamp seconds)
 {
 	ev_timer timer;
@@ -1464,32 +2090,208 @@ void fbr_async_wait(FBR_P_ ev_async *w)
 	return;
 }
 
-static unsigned get_page_size()
+static void signal_cb(_unused_ EV_P_ ev_signal *w, _unused_ int revents)
 {
-	static unsigned sz;
-	long retval;
-	if (sz > 0)
-		return sz;
-	retval = sysconf(_SC_PAGESIZE);
-	if (0 > retval) {
-		fprintf(stderr, "libevfibers: sysconf(_SC_PAGESIZE): %s",
-				strerror(errno));
-		abort();
-	}
-	sz = retval;
-	return sz;
+	struct fbr_context *fctx = w->data;
+
+	fctx->__p->signals_pending[w->signum]++;
+	/* Waiters are moved to the pending queue on the first delivery, all
+	 * the subsequent ones only bump the counter */
+	fbr_cond_broadcast(FBR_A_ &fctx->__p->signals_cond);
 }
 
-static size_t round_up_to_page_size(size_t size)
+static int signal_watch(FBR_P_ int signo)
 {
-	unsigned sz = get_page_size();
-	size_t remainder;
-	remainder = size % sz;
-	if (remainder == 0)
+	ev_signal *w;
+
+	if (signo <= 0 || signo >= NSIG || SIGKILL == signo ||
+			SIGSTOP == signo)
+		return_error(-1, FBR_EINVAL);
+	w = &fctx->__p->signals[signo];
+	if (ev_is_active(w))
+		return_success(0);
+	ev_signal_init(w, signal_cb, signo);
+	w->data = fctx;
+	ev_signal_start(fctx->__p->loop, w);
+	/* Watching for signals should not keep the loop running */
+	ev_unref(fctx->__p->loop);
+	return_success(0);
+}
+
+static size_t signal_collect(FBR_P_ const sigset_t *set,
+		struct fbr_siginfo *info, size_t n)
+{
+	size_t i = 0;
+	int signo;
+
+	for (signo = 1; signo < NSIG && i < n; signo++) {
+		if (0 == fctx->__p->signals_pending[signo])
+			continue;
+		if (1 != sigismember(set, signo))
+			continue;
+		info[i].signo = signo;
+		info[i].count = fctx->__p->signals_pending[signo];
+		fctx->__p->signals_pending[signo] = 0;
+		i++;
+	}
+	return i;
+}
+
+static void signal_unref_dtor(FBR_P_ _unused_ void *_arg)
+{
+	ev_unref(fctx->__p->loop);
+}
+
+int fbr_signal_wait(FBR_P_ const sigset_t *set, ev_tstamp timeout,
+		struct fbr_siginfo *info, size_t n)
+{
+	struct fbr_ev_cond_var ev;
+	struct fbr_ev_base *events[] = {&ev.ev_base, NULL};
+	ev_tstamp deadline = ev_now(fctx->__p->loop) + timeout;
+	ev_tstamp remaining = 0.;
+	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
+	size_t retval;
+	int n_events;
+	int signo;
+
+	if (0 == n)
+		return_error(-1, FBR_EINVAL);
+
+	for (signo = 1; signo < NSIG; signo++) {
+		if (1 != sigismember(set, signo))
+			continue;
+		if (-1 == signal_watch(FBR_A_ signo))
+			return -1;
+	}
+	dtor.func = signal_unref_dtor;
+
+	for (;;) {
+		retval = signal_collect(FBR_A_ set, info, n);
+		if (retval > 0)
+			return_success(retval);
+
+		if (timeout >= 0.) {
+			remaining = deadline - ev_now(fctx->__p->loop);
+			if (remaining <= 0.)
+				return_error(-1, FBR_ETIMEDOUT);
+		}
+		fbr_ev_cond_var_init(FBR_A_ &ev, &fctx->__p->signals_cond,
+				NULL);
+		/* Signal watchers are unreferenced, but the loop should keep
+		 * running while somebody waits for them */
+		ev_ref(fctx->__p->loop);
+		fbr_destructor_add(FBR_A_ &dtor);
+		if (timeout < 0.)
+			n_events = fbr_ev_wait_one(FBR_A_ &ev.ev_base);
+		else
+			n_events = fbr_ev_wait_to(FBR_A_ events, remaining);
+		fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
+		if (-1 == n_events)
+			return -1;
+	}
+}
+
+static unsigned get_page_size()
+{
+	static unsigned sz;
+	long retval;
+	if (sz > 0)
+		return sz;
+	retval = sysconf(_SC_PAGESIZE);
+	if (0 > retval) {
+		fprintf(stderr, "libevfibers: sysconf(_SC_PAGESIZE): %s",
+				strerror(errno));
+		abort();
+	}
+	sz = retval;
+	return sz;
+}
+
+/* Returns 0 if the system has no huge pages configured */
+static size_t get_huge_page_size()
+{
+	static size_t sz = (size_t)-1;
+	char line[128];
+	unsigned long kb;
+	FILE *fp;
+
+	if ((size_t)-1 != sz)
+		return sz;
+	sz = 0;
+	fp = fopen("/proc/meminfo", "r");
+	if (NULL == fp)
+		return sz;
+	while (fgets(line, sizeof(line), fp)) {
+		if (1 == sscanf(line, "Hugepagesize: %lu kB", &kb)) {
+			sz = kb * 1024;
+			break;
+		}
+	}
+	fclose(fp);
+	return sz;
+}
+
+static size_t round_up_to_page_size(size_t size)
+{
+	unsigned sz = get_page_size();
+	size_t remainder;
+	remainder = size % sz;
+	if (remainder == 0)
 		return size;
 	return size + sz - remainder;
 }
 
+static void *stack_map(size_t size, int hugetlb)
+{
+	void *ptr;
+	int flags = FBR_MAP_ANON_FLAG | MAP_PRIVATE;
+
+	if (hugetlb) {
+#ifdef MAP_HUGETLB
+		flags |= MAP_HUGETLB;
+#else
+		return NULL;
+#endif
+	}
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (MAP_FAILED == ptr)
+		return NULL;
+	return ptr;
+}
+
+static void stack_alloc(FBR_P_ struct fbr_fiber *fiber, size_t size)
+{
+	size_t huge = get_huge_page_size();
+	size_t huge_size;
+
+	fiber->stack_size = size;
+	fiber->stack_mapped = 0;
+	if (fctx->__p->huge_page_stacks) {
+		fiber->stack_mapped = 1;
+		if (huge > 0) {
+			huge_size = (size + huge - 1) / huge * huge;
+			fiber->stack = stack_map(huge_size, 1);
+			if (fiber->stack) {
+				fiber->stack_size = huge_size;
+				return;
+			}
+		}
+		/* No huge pages are reserved, let the kernel collapse
+		 * regular ones */
+		fiber->stack = stack_map(size, 0);
+		if (fiber->stack) {
+#ifdef MADV_HUGEPAGE
+			madvise(fiber->stack, size, MADV_HUGEPAGE);
+#endif
+			return;
+		}
+		fiber->stack_mapped = 0;
+	}
+	fiber->stack = malloc(size);
+	if (NULL == fiber->stack)
+		err(EXIT_FAILURE, "malloc failed");
+}
+
 fbr_id_t fbr_create(FBR_P_ const char *name, fbr_fiber_func_t func, void *arg,
 		size_t stack_size)
 {
@@ -1503,13 +2305,11 @@ fbr_id_t fbr_create(FBR_P_ const char *name, fbr_fiber_func_t func, void *arg,
 		if (0 == stack_size)
 			stack_size = FBR_STACK_SIZE;
 		stack_size = round_up_to_page_size(stack_size);
-		fiber->stack = malloc(stack_size);
-		if (NULL == fiber->stack)
-			err(EXIT_FAILURE, "malloc failed");
-		fiber->stack_size = stack_size;
+		stack_alloc(FBR_A_ fiber, stack_size);
 		(void)VALGRIND_STACK_REGISTER(fiber->stack, fiber->stack +
-				stack_size);
+				fiber->stack_size);
 		fbr_cond_init(FBR_A_ &fiber->reclaim_cond);
+		fbr_cond_init(FBR_A_ &fiber->join_cond);
 		fiber->id = fctx->__p->last_id++;
 	}
 	coro_create(&fiber->ctx, (coro_func)call_wrapper, FBR_A, fiber->stack,
@@ -1524,9 +2324,59 @@ fbr_id_t fbr_create(FBR_P_ const char *name, fbr_fiber_func_t func, void *arg,
 	fiber->parent = CURRENT_FIBER;
 	fiber->no_reclaim = 0;
 	fiber->want_reclaim = 0;
+	fiber->joinable_func = NULL;
+	fiber->finished = 0;
+	fiber->result = NULL;
 	return fbr_id_pack(fiber);
 }
 
+fbr_id_t fbr_create_joinable(FBR_P_ const char *name, fbr_joinable_func_t func,
+		void *arg, size_t stack_size)
+{
+	struct fbr_fiber *fiber;
+	fbr_id_t id;
+
+	id = fbr_create(FBR_A_ name, NULL, arg, stack_size);
+	if (fbr_id_isnull(id))
+		return id;
+	unpack_transfer_errno(FBR_ID_NULL, &fiber, id);
+	fiber->joinable_func = func;
+	return id;
+}
+
+int fbr_join(FBR_P_ fbr_id_t id, void **result, ev_tstamp timeout)
+{
+	struct fbr_fiber *fiber;
+	ev_tstamp deadline = ev_now(fctx->__p->loop) + timeout;
+	ev_tstamp remaining;
+	int retval;
+
+	unpack_transfer_errno(-1, &fiber, id);
+	if (NULL == fiber->joinable_func || fiber == CURRENT_FIBER)
+		return_error(-1, FBR_EINVAL);
+
+	while (!fiber->finished) {
+		if (timeout < 0.) {
+			fbr_cond_wait(FBR_A_ &fiber->join_cond, NULL);
+			retval = 0;
+		} else {
+			remaining = deadline - ev_now(fctx->__p->loop);
+			if (remaining <= 0.)
+				return_error(-1, FBR_ETIMEDOUT);
+			retval = fbr_cond_wait_wto(FBR_A_ &fiber->join_cond,
+					NULL, remaining);
+		}
+		/* Fiber might have been reclaimed in the meantime */
+		unpack_transfer_errno(-1, &fiber, id);
+		if (-1 == retval && !fiber->finished)
+			return_error(-1, FBR_ETIMEDOUT);
+	}
+
+	if (result)
+		*result = fiber->result;
+	return fbr_reclaim(FBR_A_ id);
+}
+
 int fbr_disown(FBR_P_ fbr_id_t parent_id)
 {
 	struct fbr_fiber *fiber, *parent;
@@ -1549,10 +2399,21 @@ fbr_id_t fbr_parent(FBR_P)
 	return fbr_id_pack(fiber->parent);
 }
 
+/* Printed once per function, so that the allocator stays cheap */
+#define warn_deprecated(name)                                             \
+	do {                                                              \
+		static int warned;                                        \
+		if (!warned) {                                            \
+			warned = 1;                                       \
+			fprintf(stderr, "libevfibers: %s is deprecated\n", \
+					name);                            \
+		}                                                         \
+	} while (0)
+
 void *fbr_calloc(FBR_P_ unsigned int nmemb, size_t size)
 {
 	void *ptr;
-	fprintf(stderr, "libevfibers: fbr_calloc is deprecated\n");
+	warn_deprecated("fbr_calloc");
 	ptr = allocate_in_fiber(FBR_A_ nmemb * size, CURRENT_FIBER);
 	memset(ptr, 0x00, nmemb * size);
 	return ptr;
@@ -1560,7 +2421,7 @@ void *fbr_calloc(FBR_P_ unsigned int nmemb, size_t size)
 
 void *fbr_alloc(FBR_P_ size_t size)
 {
-	fprintf(stderr, "libevfibers: fbr_alloc is deprecated\n");
+	warn_deprecated("fbr_alloc");
 	return allocate_in_fiber(FBR_A_ size, CURRENT_FIBER);
 }
 
@@ -1568,22 +2429,25 @@ void fbr_alloc_set_destructor(_unused_ FBR_P_ void *ptr,
 		fbr_alloc_destructor_func_t func, void *context)
 {
 	struct mem_pool *pool_entry;
-	fprintf(stderr, "libevfibers:"
-		       " fbr_alloc_set_destructor is deprecated\n");
+	warn_deprecated("fbr_alloc_set_destructor");
 	pool_entry = (struct mem_pool *)ptr - 1;
+	if (NULL == pool_entry->destructor && func)
+		LIST_INSERT_HEAD(&pool_entry->fiber->pool, pool_entry, entries);
+	else if (pool_entry->destructor && NULL == func)
+		LIST_REMOVE(pool_entry, entries);
 	pool_entry->destructor = func;
 	pool_entry->destructor_context = context;
 }
 
 void fbr_free(FBR_P_ void *ptr)
 {
-	fprintf(stderr, "libevfibers: fbr_free is deprecated\n");
+	warn_deprecated("fbr_free");
 	fbr_free_in_fiber(FBR_A_ CURRENT_FIBER, ptr, 1);
 }
 
 void fbr_free_nd(FBR_P_ void *ptr)
 {
-	fprintf(stderr, "libevfibers: fbr_free_nd is deprecated\n");
+	warn_deprecated("fbr_free_nd");
 	fbr_free_in_fiber(FBR_A_ CURRENT_FIBER, ptr, 0);
 }
 
@@ -1614,21 +2478,6 @@ static void transfer_later(FBR_P_ struct fbr_id_tailq_i *item)
 	ev_async_send(fctx->__p->loop, &fctx->__p->pending_async);
 }
 
-static void transfer_later_tailq(FBR_P_ struct fbr_id_tailq *tailq)
-{
-	int was_empty;
-	struct fbr_id_tailq_i *item;
-	TAILQ_FOREACH(item, tailq, entries) {
-		item->head = &fctx->__p->pending_fibers;
-	}
-	was_empty = TAILQ_EMPTY(&fctx->__p->pending_fibers);
-	TAILQ_CONCAT(&fctx->__p->pending_fibers, tailq, entries);
-	if (was_empty && !TAILQ_EMPTY(&fctx->__p->pending_fibers)) {
-		ev_async_start(fctx->__p->loop, &fctx->__p->pending_async);
-	}
-	ev_async_send(fctx->__p->loop, &fctx->__p->pending_async);
-}
-
 void fbr_ev_mutex_init(FBR_P_ struct fbr_ev_mutex *ev,
 		struct fbr_mutex *mutex)
 {
@@ -1636,10 +2485,36 @@ void fbr_ev_mutex_init(FBR_P_ struct fbr_ev_mutex *ev,
 	ev->mutex = mutex;
 }
 
+void fbr_cooperate(FBR_P)
+{
+	struct fbr_id_tailq_i item;
+	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
+
+	id_tailq_i_set(FBR_A_ &item, CURRENT_FIBER);
+	item.ev = NULL;
+	dtor.func = item_dtor;
+	dtor.arg = &item;
+	fbr_destructor_add(FBR_A_ &dtor);
+
+	transfer_later(FBR_A_ &item);
+	fbr_yield(FBR_A);
+
+	fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
+}
+
 void fbr_mutex_init(_unused_ FBR_P_ struct fbr_mutex *mutex)
 {
 	mutex->locked_by = FBR_ID_NULL;
 	TAILQ_INIT(&mutex->pending);
+	mutex->mode = FBR_MUTEX_FIFO;
+}
+
+void fbr_mutex_set_mode(_unused_ FBR_P_ struct fbr_mutex *mutex,
+		enum fbr_mutex_mode mode)
+{
+	assert(TAILQ_EMPTY(&mutex->pending) &&
+			"Can't change the mode of a mutex with waiters");
+	mutex->mode = mode;
 }
 
 void fbr_mutex_lock(FBR_P_ struct fbr_mutex *mutex)
@@ -1662,35 +2537,50 @@ int fbr_mutex_trylock(FBR_P_ struct fbr_mutex *mutex)
 	return 0;
 }
 
-void fbr_mutex_unlock(FBR_P_ struct fbr_mutex *mutex)
+static void mutex_release(FBR_P_ struct fbr_mutex *mutex, int may_switch)
 {
-	struct fbr_id_tailq_i *item, *x;
+	struct fbr_id_tailq_i *item;
 	struct fbr_fiber *fiber = NULL;
-	assert(fbr_id_eq(mutex->locked_by, CURRENT_FIBER_ID) &&
-			"Can't unlock the mutex, locked by another fiber");
+	size_t depth;
 
-	if (TAILQ_EMPTY(&mutex->pending)) {
-		mutex->locked_by = FBR_ID_NULL;
-		return;
-	}
-
-	TAILQ_FOREACH_SAFE(item, &mutex->pending, entries, x) {
+	mutex->locked_by = FBR_ID_NULL;
+	while (!TAILQ_EMPTY(&mutex->pending)) {
+		item = TAILQ_FIRST(&mutex->pending);
 		assert(item->head == &mutex->pending);
 		TAILQ_REMOVE(&mutex->pending, item, entries);
+		item->head = NULL;
 		if (-1 == fbr_id_unpack(FBR_A_ &fiber, item->id)) {
 			fbr_log_e(FBR_A_ "libevfibers: unexpected error trying"
 					" to find a fiber by id: %s",
 					fbr_strerror(FBR_A_ fctx->f_errno));
 			continue;
 		}
-		break;
+		post_ev(FBR_A_ fiber, item->ev);
+
+		if (FBR_MUTEX_BARGING == mutex->mode) {
+			/* Waiter takes the mutex itself once it runs */
+			transfer_later(FBR_A_ item);
+			return;
+		}
+
+		mutex->locked_by = item->id;
+		depth = fctx->__p->sp - fctx->__p->stack;
+		if (FBR_MUTEX_HANDOFF == mutex->mode && may_switch &&
+				depth + 2 < FBR_CALL_STACK_SIZE) {
+			fbr_transfer(FBR_A_ item->id);
+			return;
+		}
+		transfer_later(FBR_A_ item);
+		return;
 	}
+}
 
-	mutex->locked_by = item->id;
-	assert(!fbr_id_isnull(mutex->locked_by));
-	post_ev(FBR_A_ fiber, item->ev);
+void fbr_mutex_unlock(FBR_P_ struct fbr_mutex *mutex)
+{
+	assert(fbr_id_eq(mutex->locked_by, CURRENT_FIBER_ID) &&
+			"Can't unlock the mutex, locked by another fiber");
 
-	transfer_later(FBR_A_ item);
+	mutex_release(FBR_A_ mutex, 1);
 }
 
 void fbr_mutex_destroy(_unused_ FBR_P_ _unused_ struct fbr_mutex *mutex)
@@ -1700,6 +2590,143 @@ void fbr_mutex_destroy(_unused_ FBR_P_ _unused_ struct fbr_mutex *mutex)
 	 */
 }
 
+void fbr_ev_rwlock_init(FBR_P_ struct fbr_ev_rwlock *ev,
+		struct fbr_rwlock *rwlock, int exclusive)
+{
+	ev_base_init(FBR_A_ &ev->ev_base, FBR_EV_RWLOCK);
+	ev->rwlock = rwlock;
+	ev->exclusive = exclusive;
+}
+
+void fbr_rwlock_init(_unused_ FBR_P_ struct fbr_rwlock *rwlock)
+{
+	rwlock->writer = FBR_ID_NULL;
+	rwlock->readers = 0;
+	TAILQ_INIT(&rwlock->rd_pending);
+	TAILQ_INIT(&rwlock->wr_pending);
+}
+
+static int rwlock_lock(FBR_P_ struct fbr_rwlock *rwlock, int exclusive,
+		ev_tstamp timeout)
+{
+	struct fbr_ev_rwlock ev;
+
+	assert(!fbr_id_eq(rwlock->writer, CURRENT_FIBER_ID) &&
+			"Reader-writer lock is already locked by current fiber");
+	fbr_ev_rwlock_init(FBR_A_ &ev, rwlock, exclusive);
+	if (timeout < 0.) {
+		fbr_ev_wait_one(FBR_A_ &ev.ev_base);
+		return_success(0);
+	}
+	if (-1 == fbr_ev_wait_one_wto(FBR_A_ &ev.ev_base, timeout))
+		return_error(-1, FBR_ETIMEDOUT);
+	return_success(0);
+}
+
+void fbr_rwlock_rdlock(FBR_P_ struct fbr_rwlock *rwlock)
+{
+	rwlock_lock(FBR_A_ rwlock, 0, -1.);
+}
+
+int fbr_rwlock_rdlock_wto(FBR_P_ struct fbr_rwlock *rwlock,
+		ev_tstamp timeout)
+{
+	return rwlock_lock(FBR_A_ rwlock, 0, timeout);
+}
+
+int fbr_rwlock_tryrdlock(FBR_P_ struct fbr_rwlock *rwlock)
+{
+	return rwlock_try(rwlock, 0, CURRENT_FIBER_ID);
+}
+
+void fbr_rwlock_wrlock(FBR_P_ struct fbr_rwlock *rwlock)
+{
+	rwlock_lock(FBR_A_ rwlock, 1, -1.);
+}
+
+int fbr_rwlock_wrlock_wto(FBR_P_ struct fbr_rwlock *rwlock,
+		ev_tstamp timeout)
+{
+	return rwlock_lock(FBR_A_ rwlock, 1, timeout);
+}
+
+int fbr_rwlock_trywrlock(FBR_P_ struct fbr_rwlock *rwlock)
+{
+	return rwlock_try(rwlock, 1, CURRENT_FIBER_ID);
+}
+
+void fbr_rwlock_unlock(FBR_P_ struct fbr_rwlock *rwlock)
+{
+	if (fbr_id_eq(rwlock->writer, CURRENT_FIBER_ID)) {
+		rwlock->writer = FBR_ID_NULL;
+	} else {
+		assert(fbr_id_isnull(rwlock->writer) && rwlock->readers > 0 &&
+				"Can't unlock the reader-writer lock, not held");
+		rwlock->readers--;
+	}
+	rwlock_grant(FBR_A_ rwlock);
+}
+
+void fbr_rwlock_destroy(_unused_ FBR_P_ _unused_ struct fbr_rwlock *rwlock)
+{
+	assert(TAILQ_EMPTY(&rwlock->rd_pending) &&
+			TAILQ_EMPTY(&rwlock->wr_pending) &&
+			"Can't destroy the reader-writer lock with waiters");
+}
+
+void fbr_ev_sem_init(FBR_P_ struct fbr_ev_sem *ev, struct fbr_sem *sem,
+		unsigned count)
+{
+	ev_base_init(FBR_A_ &ev->ev_base, FBR_EV_SEM);
+	ev->sem = sem;
+	ev->count = count;
+}
+
+void fbr_sem_init(_unused_ FBR_P_ struct fbr_sem *sem, unsigned value)
+{
+	sem->value = value;
+	TAILQ_INIT(&sem->pending);
+}
+
+void fbr_sem_acquire(FBR_P_ struct fbr_sem *sem, unsigned count)
+{
+	struct fbr_ev_sem ev;
+
+	fbr_ev_sem_init(FBR_A_ &ev, sem, count);
+	fbr_ev_wait_one(FBR_A_ &ev.ev_base);
+}
+
+int fbr_sem_acquire_wto(FBR_P_ struct fbr_sem *sem, unsigned count,
+		ev_tstamp timeout)
+{
+	struct fbr_ev_sem ev;
+
+	fbr_ev_sem_init(FBR_A_ &ev, sem, count);
+	if (-1 == fbr_ev_wait_one_wto(FBR_A_ &ev.ev_base, timeout))
+		return_error(-1, FBR_ETIMEDOUT);
+	return_success(0);
+}
+
+int fbr_sem_try_acquire(_unused_ FBR_P_ struct fbr_sem *sem, unsigned count)
+{
+	if (!TAILQ_EMPTY(&sem->pending) || count > sem->value)
+		return 0;
+	sem->value -= count;
+	return 1;
+}
+
+void fbr_sem_release(FBR_P_ struct fbr_sem *sem, unsigned count)
+{
+	sem->value += count;
+	sem_grant(FBR_A_ sem);
+}
+
+void fbr_sem_destroy(_unused_ FBR_P_ _unused_ struct fbr_sem *sem)
+{
+	assert(TAILQ_EMPTY(&sem->pending) &&
+			"Can't destroy the semaphore with waiters");
+}
+
 void fbr_ev_cond_var_init(FBR_P_ struct fbr_ev_cond_var *ev,
 		struct fbr_cond_var *cond, struct fbr_mutex *mutex)
 {
@@ -1733,20 +2760,54 @@ int fbr_cond_wait(FBR_P_ struct fbr_cond_var *cond, struct fbr_mutex *mutex)
 	return_success(0);
 }
 
+int fbr_cond_wait_wto(FBR_P_ struct fbr_cond_var *cond,
+		struct fbr_mutex *mutex, ev_tstamp timeout)
+{
+	struct fbr_ev_cond_var ev;
+
+	if (mutex && fbr_id_isnull(mutex->locked_by))
+		return_error(-1, FBR_EINVAL);
+
+	fbr_ev_cond_var_init(FBR_A_ &ev, cond, mutex);
+	if (-1 == fbr_ev_wait_one_wto(FBR_A_ &ev.ev_base, timeout)) {
+		/* Mutex is reacquired only for the arrived event */
+		if (mutex)
+			fbr_mutex_lock(FBR_A_ mutex);
+		return_error(-1, FBR_ETIMEDOUT);
+	}
+	return_success(0);
+}
+
 void fbr_cond_broadcast(FBR_P_ struct fbr_cond_var *cond)
 {
-	struct fbr_id_tailq_i *item;
+	struct fbr_id_tailq_i *item, *x;
+	struct fbr_id_tailq *woken = &fctx->__p->cond_woken;
 	struct fbr_fiber *fiber;
+	int was_empty;
+	int i;
+
 	if (TAILQ_EMPTY(&cond->waiting))
 		return;
-	TAILQ_FOREACH(item, &cond->waiting, entries) {
+	/* Waiters are moved to the context, nothing refers to the condition
+	 * variable once this returns */
+	TAILQ_FOREACH_SAFE(item, &cond->waiting, entries, x) {
+		item->head = woken;
 		if(-1 == fbr_id_unpack(FBR_A_ &fiber, item->id)) {
 			assert(FBR_ENOFIBER == fctx->f_errno);
 			continue;
 		}
 		post_ev(FBR_A_ fiber, item->ev);
 	}
-	transfer_later_tailq(FBR_A_ &cond->waiting);
+	was_empty = TAILQ_EMPTY(woken);
+	TAILQ_CONCAT(woken, &cond->waiting, entries);
+	/* Otherwise earlier woken fibers are already passing the baton */
+	if (!was_empty)
+		return;
+	for (i = 0; i < FBR_COND_BROADCAST_BATCH && !TAILQ_EMPTY(woken); i++) {
+		item = TAILQ_FIRST(woken);
+		TAILQ_REMOVE(woken, item, entries);
+		transfer_later(FBR_A_ item);
+	}
 }
 
 void fbr_cond_signal(FBR_P_ struct fbr_cond_var *cond)
@@ -1767,304 +2828,2573 @@ void fbr_cond_signal(FBR_P_ struct fbr_cond_var *cond)
 	transfer_later(FBR_A_ item);
 }
 
-int fbr_vrb_init(struct fbr_vrb *vrb, size_t size, const char *file_pattern)
+void fbr_cond_signal_n(FBR_P_ struct fbr_cond_var *cond, unsigned n)
 {
-	int fd = -1;
-	size_t sz = get_page_size();
-	size = (size ? round_up_to_page_size(size) : sz);
-	void *ptr = MAP_FAILED;
-	char *temp_name = NULL;
-	mode_t old_umask;
-	const mode_t secure_umask = 077;
-
-	temp_name = strdup(file_pattern);
-	if (!temp_name)
-		return -1;
-	//fctx->__p->vrb_file_pattern);
-	vrb->mem_ptr_size = size * 2 + sz * 2;
-	vrb->mem_ptr = mmap(NULL, vrb->mem_ptr_size, PROT_NONE,
-			FBR_MAP_ANON_FLAG | MAP_PRIVATE, -1, 0);
-	if (MAP_FAILED == vrb->mem_ptr)
-		goto error;
-	vrb->lower_ptr = vrb->mem_ptr + sz;
-	vrb->upper_ptr = vrb->lower_ptr + size;
-	vrb->ptr_size = size;
-	vrb->data_ptr = vrb->lower_ptr;
-	vrb->space_ptr = vrb->lower_ptr;
+	struct fbr_id_tailq_i *item;
+	struct fbr_fiber *fiber;
 
-	old_umask = umask(0);
-	umask(secure_umask);
+	while (n > 0 && !TAILQ_EMPTY(&cond->waiting)) {
+		item = TAILQ_FIRST(&cond->waiting);
+		assert(item->head == &cond->waiting);
+		TAILQ_REMOVE(&cond->waiting, item, entries);
+		if(-1 == fbr_id_unpack(FBR_A_ &fiber, item->id)) {
+			assert(FBR_ENOFIBER == fctx->f_errno);
+			item->head = NULL;
+			continue;
+		}
+		post_ev(FBR_A_ fiber, item->ev);
+		transfer_later(FBR_A_ item);
+		n--;
+	}
+}
+
+void fbr_waitgroup_init(FBR_P_ struct fbr_waitgroup *wg)
+{
+	wg->counter = 0;
+	fbr_cond_init(FBR_A_ &wg->cond);
+}
+
+void fbr_waitgroup_add(_unused_ FBR_P_ struct fbr_waitgroup *wg, unsigned n)
+{
+	wg->counter += n;
+}
+
+void fbr_waitgroup_done(FBR_P_ struct fbr_waitgroup *wg)
+{
+	assert(wg->counter > 0 && "Wait group has no outstanding tasks");
+	if (0 == --wg->counter)
+		fbr_cond_broadcast(FBR_A_ &wg->cond);
+}
+
+int fbr_waitgroup_wait(FBR_P_ struct fbr_waitgroup *wg, ev_tstamp timeout)
+{
+	ev_tstamp deadline = ev_now(fctx->__p->loop) + timeout;
+	ev_tstamp remaining;
+
+	while (wg->counter > 0) {
+		if (timeout < 0.) {
+			fbr_cond_wait(FBR_A_ &wg->cond, NULL);
+			continue;
+		}
+		remaining = deadline - ev_now(fctx->__p->loop);
+		if (remaining <= 0.)
+			return_error(-1, FBR_ETIMEDOUT);
+		if (-1 == fbr_cond_wait_wto(FBR_A_ &wg->cond, NULL, remaining)
+				&& wg->counter > 0)
+			return -1;
+	}
+	return_success(0);
+}
+
+void fbr_waitgroup_destroy(FBR_P_ struct fbr_waitgroup *wg)
+{
+	fbr_cond_destroy(FBR_A_ &wg->cond);
+}
+
+void fbr_barrier_init(FBR_P_ struct fbr_barrier *barrier, unsigned count)
+{
+	assert(count > 0);
+	barrier->count = count;
+	barrier->waiting = 0;
+	barrier->generation = 0;
+	fbr_cond_init(FBR_A_ &barrier->cond);
+}
+
+int fbr_barrier_wait(FBR_P_ struct fbr_barrier *barrier)
+{
+	unsigned generation = barrier->generation;
+
+	if (++barrier->waiting == barrier->count) {
+		barrier->waiting = 0;
+		barrier->generation++;
+		fbr_cond_broadcast(FBR_A_ &barrier->cond);
+		return 1;
+	}
+	while (generation == barrier->generation)
+		fbr_cond_wait(FBR_A_ &barrier->cond, NULL);
+	return 0;
+}
+
+void fbr_barrier_destroy(FBR_P_ struct fbr_barrier *barrier)
+{
+	fbr_cond_destroy(FBR_A_ &barrier->cond);
+}
+
+void fbr_ev_future_init(FBR_P_ struct fbr_ev_future *ev,
+		struct fbr_future *future)
+{
+	ev_base_init(FBR_A_ &ev->ev_base, FBR_EV_FUTURE);
+	ev->future = future;
+}
+
+struct fbr_future *fbr_future_create(FBR_P)
+{
+	struct fbr_future *future;
+
+	if (!SLIST_EMPTY(&fctx->__p->free_futures)) {
+		future = SLIST_FIRST(&fctx->__p->free_futures);
+		SLIST_REMOVE_HEAD(&fctx->__p->free_futures, entries);
+		fctx->__p->n_free_futures--;
+	} else {
+		future = malloc(sizeof(*future));
+		if (NULL == future)
+			err(EXIT_FAILURE, "malloc failed");
+	}
+	future->refs = 1;
+	future->ready = 0;
+	future->error = 0;
+	future->value = NULL;
+	TAILQ_INIT(&future->waiting);
+	return future;
+}
+
+void fbr_future_retain(_unused_ FBR_P_ struct fbr_future *future)
+{
+	future->refs++;
+}
+
+void fbr_future_release(FBR_P_ struct fbr_future *future)
+{
+	assert(future->refs > 0);
+	if (--future->refs > 0)
+		return;
+	assert(TAILQ_EMPTY(&future->waiting) &&
+			"Future is released while being awaited");
+	if (fctx->__p->n_free_futures >= FBR_FUTURE_POOL_SIZE) {
+		free(future);
+		return;
+	}
+	SLIST_INSERT_HEAD(&fctx->__p->free_futures, future, entries);
+	fctx->__p->n_free_futures++;
+}
+
+static int future_complete(FBR_P_ struct fbr_future *future, void *value,
+		int error)
+{
+	struct fbr_id_tailq_i *item;
+	struct fbr_fiber *fiber;
+
+	if (future->ready)
+		return_error(-1, FBR_EINVAL);
+	future->ready = 1;
+	future->value = value;
+	future->error = error;
+
+	while (!TAILQ_EMPTY(&future->waiting)) {
+		item = TAILQ_FIRST(&future->waiting);
+		TAILQ_REMOVE(&future->waiting, item, entries);
+		item->head = NULL;
+		if(-1 == fbr_id_unpack(FBR_A_ &fiber, item->id)) {
+			assert(FBR_ENOFIBER == fctx->f_errno);
+			continue;
+		}
+		post_ev(FBR_A_ fiber, item->ev);
+		transfer_later(FBR_A_ item);
+	}
+	return_success(0);
+}
+
+int fbr_future_set(FBR_P_ struct fbr_future *future, void *value)
+{
+	return future_complete(FBR_A_ future, value, 0);
+}
+
+int fbr_future_set_error(FBR_P_ struct fbr_future *future, int error)
+{
+	if (0 == error)
+		return_error(-1, FBR_EINVAL);
+	return future_complete(FBR_A_ future, NULL, error);
+}
+
+int fbr_future_is_ready(_unused_ FBR_P_ struct fbr_future *future)
+{
+	return future->ready;
+}
+
+int fbr_future_error(_unused_ FBR_P_ struct fbr_future *future)
+{
+	return future->error;
+}
+
+int fbr_future_wait(FBR_P_ struct fbr_future *future, void **value,
+		ev_tstamp timeout)
+{
+	struct fbr_ev_future ev;
+
+	if (!future->ready) {
+		fbr_ev_future_init(FBR_A_ &ev, future);
+		if (timeout < 0.)
+			fbr_ev_wait_one(FBR_A_ &ev.ev_base);
+		else if (-1 == fbr_ev_wait_one_wto(FBR_A_ &ev.ev_base, timeout))
+			return_error(-1, FBR_ETIMEDOUT);
+	}
+	if (future->error)
+		return_error(-1, FBR_EFUTURE);
+	if (value)
+		*value = future->value;
+	return_success(0);
+}
+
+void fbr_ev_chan_init(FBR_P_ struct fbr_ev_chan *ev, struct fbr_chan *chan,
+		enum fbr_chan_op op, void *elem)
+{
+	ev_base_init(FBR_A_ &ev->ev_base, FBR_EV_CHAN);
+	ev->chan = chan;
+	ev->op = op;
+	ev->elem = elem;
+	ev->closed = 0;
+}
+
+struct fbr_chan *fbr_chan_create(FBR_P_ size_t elem_size, size_t capacity)
+{
+	struct fbr_chan *chan;
+
+	if (0 == elem_size)
+		return_error(NULL, FBR_EINVAL);
+	if (capacity > (SIZE_MAX - sizeof(*chan)) / elem_size)
+		return_error(NULL, FBR_EINVAL);
+	chan = malloc(sizeof(*chan) + elem_size * capacity);
+	if (NULL == chan)
+		err(EXIT_FAILURE, "malloc failed");
+	chan->elem_size = elem_size;
+	chan->capacity = capacity;
+	chan->head = 0;
+	chan->count = 0;
+	chan->closed = 0;
+	TAILQ_INIT(&chan->senders);
+	TAILQ_INIT(&chan->receivers);
+	chan->ring = (unsigned char *)(chan + 1);
+	return chan;
+}
+
+static unsigned char *chan_slot(struct fbr_chan *chan, size_t i)
+{
+	return chan->ring + ((chan->head + i) % chan->capacity) * chan->elem_size;
+}
+
+/* Dequeues the first fiber blocked on a channel that is still free to complete
+ * the operation, i.e. has not had another event of the same wait arrive */
+static struct fbr_id_tailq_i *chan_peer(FBR_P_ struct fbr_id_tailq *head)
+{
+	struct fbr_id_tailq_i *item, *x;
+	struct fbr_fiber *fiber;
+
+	TAILQ_FOREACH_SAFE(item, head, entries, x) {
+		if (-1 == fbr_id_unpack(FBR_A_ &fiber, item->id)) {
+			fbr_log_e(FBR_A_ "libevfibers: unexpected error trying"
+					" to find a fiber by id: %s",
+					fbr_strerror(FBR_A_ fctx->f_errno));
+			continue;
+		}
+		if (fiber->ev.arrived || fiber == CURRENT_FIBER)
+			continue;
+		TAILQ_REMOVE(head, item, entries);
+		item->head = NULL;
+		post_ev(FBR_A_ fiber, item->ev);
+		return item;
+	}
+	return NULL;
+}
+
+static int chan_try_send(FBR_P_ struct fbr_chan *chan, const void *elem)
+{
+	struct fbr_id_tailq_i *item;
+
+	/* Receivers only wait on an empty channel */
+	item = chan->count ? NULL : chan_peer(FBR_A_ &chan->receivers);
+	if (item) {
+		memcpy(fbr_ev_upcast(item->ev, fbr_ev_chan)->elem, elem,
+				chan->elem_size);
+		transfer_later(FBR_A_ item);
+		return 1;
+	}
+	if (chan->count == chan->capacity)
+		return 0;
+	memcpy(chan_slot(chan, chan->count), elem, chan->elem_size);
+	chan->count++;
+	return 1;
+}
+
+static int chan_try_recv(FBR_P_ struct fbr_chan *chan, void *elem)
+{
+	struct fbr_id_tailq_i *item;
+	void *src;
+
+	item = chan_peer(FBR_A_ &chan->senders);
+	if (0 == chan->count) {
+		if (NULL == item)
+			return 0;
+		memcpy(elem, fbr_ev_upcast(item->ev, fbr_ev_chan)->elem,
+				chan->elem_size);
+		transfer_later(FBR_A_ item);
+		return 1;
+	}
+	memcpy(elem, chan_slot(chan, 0), chan->elem_size);
+	chan->head = (chan->head + 1) % chan->capacity;
+	chan->count--;
+	if (item) {
+		/* Freed slot goes to the first blocked sender */
+		src = fbr_ev_upcast(item->ev, fbr_ev_chan)->elem;
+		memcpy(chan_slot(chan, chan->count), src, chan->elem_size);
+		chan->count++;
+		transfer_later(FBR_A_ item);
+	}
+	return 1;
+}
+
+/* Returns 1 if the operation has completed (or failed because the channel is
+ * closed) */
+static int chan_try(FBR_P_ struct fbr_ev_chan *e_chan)
+{
+	struct fbr_chan *chan = e_chan->chan;
+
+	if (FBR_CHAN_SEND == e_chan->op) {
+		if (chan->closed)
+			return e_chan->closed = 1;
+		return chan_try_send(FBR_A_ chan, e_chan->elem);
+	}
+	if (chan_try_recv(FBR_A_ chan, e_chan->elem))
+		return 1;
+	if (chan->closed)
+		return e_chan->closed = 1;
+	return 0;
+}
+
+static int chan_op(FBR_P_ struct fbr_chan *chan, enum fbr_chan_op op,
+		void *elem, int block)
+{
+	struct fbr_ev_chan ev;
+
+	fbr_ev_chan_init(FBR_A_ &ev, chan, op, elem);
+	if (block)
+		fbr_ev_wait_one(FBR_A_ &ev.ev_base);
+	else if (!chan_try(FBR_A_ &ev))
+		return_success(0);
+	if (ev.closed)
+		return_error(-1, FBR_ECLOSED);
+	return_success(1);
+}
+
+int fbr_chan_send(FBR_P_ struct fbr_chan *chan, const void *elem)
+{
+	if (-1 == chan_op(FBR_A_ chan, FBR_CHAN_SEND, (void *)elem, 1))
+		return -1;
+	return 0;
+}
+
+int fbr_chan_try_send(FBR_P_ struct fbr_chan *chan, const void *elem)
+{
+	return chan_op(FBR_A_ chan, FBR_CHAN_SEND, (void *)elem, 0);
+}
+
+int fbr_chan_recv(FBR_P_ struct fbr_chan *chan, void *elem)
+{
+	if (-1 == chan_op(FBR_A_ chan, FBR_CHAN_RECV, elem, 1))
+		return -1;
+	return 0;
+}
+
+int fbr_chan_try_recv(FBR_P_ struct fbr_chan *chan, void *elem)
+{
+	return chan_op(FBR_A_ chan, FBR_CHAN_RECV, elem, 0);
+}
+
+size_t fbr_chan_len(_unused_ FBR_P_ struct fbr_chan *chan)
+{
+	return chan->count;
+}
+
+static void chan_close_waiters(FBR_P_ struct fbr_id_tailq *head)
+{
+	struct fbr_id_tailq_i *item;
+
+	while (NULL != (item = chan_peer(FBR_A_ head))) {
+		fbr_ev_upcast(item->ev, fbr_ev_chan)->closed = 1;
+		transfer_later(FBR_A_ item);
+	}
+}
+
+void fbr_chan_close(FBR_P_ struct fbr_chan *chan)
+{
+	if (chan->closed)
+		return;
+	chan->closed = 1;
+	chan_close_waiters(FBR_A_ &chan->senders);
+	chan_close_waiters(FBR_A_ &chan->receivers);
+}
+
+void fbr_chan_destroy(_unused_ FBR_P_ struct fbr_chan *chan)
+{
+	assert(TAILQ_EMPTY(&chan->senders) && TAILQ_EMPTY(&chan->receivers) &&
+			"Channel is destroyed while being awaited");
+	free(chan);
+}
+
+int fbr_select(FBR_P_ struct fbr_ev_base *events[], ev_tstamp timeout)
+{
+	int n_events;
+	int i;
+
+	if (timeout < 0.)
+		n_events = fbr_ev_wait(FBR_A_ events);
+	else
+		n_events = fbr_ev_wait_to(FBR_A_ events, timeout);
+	if (n_events < 0)
+		return -1;
+	for (i = 0; NULL != events[i]; i++)
+		if (events[i]->arrived)
+			return_success(i);
+	return_error(-1, FBR_ETIMEDOUT);
+}
+
+static int vrb_open_fd(size_t size, const char *file_pattern, int hugetlb)
+{
+	int fd = -1;
+	char *temp_name = NULL;
+	mode_t old_umask;
+	const mode_t secure_umask = 077;
+#ifdef HAVE_MEMFD_CREATE
+	unsigned flags = MFD_CLOEXEC;
+
+	if (hugetlb) {
+#ifdef MFD_HUGETLB
+		flags |= MFD_HUGETLB;
+#else
+		return -1;
+#endif
+	}
+	fd = memfd_create("fbr_vrb", flags);
+	if (0 <= fd)
+		goto truncate;
+	/* Files are a fallback for kernels without memfd only */
+	if (ENOSYS != errno)
+		return -1;
+#endif
+	if (hugetlb)
+		return -1;
+
+	temp_name = strdup(file_pattern);
+	if (!temp_name)
+		return -1;
+	old_umask = umask(0);
+	umask(secure_umask);
 	fd = mkstemp(temp_name);
 	umask(old_umask);
-	if (0 >= fd)
+	if (0 > fd)
 		goto error;
-
 	if (0 > unlink(temp_name))
 		goto error;
 	free(temp_name);
 	temp_name = NULL;
 
+#ifdef HAVE_MEMFD_CREATE
+truncate:
+#endif
 	if (0 > ftruncate(fd, size))
 		goto error;
+	return fd;
+
+error:
+	if (0 <= fd)
+		close(fd);
+	if (temp_name)
+		free(temp_name);
+	return -1;
+}
+
+static size_t vrb_align(unsigned flags)
+{
+	return (flags & FBR_VRB_HUGETLB) ? get_huge_page_size() :
+		get_page_size();
+}
+
+/* Reserves address space and maps fd twice into it, leaving data pointers
+ * alone */
+static int vrb_mirror(struct fbr_vrb *vrb, int fd, size_t size, size_t align)
+{
+	size_t sz = get_page_size();
+	void *ptr;
+
+	vrb->mem_ptr_size = size * 2 + align * 2;
+	vrb->mem_ptr = mmap(NULL, vrb->mem_ptr_size, PROT_NONE,
+			FBR_MAP_ANON_FLAG | MAP_PRIVATE, -1, 0);
+	if (MAP_FAILED == vrb->mem_ptr)
+		return -1;
+	/* Leaves at least a page of guard on both sides */
+	vrb->lower_ptr = (void *)(((uintptr_t)vrb->mem_ptr + sz + align - 1) /
+			align * align);
+	vrb->upper_ptr = vrb->lower_ptr + size;
+	vrb->ptr_size = size;
+
+	ptr = mmap(vrb->lower_ptr, vrb->ptr_size, PROT_READ | PROT_WRITE,
+			MAP_FIXED | MAP_SHARED, fd, 0);
+	if (ptr != vrb->lower_ptr)
+		goto error;
+
+	ptr = mmap(vrb->upper_ptr, vrb->ptr_size, PROT_READ | PROT_WRITE,
+			MAP_FIXED | MAP_SHARED, fd, 0);
+	if (ptr != vrb->upper_ptr)
+		goto error;
+	return 0;
+
+error:
+	/* Fixed mappings lie within the reservation */
+	munmap(vrb->mem_ptr, vrb->mem_ptr_size);
+	return -1;
+}
+
+static int vrb_map(struct fbr_vrb *vrb, size_t size, const char *file_pattern,
+		unsigned flags)
+{
+	int fd;
+	size_t align = vrb_align(flags);
+
+	if (0 == align)
+		return -1;
+	size = (size ? (size + align - 1) / align * align : align);
+
+	fd = vrb_open_fd(size, file_pattern, flags & FBR_VRB_HUGETLB);
+	if (0 > fd)
+		return -1;
+	if (vrb_mirror(vrb, fd, size, align)) {
+		close(fd);
+		return -1;
+	}
+	vrb->data_ptr = vrb->lower_ptr;
+	vrb->space_ptr = vrb->lower_ptr;
+	vrb->flags = flags;
+	if (flags & FBR_VRB_RESIZABLE) {
+		vrb->fd = fd;
+	} else {
+		close(fd);
+		vrb->fd = -1;
+	}
+	return 0;
+}
+
+int fbr_vrb_init_flags(struct fbr_vrb *vrb, size_t size,
+		const char *file_pattern, unsigned flags)
+{
+	/* Huge pages might not be reserved, regular ones will do then */
+	if (!(flags & FBR_VRB_HUGETLB))
+		return vrb_map(vrb, size, file_pattern, flags);
+	if (0 == vrb_map(vrb, size, file_pattern, flags))
+		return 0;
+	if (vrb_map(vrb, size, file_pattern, flags & ~FBR_VRB_HUGETLB))
+		return -1;
+#ifdef MADV_HUGEPAGE
+	/* Honored for shared memory if shmem_enabled allows advise */
+	madvise(vrb->lower_ptr, vrb->ptr_size, MADV_HUGEPAGE);
+	madvise(vrb->upper_ptr, vrb->ptr_size, MADV_HUGEPAGE);
+#endif
+	return 0;
+}
+
+int fbr_vrb_init(struct fbr_vrb *vrb, size_t size, const char *file_pattern)
+{
+	return fbr_vrb_init_flags(vrb, size, file_pattern, 0);
+}
+
+static int vrb_resize_copy(struct fbr_vrb *vrb, size_t size,
+		const char *file_pattern)
+{
+	struct fbr_vrb tmp;
+
+	if (vrb_map(&tmp, size, file_pattern, vrb->flags))
+		return -1;
+	memcpy(fbr_vrb_space_ptr(&tmp), fbr_vrb_data_ptr(vrb),
+			fbr_vrb_data_len(vrb));
+	fbr_vrb_give(&tmp, fbr_vrb_data_len(vrb));
+	fbr_vrb_destroy(vrb);
+	*vrb = tmp;
+	return 0;
+}
+
+static int vrb_resize_in_place(struct fbr_vrb *vrb, size_t size)
+{
+	struct fbr_vrb tmp = *vrb;
+	size_t old_size = vrb->ptr_size;
+	size_t len = fbr_vrb_data_len(vrb);
+	size_t offset = vrb->data_ptr - vrb->lower_ptr;
+	size_t wrapped, head;
+	void *bounce = NULL;
+	int retval;
+
+	if (size > old_size) {
+		if (0 > ftruncate(vrb->fd, size))
+			return -1;
+	} else if (len > 0 && offset + len > size) {
+		/* Data is not within the part of the file being kept */
+		bounce = malloc(len);
+		if (NULL == bounce)
+			return -1;
+		memcpy(bounce, vrb->data_ptr, len);
+		offset = 0;
+	}
+	if (vrb_mirror(&tmp, vrb->fd, size, vrb_align(vrb->flags))) {
+		free(bounce);
+		return -1;
+	}
+	munmap(vrb->mem_ptr, vrb->mem_ptr_size);
+	/* Gives the memory back, failure to do so is harmless */
+	if (size < old_size) {
+		retval = ftruncate(vrb->fd, size);
+		(void)retval;
+	}
+
+	tmp.data_ptr = tmp.lower_ptr + offset;
+	tmp.space_ptr = tmp.data_ptr + len;
+	if (bounce) {
+		memcpy(tmp.data_ptr, bounce, len);
+		free(bounce);
+	} else if (size > old_size && offset + len > old_size) {
+		/* Tail of the data wrapped around to the start of the file has
+		 * to follow the head, which now goes on past old_size */
+		wrapped = offset + len - old_size;
+		head = wrapped < size - old_size ? wrapped : size - old_size;
+		memcpy(tmp.lower_ptr + old_size, tmp.lower_ptr, head);
+		if (wrapped > head)
+			memmove(tmp.lower_ptr, tmp.lower_ptr + head,
+					wrapped - head);
+	}
+	*vrb = tmp;
+	return 0;
+}
+
+int fbr_vrb_resize(struct fbr_vrb *vrb, size_t new_size,
+		const char *file_pattern)
+{
+	size_t align = vrb_align(vrb->flags);
+	size_t size = new_size;
+
+	if (size < fbr_vrb_data_len(vrb))
+		size = fbr_vrb_data_len(vrb);
+	size = (size ? (size + align - 1) / align * align : align);
+	if (size == vrb->ptr_size)
+		return 0;
+	if (0 > vrb->fd)
+		return vrb_resize_copy(vrb, size, file_pattern);
+	return vrb_resize_in_place(vrb, size);
+}
+
+static struct vrb_pool_bucket *vrb_pool_bucket(FBR_P_ size_t capacity,
+		unsigned flags)
+{
+	struct vrb_pool_bucket *bucket;
+
+	LIST_FOREACH(bucket, &fctx->__p->vrb_pool, entries)
+		if (bucket->capacity == capacity && bucket->flags == flags)
+			return bucket;
+	return NULL;
+}
+
+static int vrb_pool_get(FBR_P_ struct fbr_vrb *vrb, size_t size,
+		unsigned flags)
+{
+	struct vrb_pool_bucket *bucket;
+	struct vrb_pool_item *item;
+	size_t align = vrb_align(flags);
+
+	if (0 == align)
+		return -1;
+	size = (size ? (size + align - 1) / align * align : align);
+	bucket = vrb_pool_bucket(FBR_A_ size, flags);
+	if (NULL == bucket || TAILQ_EMPTY(&bucket->items))
+		return -1;
+	/* Most recently pooled mapping is the most likely to be resident */
+	item = TAILQ_FIRST(&bucket->items);
+	TAILQ_REMOVE(&bucket->items, item, entries);
+	*vrb = item->vrb;
+	fbr_vrb_reset(vrb);
+	fctx->__p->vrb_pool_bytes -= vrb->ptr_size;
+	return 0;
+}
+
+static void vrb_pool_put(FBR_P_ struct fbr_vrb *vrb)
+{
+	struct vrb_pool_bucket *bucket;
+	struct vrb_pool_item *item;
+
+	if (vrb->ptr_size < sizeof(*item) || fctx->__p->vrb_pool_bytes +
+			vrb->ptr_size > fctx->__p->vrb_pool_max_bytes) {
+		fbr_vrb_destroy(vrb);
+		return;
+	}
+	bucket = vrb_pool_bucket(FBR_A_ vrb->ptr_size, vrb->flags);
+	if (NULL == bucket) {
+		bucket = malloc(sizeof(*bucket));
+		if (NULL == bucket) {
+			fbr_vrb_destroy(vrb);
+			return;
+		}
+		bucket->capacity = vrb->ptr_size;
+		bucket->flags = vrb->flags;
+		TAILQ_INIT(&bucket->items);
+		LIST_INSERT_HEAD(&fctx->__p->vrb_pool, bucket, entries);
+	}
+	item = vrb->lower_ptr;
+	item->vrb = *vrb;
+	TAILQ_INSERT_HEAD(&bucket->items, item, entries);
+	fctx->__p->vrb_pool_bytes += vrb->ptr_size;
+}
+
+void fbr_buffer_pool_trim(FBR_P_ size_t max_bytes)
+{
+	struct vrb_pool_bucket *bucket, *x;
+	struct vrb_pool_item *item;
+	struct fbr_vrb vrb;
+	int evicted = 1;
+
+	/* Evicts the coldest mapping of every bucket in turn */
+	while (fctx->__p->vrb_pool_bytes > max_bytes && evicted) {
+		evicted = 0;
+		LIST_FOREACH(bucket, &fctx->__p->vrb_pool, entries) {
+			if (fctx->__p->vrb_pool_bytes <= max_bytes)
+				break;
+			if (TAILQ_EMPTY(&bucket->items))
+				continue;
+			item = TAILQ_LAST(&bucket->items, vrb_pool_item_tailq);
+			TAILQ_REMOVE(&bucket->items, item, entries);
+			vrb = item->vrb;
+			fctx->__p->vrb_pool_bytes -= vrb.ptr_size;
+			fbr_vrb_destroy(&vrb);
+			evicted = 1;
+		}
+	}
+	LIST_FOREACH_SAFE(bucket, &fctx->__p->vrb_pool, entries, x) {
+		if (!TAILQ_EMPTY(&bucket->items))
+			continue;
+		LIST_REMOVE(bucket, entries);
+		free(bucket);
+	}
+}
+
+void fbr_buffer_pool_set_max(FBR_P_ size_t max_bytes)
+{
+	fctx->__p->vrb_pool_max_bytes = max_bytes;
+	fbr_buffer_pool_trim(FBR_A_ max_bytes);
+}
+
+int fbr_buffer_init(FBR_P_ struct fbr_buffer *buffer, size_t size)
+{
+	return fbr_buffer_init_flags(FBR_A_ buffer, size, 0);
+}
+
+int fbr_buffer_init_flags(FBR_P_ struct fbr_buffer *buffer, size_t size,
+		unsigned flags)
+{
+	int rv;
+
+	if (0 != vrb_pool_get(FBR_A_ &buffer->vrb, size, flags)) {
+		rv = fbr_vrb_init_flags(&buffer->vrb, size,
+				fctx->__p->buffer_file_pattern, flags);
+		if (rv)
+			return_error(-1, FBR_EBUFFERMMAP);
+	}
+
+	buffer->prepared_bytes = 0;
+	buffer->waiting_bytes = 0;
+	buffer->reserved_bytes = 0;
+	TAILQ_INIT(&buffer->reservations);
+	fbr_cond_init(FBR_A_ &buffer->committed_cond);
+	fbr_cond_init(FBR_A_ &buffer->bytes_freed_cond);
+	fbr_mutex_init(FBR_A_ &buffer->write_mutex);
+	fbr_mutex_init(FBR_A_ &buffer->read_mutex);
+	return_success(0);
+}
+
+void fbr_vrb_destroy(struct fbr_vrb *vrb)
+{
+	munmap(vrb->upper_ptr, vrb->ptr_size);
+	munmap(vrb->lower_ptr, vrb->ptr_size);
+	munmap(vrb->mem_ptr, vrb->mem_ptr_size);
+	if (0 <= vrb->fd)
+		close(vrb->fd);
+}
+
+void fbr_buffer_destroy(FBR_P_ struct fbr_buffer *buffer)
+{
+	vrb_pool_put(FBR_A_ &buffer->vrb);
+
+	fbr_mutex_destroy(FBR_A_ &buffer->read_mutex);
+	fbr_mutex_destroy(FBR_A_ &buffer->write_mutex);
+	fbr_cond_destroy(FBR_A_ &buffer->committed_cond);
+	fbr_cond_destroy(FBR_A_ &buffer->bytes_freed_cond);
+}
+
+void *fbr_buffer_alloc_prepare(FBR_P_ struct fbr_buffer *buffer, size_t size)
+{
+	if (size > fbr_buffer_size(FBR_A_ buffer))
+		return_error(NULL, FBR_EINVAL);
+
+	fbr_mutex_lock(FBR_A_ &buffer->write_mutex);
+
+	while (buffer->prepared_bytes > 0)
+		fbr_cond_wait(FBR_A_ &buffer->committed_cond,
+				&buffer->write_mutex);
+
+	assert(0 == buffer->prepared_bytes);
+
+	buffer->prepared_bytes = size;
+
+	while (buffer->reserved_bytes > 0)
+		fbr_cond_wait(FBR_A_ &buffer->committed_cond,
+				&buffer->write_mutex);
+
+	while (fbr_buffer_free_bytes(FBR_A_ buffer) < size)
+		fbr_cond_wait(FBR_A_ &buffer->bytes_freed_cond,
+				&buffer->write_mutex);
+
+	return fbr_buffer_space_ptr(FBR_A_ buffer);
+}
+
+void fbr_buffer_alloc_commit(FBR_P_ struct fbr_buffer *buffer)
+{
+	fbr_vrb_give(&buffer->vrb, buffer->prepared_bytes);
+	buffer->prepared_bytes = 0;
+	/* Reader and writers waiting for the prepared chunk share the cond */
+	fbr_cond_broadcast(FBR_A_ &buffer->committed_cond);
+	fbr_mutex_unlock(FBR_A_ &buffer->write_mutex);
+}
+
+void fbr_buffer_alloc_abort(FBR_P_ struct fbr_buffer *buffer)
+{
+	buffer->prepared_bytes = 0;
+	fbr_cond_broadcast(FBR_A_ &buffer->committed_cond);
+	fbr_mutex_unlock(FBR_A_ &buffer->write_mutex);
+}
+
+void *fbr_buffer_reserve(FBR_P_ struct fbr_buffer *buffer,
+		struct fbr_buffer_rsv *rsv, size_t size)
+{
+	if (size > fbr_buffer_size(FBR_A_ buffer))
+		return_error(NULL, FBR_EINVAL);
+
+	fbr_mutex_lock(FBR_A_ &buffer->write_mutex);
+
+	for (;;) {
+		if (buffer->prepared_bytes > 0)
+			fbr_cond_wait(FBR_A_ &buffer->committed_cond,
+					&buffer->write_mutex);
+		else if (fbr_buffer_free_bytes(FBR_A_ buffer) < size)
+			fbr_cond_wait(FBR_A_ &buffer->bytes_freed_cond,
+					&buffer->write_mutex);
+		else
+			break;
+	}
+
+	rsv->ptr = (char *)fbr_buffer_space_ptr(FBR_A_ buffer) +
+		buffer->reserved_bytes;
+	rsv->size = size;
+	rsv->committed = 0;
+	TAILQ_INSERT_TAIL(&buffer->reservations, rsv, entries);
+	buffer->reserved_bytes += size;
+
+	/* Space freed by a reader wakes one writer, pass what is left on */
+	if (fbr_buffer_free_bytes(FBR_A_ buffer) > 0)
+		fbr_cond_signal(FBR_A_ &buffer->bytes_freed_cond);
+
+	fbr_mutex_unlock(FBR_A_ &buffer->write_mutex);
+	return_success(rsv->ptr);
+}
+
+void fbr_buffer_reserve_commit(FBR_P_ struct fbr_buffer *buffer,
+		struct fbr_buffer_rsv *rsv)
+{
+	size_t published = 0;
+
+	rsv->committed = 1;
+	while ((rsv = TAILQ_FIRST(&buffer->reservations)) && rsv->committed) {
+		TAILQ_REMOVE(&buffer->reservations, rsv, entries);
+		buffer->reserved_bytes -= rsv->size;
+		published += rsv->size;
+	}
+	if (0 == published)
+		return;
+	fbr_vrb_give(&buffer->vrb, published);
+	/* Wakes both readers and writers waiting for reservations to drain */
+	fbr_cond_broadcast(FBR_A_ &buffer->committed_cond);
+}
+
+void *fbr_buffer_read_address(FBR_P_ struct fbr_buffer *buffer, size_t size)
+{
+	int retval;
+	if (size > fbr_buffer_size(FBR_A_ buffer))
+		return_error(NULL, FBR_EINVAL);
+
+	fbr_mutex_lock(FBR_A_ &buffer->read_mutex);
+
+	while (fbr_buffer_bytes(FBR_A_ buffer) < size) {
+		retval = fbr_cond_wait(FBR_A_ &buffer->committed_cond,
+				&buffer->read_mutex);
+		assert(0 == retval);
+		(void)retval;
+	}
+
+	buffer->waiting_bytes = size;
+
+	return_success(fbr_buffer_data_ptr(FBR_A_ buffer));
+}
+
+void fbr_buffer_read_advance(FBR_P_ struct fbr_buffer *buffer)
+{
+	fbr_vrb_take(&buffer->vrb, buffer->waiting_bytes);
+
+	fbr_cond_signal(FBR_A_ &buffer->bytes_freed_cond);
+	fbr_mutex_unlock(FBR_A_ &buffer->read_mutex);
+}
+
+void fbr_buffer_read_discard(FBR_P_ struct fbr_buffer *buffer)
+{
+	fbr_mutex_unlock(FBR_A_ &buffer->read_mutex);
+}
+
+static int fd_wait(FBR_P_ int fd, int events, ev_tstamp timeout)
+{
+	ev_io io;
+	struct fbr_ev_watcher watcher;
+	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
+	int rc = 0;
+
+	ev_io_init(&io, NULL, fd, events);
+	ev_io_start(fctx->__p->loop, &io);
+	dtor.func = watcher_io_dtor;
+	dtor.arg = &io;
+	fbr_destructor_add(FBR_A_ &dtor);
+
+	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
+	if (timeout < 0.)
+		fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+	else
+		rc = fbr_ev_wait_one_wto(FBR_A_ &watcher.ev_base, timeout);
+
+	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
+	ev_io_stop(fctx->__p->loop, &io);
+	return rc;
+}
+
+ssize_t fbr_buffer_read_from_fd(FBR_P_ struct fbr_buffer *buffer, int fd,
+		size_t max, ev_tstamp timeout)
+{
+	ssize_t r;
+	size_t count;
+
+	fbr_mutex_lock(FBR_A_ &buffer->write_mutex);
+
+	for (;;) {
+		if (buffer->prepared_bytes > 0 || buffer->reserved_bytes > 0)
+			fbr_cond_wait(FBR_A_ &buffer->committed_cond,
+					&buffer->write_mutex);
+		else if (0 == fbr_buffer_free_bytes(FBR_A_ buffer))
+			fbr_cond_wait(FBR_A_ &buffer->bytes_freed_cond,
+					&buffer->write_mutex);
+		else
+			break;
+	}
+
+	if (-1 == fd_wait(FBR_A_ fd, EV_READ, timeout)) {
+		fbr_mutex_unlock(FBR_A_ &buffer->write_mutex);
+		return_error(-1, FBR_ETIMEDOUT);
+	}
+	count = fbr_buffer_free_bytes(FBR_A_ buffer);
+	if (count > max)
+		count = max;
+	do {
+		r = read(fd, fbr_buffer_space_ptr(FBR_A_ buffer), count);
+	} while (-1 == r && EINTR == errno);
+	if (r > 0) {
+		fbr_vrb_give(&buffer->vrb, r);
+		fbr_cond_broadcast(FBR_A_ &buffer->committed_cond);
+	}
+
+	fbr_mutex_unlock(FBR_A_ &buffer->write_mutex);
+	if (-1 == r)
+		return_error(-1, FBR_ESYSTEM);
+	return_success(r);
+}
+
+ssize_t fbr_buffer_write_to_fd(FBR_P_ struct fbr_buffer *buffer, int fd,
+		size_t max, ev_tstamp timeout)
+{
+	ssize_t r;
+	size_t count;
+
+	fbr_mutex_lock(FBR_A_ &buffer->read_mutex);
+
+	while (0 == fbr_buffer_bytes(FBR_A_ buffer))
+		fbr_cond_wait(FBR_A_ &buffer->committed_cond,
+				&buffer->read_mutex);
+
+	if (-1 == fd_wait(FBR_A_ fd, EV_WRITE, timeout)) {
+		fbr_mutex_unlock(FBR_A_ &buffer->read_mutex);
+		return_error(-1, FBR_ETIMEDOUT);
+	}
+	count = fbr_buffer_bytes(FBR_A_ buffer);
+	if (count > max)
+		count = max;
+	do {
+		r = write(fd, fbr_buffer_data_ptr(FBR_A_ buffer), count);
+	} while (-1 == r && EINTR == errno);
+	if (r > 0) {
+		fbr_vrb_take(&buffer->vrb, r);
+		fbr_cond_signal(FBR_A_ &buffer->bytes_freed_cond);
+	}
+
+	fbr_mutex_unlock(FBR_A_ &buffer->read_mutex);
+	if (-1 == r)
+		return_error(-1, FBR_ESYSTEM);
+	return_success(r);
+}
+
+int fbr_buffer_resize(FBR_P_ struct fbr_buffer *buffer, size_t size)
+{
+	int rv;
+	fbr_mutex_lock(FBR_A_ &buffer->read_mutex);
+	fbr_mutex_lock(FBR_A_ &buffer->write_mutex);
+	while (buffer->reserved_bytes > 0)
+		fbr_cond_wait(FBR_A_ &buffer->committed_cond,
+				&buffer->write_mutex);
+	rv = fbr_vrb_resize(&buffer->vrb, size, fctx->__p->buffer_file_pattern);
+	fbr_mutex_unlock(FBR_A_ &buffer->write_mutex);
+	fbr_mutex_unlock(FBR_A_ &buffer->read_mutex);
+	if (rv)
+		return_error(-1, FBR_EBUFFERMMAP);
+	return_success(0);
+}
+
+static int ipc_wakeup_open(int fds[2])
+{
+#ifdef HAVE_EVENTFD
+	fds[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (0 > fds[0])
+		return -1;
+	fds[1] = fds[0];
+#else
+	int i;
+
+	if (pipe(fds))
+		return -1;
+	for (i = 0; i < 2; i++) {
+		fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+#endif
+	return 0;
+}
+
+static void ipc_wakeup_close(int fds[2])
+{
+	if (fds[1] != fds[0])
+		close(fds[1]);
+	close(fds[0]);
+}
+
+/* Pairs with ipc_park: either the parked side sees the index update on its
+ * recheck, or we see its flag and wake it up */
+static void ipc_wakeup(int fds[2], int *parked)
+{
+	const uint64_t one = 1;
+	ssize_t retval;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (0 == __atomic_load_n(parked, __ATOMIC_RELAXED))
+		return;
+	if (0 == __atomic_exchange_n(parked, 0, __ATOMIC_ACQ_REL))
+		return;
+	/* Failure means the pipe is full of wakeups already */
+	retval = write(fds[1], &one, sizeof(one));
+	(void)retval;
+}
+
+static void ipc_park(int *parked)
+{
+	__atomic_store_n(parked, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void ipc_sleep(FBR_P_ int fds[2])
+{
+	char buf[64];
+
+	fd_wait(FBR_A_ fds[0], EV_READ, -1.);
+	while (0 < read(fds[0], buf, sizeof(buf)))
+		;
+}
+
+static size_t ipc_data_len(struct fbr_ipc_hdr *hdr)
+{
+	return __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) -
+		__atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+}
+
+static size_t ipc_space_len(struct fbr_ipc_hdr *hdr)
+{
+	return hdr->capacity - ipc_data_len(hdr);
+}
+
+int fbr_ipc_buffer_init(FBR_P_ struct fbr_ipc_buffer *ipc, size_t size)
+{
+	size_t page = get_page_size();
+	int fd;
+	void *ptr;
+
+	size = (size ? (size + page - 1) / page * page : page);
+	/* The header page follows the ring in the same file */
+	fd = vrb_open_fd(size + page, fctx->__p->buffer_file_pattern, 0);
+	if (0 > fd)
+		return_error(-1, FBR_EBUFFERMMAP);
+	if (vrb_mirror(&ipc->vrb, fd, size, page)) {
+		close(fd);
+		return_error(-1, FBR_EBUFFERMMAP);
+	}
+	ptr = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, size);
+	close(fd);
+	ipc->vrb.fd = -1;
+	ipc->vrb.flags = 0;
+	ipc->vrb.data_ptr = ipc->vrb.lower_ptr;
+	ipc->vrb.space_ptr = ipc->vrb.lower_ptr;
+	if (MAP_FAILED == ptr) {
+		fbr_vrb_destroy(&ipc->vrb);
+		return_error(-1, FBR_EBUFFERMMAP);
+	}
+	ipc->hdr = ptr;
+	ipc->hdr->capacity = size;
+
+	if (ipc_wakeup_open(ipc->data_fd))
+		goto wakeup_error;
+	if (ipc_wakeup_open(ipc->space_fd)) {
+		ipc_wakeup_close(ipc->data_fd);
+		goto wakeup_error;
+	}
+
+	ipc->prepared_bytes = 0;
+	ipc->waiting_bytes = 0;
+	fbr_mutex_init(FBR_A_ &ipc->write_mutex);
+	fbr_mutex_init(FBR_A_ &ipc->read_mutex);
+	return_success(0);
+
+wakeup_error:
+	munmap(ipc->hdr, page);
+	fbr_vrb_destroy(&ipc->vrb);
+	return_error(-1, FBR_ESYSTEM);
+}
+
+void fbr_ipc_buffer_destroy(FBR_P_ struct fbr_ipc_buffer *ipc)
+{
+	ipc_wakeup_close(ipc->space_fd);
+	ipc_wakeup_close(ipc->data_fd);
+	munmap(ipc->hdr, get_page_size());
+	fbr_vrb_destroy(&ipc->vrb);
+	fbr_mutex_destroy(FBR_A_ &ipc->read_mutex);
+	fbr_mutex_destroy(FBR_A_ &ipc->write_mutex);
+}
+
+size_t fbr_ipc_buffer_size(_unused_ FBR_P_ struct fbr_ipc_buffer *ipc)
+{
+	return ipc->hdr->capacity;
+}
+
+size_t fbr_ipc_buffer_bytes(_unused_ FBR_P_ struct fbr_ipc_buffer *ipc)
+{
+	return ipc_data_len(ipc->hdr);
+}
+
+size_t fbr_ipc_buffer_free_bytes(_unused_ FBR_P_ struct fbr_ipc_buffer *ipc)
+{
+	return ipc_space_len(ipc->hdr);
+}
+
+void *fbr_ipc_buffer_alloc_prepare(FBR_P_ struct fbr_ipc_buffer *ipc,
+		size_t size)
+{
+	struct fbr_ipc_hdr *hdr = ipc->hdr;
+
+	if (size > hdr->capacity)
+		return_error(NULL, FBR_EINVAL);
+
+	fbr_mutex_lock(FBR_A_ &ipc->write_mutex);
+
+	while (ipc_space_len(hdr) < size) {
+		ipc_park(&hdr->writer_parked);
+		if (ipc_space_len(hdr) >= size)
+			break;
+		ipc_sleep(FBR_A_ ipc->space_fd);
+	}
+	ipc->prepared_bytes = size;
+
+	return_success((char *)ipc->vrb.lower_ptr +
+			hdr->head % hdr->capacity);
+}
+
+void fbr_ipc_buffer_alloc_commit(FBR_P_ struct fbr_ipc_buffer *ipc)
+{
+	struct fbr_ipc_hdr *hdr = ipc->hdr;
+
+	__atomic_store_n(&hdr->head, hdr->head + ipc->prepared_bytes,
+			__ATOMIC_RELEASE);
+	ipc->prepared_bytes = 0;
+	ipc_wakeup(ipc->data_fd, &hdr->reader_parked);
+	fbr_mutex_unlock(FBR_A_ &ipc->write_mutex);
+}
+
+void fbr_ipc_buffer_alloc_abort(FBR_P_ struct fbr_ipc_buffer *ipc)
+{
+	ipc->prepared_bytes = 0;
+	fbr_mutex_unlock(FBR_A_ &ipc->write_mutex);
+}
+
+void *fbr_ipc_buffer_read_address(FBR_P_ struct fbr_ipc_buffer *ipc,
+		size_t size)
+{
+	struct fbr_ipc_hdr *hdr = ipc->hdr;
+
+	if (size > hdr->capacity)
+		return_error(NULL, FBR_EINVAL);
+
+	fbr_mutex_lock(FBR_A_ &ipc->read_mutex);
+
+	while (ipc_data_len(hdr) < size) {
+		ipc_park(&hdr->reader_parked);
+		if (ipc_data_len(hdr) >= size)
+			break;
+		ipc_sleep(FBR_A_ ipc->data_fd);
+	}
+	ipc->waiting_bytes = size;
+
+	return_success((char *)ipc->vrb.lower_ptr +
+			hdr->tail % hdr->capacity);
+}
+
+void fbr_ipc_buffer_read_advance(FBR_P_ struct fbr_ipc_buffer *ipc)
+{
+	struct fbr_ipc_hdr *hdr = ipc->hdr;
+
+	__atomic_store_n(&hdr->tail, hdr->tail + ipc->waiting_bytes,
+			__ATOMIC_RELEASE);
+	ipc->waiting_bytes = 0;
+	ipc_wakeup(ipc->space_fd, &hdr->writer_parked);
+	fbr_mutex_unlock(FBR_A_ &ipc->read_mutex);
+}
+
+void fbr_ipc_buffer_read_discard(FBR_P_ struct fbr_ipc_buffer *ipc)
+{
+	ipc->waiting_bytes = 0;
+	fbr_mutex_unlock(FBR_A_ &ipc->read_mutex);
+}
+
+struct fbr_mq *fbr_mq_create(FBR_P_ size_t size, int flags)
+{
+	struct fbr_mq *mq;
+	size_t capacity = 1;
+
+	/* Rounded up ring of pointers has to fit into size_t */
+	if (size > ((SIZE_MAX >> 1) + 1) / sizeof(void *))
+		return_error(NULL, FBR_EINVAL);
+	while (capacity < size)
+		capacity <<= 1;
+
+	mq = calloc(1, sizeof(*mq));
+	if (NULL == mq)
+		err(EXIT_FAILURE, "calloc failed");
+	mq->fctx = fctx;
+	mq->mask = capacity - 1;
+	mq->rb = calloc(capacity, sizeof(void *));
+	if (NULL == mq->rb)
+		err(EXIT_FAILURE, "calloc failed");
+	mq->flags = flags;
+
+	fbr_cond_init(FBR_A_ &mq->bytes_available_cond);
+	fbr_cond_init(FBR_A_ &mq->bytes_freed_cond);
+
+	return mq;
+}
+
+/* head and tail are free running, the ring is indexed by their low bits */
+static inline size_t mq_count(struct fbr_mq *mq)
+{
+	return mq->head - mq->tail;
+}
+
+static inline int mq_full(struct fbr_mq *mq)
+{
+	return mq_count(mq) > mq->mask;
+}
+
+void fbr_mq_clear(struct fbr_mq *mq, int wake_up_writers)
+{
+	int was_full = mq_full(mq);
+
+	memset(mq->rb, 0x00, (mq->mask + 1) * sizeof(void *));
+	mq->head = 0;
+	mq->tail = 0;
+
+	if (wake_up_writers && was_full)
+		fbr_cond_broadcast(mq->fctx, &mq->bytes_freed_cond);
+}
+
+/* Wakeups are only due on empty->non-empty and full->non-full transitions.
+ * A woken fiber which leaves some room behind passes the wakeup on, so that
+ * the ones still waiting do not get stuck. */
+static void mq_pushed(struct fbr_mq *mq, size_t was, size_t n)
+{
+	if (0 == was)
+		fbr_cond_signal_n(mq->fctx, &mq->bytes_available_cond,
+				min(n, (size_t)UINT_MAX));
+	if (!mq_full(mq) && !TAILQ_EMPTY(&mq->bytes_freed_cond.waiting))
+		fbr_cond_signal(mq->fctx, &mq->bytes_freed_cond);
+}
+
+static void mq_popped(struct fbr_mq *mq, size_t was, size_t n)
+{
+	if (was > mq->mask)
+		fbr_cond_signal_n(mq->fctx, &mq->bytes_freed_cond,
+				min(n, (size_t)UINT_MAX));
+	if (mq_count(mq) && !TAILQ_EMPTY(&mq->bytes_available_cond.waiting))
+		fbr_cond_signal(mq->fctx, &mq->bytes_available_cond);
+}
+
+void fbr_mq_push(struct fbr_mq *mq, void *obj)
+{
+	size_t was;
+
+	fbr_mq_wait_push(mq);
+
+	was = mq_count(mq);
+	mq->rb[mq->head++ & mq->mask] = obj;
+	mq_pushed(mq, was, 1);
+}
+
+int fbr_mq_try_push(struct fbr_mq *mq, void *obj)
+{
+	size_t was;
+
+	/* Cicular buffer is full */
+	if (mq_full(mq))
+		return -1;
+
+	was = mq_count(mq);
+	mq->rb[mq->head++ & mq->mask] = obj;
+	mq_pushed(mq, was, 1);
+	return 0;
+}
+
+size_t fbr_mq_push_n(struct fbr_mq *mq, void **objs, size_t n)
+{
+	size_t was;
+	size_t i;
+
+	if (0 == n)
+		return 0;
+	fbr_mq_wait_push(mq);
+
+	was = mq_count(mq);
+	if (n > mq->mask + 1 - was)
+		n = mq->mask + 1 - was;
+	for (i = 0; i < n; i++)
+		mq->rb[mq->head++ & mq->mask] = objs[i];
+	mq_pushed(mq, was, n);
+	return n;
+}
+
+void fbr_mq_wait_push(struct fbr_mq *mq)
+{
+	while (mq_full(mq))
+		fbr_cond_wait(mq->fctx, &mq->bytes_freed_cond, NULL);
+}
+
+static void *mq_do_pop(struct fbr_mq *mq)
+{
+	void *obj;
+	size_t was = mq_count(mq);
+	size_t i = mq->tail++ & mq->mask;
+
+	obj = mq->rb[i];
+	mq->rb[i] = NULL;
+
+	mq_popped(mq, was, 1);
+	return obj;
+}
+
+void *fbr_mq_pop(struct fbr_mq *mq)
+{
+	fbr_mq_wait_pop(mq);
+
+	return mq_do_pop(mq);
+}
+
+int fbr_mq_try_pop(struct fbr_mq *mq, void **obj)
+{
+	/* if the head isn't ahead of the tail, we don't have any emelemnts */
+	if (mq->head == mq->tail)
+		return -1;
+
+	*obj = mq_do_pop(mq);
+	return 0;
+}
+
+size_t fbr_mq_pop_n(struct fbr_mq *mq, void **objs, size_t n)
+{
+	size_t was;
+	size_t i, j;
+
+	if (0 == n)
+		return 0;
+	fbr_mq_wait_pop(mq);
+
+	was = mq_count(mq);
+	if (n > was)
+		n = was;
+	for (i = 0; i < n; i++) {
+		j = mq->tail++ & mq->mask;
+		objs[i] = mq->rb[j];
+		mq->rb[j] = NULL;
+	}
+	mq_popped(mq, was, n);
+	return n;
+}
+
+void fbr_mq_wait_pop(struct fbr_mq *mq)
+{
+	/* if the head isn't ahead of the tail, we don't have any emelemnts */
+	while (mq->head == mq->tail)
+		fbr_cond_wait(mq->fctx, &mq->bytes_available_cond, NULL);
+}
+
+void fbr_mq_destroy(struct fbr_mq *mq)
+{
+	fbr_cond_destroy(mq->fctx, &mq->bytes_freed_cond);
+	fbr_cond_destroy(mq->fctx, &mq->bytes_available_cond);
+	free(mq->rb);
+	free(mq);
+}
+
+struct fbr_xmq *fbr_xmq_create(FBR_P_ size_t size)
+{
+	struct fbr_xmq *xmq;
+	size_t capacity = 1;
+	size_t i;
+	int retval;
+
+	/* Rounded up ring of slots has to fit into size_t */
+	if (size > ((SIZE_MAX >> 1) + 1) / sizeof(struct fbr_xmq_slot))
+		return_error(NULL, FBR_EINVAL);
+	while (capacity < size)
+		capacity <<= 1;
+
+	retval = posix_memalign((void **)&xmq, FBR_XMQ_CACHELINE, sizeof(*xmq));
+	if (retval)
+		errx(EXIT_FAILURE, "posix_memalign failed: %s", strerror(retval));
+	memset(xmq, 0x00, sizeof(*xmq));
+	xmq->fctx = fctx;
+	xmq->loop = fctx->__p->loop;
+	xmq->mask = capacity - 1;
+	xmq->slots = calloc(capacity, sizeof(struct fbr_xmq_slot));
+	if (NULL == xmq->slots)
+		err(EXIT_FAILURE, "calloc failed");
+	/* Slot i is free for the push number i */
+	for (i = 0; i < capacity; i++)
+		xmq->slots[i].seq = i;
+	ev_async_init(&xmq->async, NULL);
+	return xmq;
+}
+
+int fbr_xmq_push(struct fbr_xmq *xmq, void *obj)
+{
+	struct fbr_xmq_slot *slot;
+	size_t pos, seq;
+
+	pos = __atomic_load_n(&xmq->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &xmq->slots[pos & xmq->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&xmq->tail, &pos,
+						pos + 1, 1, __ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+				break;
+		} else if ((ssize_t)(seq - pos) < 0) {
+			/* Slot has not been consumed since the previous lap */
+			return -1;
+		} else
+			pos = __atomic_load_n(&xmq->tail, __ATOMIC_RELAXED);
+	}
+	slot->obj = obj;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* Pairs with the fence in xmq_park: either the consumer sees the new
+	 * element, or we see it parked. Acquiring the parked flag makes the
+	 * started ev_async, along with libev's wakeup pipe, visible here */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&xmq->parked, __ATOMIC_RELAXED) &&
+			__atomic_exchange_n(&xmq->parked, 0, __ATOMIC_ACQ_REL))
+		ev_async_send(xmq->loop, &xmq->async);
+	return 0;
+}
+
+static int xmq_empty(struct fbr_xmq *xmq)
+{
+	struct fbr_xmq_slot *slot = &xmq->slots[xmq->head & xmq->mask];
+	return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != xmq->head + 1;
+}
+
+int fbr_xmq_try_pop(struct fbr_xmq *xmq, void **obj)
+{
+	struct fbr_xmq_slot *slot = &xmq->slots[xmq->head & xmq->mask];
+
+	if (xmq_empty(xmq))
+		return -1;
+	*obj = slot->obj;
+	/* Hand the slot over to the push one lap ahead */
+	__atomic_store_n(&slot->seq, xmq->head + xmq->mask + 1,
+			__ATOMIC_RELEASE);
+	xmq->head++;
+	return 0;
+}
+
+static void xmq_park(struct fbr_xmq *xmq)
+{
+	struct fbr_context *fctx = xmq->fctx;
+
+	/* Started before parking, as starting an ev_async drops an earlier
+	 * ev_async_send */
+	ev_async_start(xmq->loop, &xmq->async);
+	/* Publishes the started watcher to the producer waking us up */
+	__atomic_store_n(&xmq->parked, 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (xmq_empty(xmq))
+		fbr_async_wait(FBR_A_ &xmq->async);
+	else
+		ev_async_stop(xmq->loop, &xmq->async);
+	__atomic_store_n(&xmq->parked, 0, __ATOMIC_RELAXED);
+}
+
+void *fbr_xmq_pop(struct fbr_xmq *xmq)
+{
+	void *obj;
+
+	while (-1 == fbr_xmq_try_pop(xmq, &obj))
+		xmq_park(xmq);
+	return obj;
+}
+
+size_t fbr_xmq_pop_n(struct fbr_xmq *xmq, void **objs, size_t n)
+{
+	size_t i = 0;
+
+	if (0 == n)
+		return 0;
+	while (xmq_empty(xmq))
+		xmq_park(xmq);
+	while (i < n && 0 == fbr_xmq_try_pop(xmq, objs + i))
+		i++;
+	return i;
+}
+
+void fbr_xmq_destroy(struct fbr_xmq *xmq)
+{
+	ev_async_stop(xmq->loop, &xmq->async);
+	free(xmq->slots);
+	free(xmq);
+}
+
+struct fbr_xbuffer *fbr_xbuffer_create(FBR_P_ size_t size)
+{
+	struct fbr_xbuffer *xbuffer;
+	int retval;
+
+	retval = posix_memalign((void **)&xbuffer, FBR_XMQ_CACHELINE,
+			sizeof(*xbuffer));
+	if (retval)
+		errx(EXIT_FAILURE, "posix_memalign failed: %s", strerror(retval));
+	memset(xbuffer, 0x00, sizeof(*xbuffer));
+	if (fbr_vrb_init(&xbuffer->vrb, size,
+				fctx->__p->buffer_file_pattern)) {
+		free(xbuffer);
+		return_error(NULL, FBR_EBUFFERMMAP);
+	}
+	xbuffer->capacity = fbr_vrb_capacity(&xbuffer->vrb);
+	ev_async_init(&xbuffer->writer.async, NULL);
+	ev_async_init(&xbuffer->reader.async, NULL);
+	return_success(xbuffer);
+}
+
+size_t fbr_xbuffer_size(struct fbr_xbuffer *xbuffer)
+{
+	return xbuffer->capacity;
+}
+
+size_t fbr_xbuffer_bytes(struct fbr_xbuffer *xbuffer)
+{
+	return __atomic_load_n(&xbuffer->head, __ATOMIC_ACQUIRE) -
+		__atomic_load_n(&xbuffer->tail, __ATOMIC_ACQUIRE);
+}
+
+size_t fbr_xbuffer_free_bytes(struct fbr_xbuffer *xbuffer)
+{
+	return xbuffer->capacity - fbr_xbuffer_bytes(xbuffer);
+}
+
+static int xbuffer_ready(struct fbr_xbuffer *xbuffer,
+		struct fbr_xbuffer_side *side, size_t size)
+{
+	if (side == &xbuffer->reader)
+		return fbr_xbuffer_bytes(xbuffer) >= size;
+	return fbr_xbuffer_free_bytes(xbuffer) >= size;
+}
+
+static void xbuffer_park(FBR_P_ struct fbr_xbuffer *xbuffer,
+		struct fbr_xbuffer_side *side, size_t size)
+{
+	side->loop = fctx->__p->loop;
+	/* Started before parking, as starting an ev_async drops an earlier
+	 * ev_async_send */
+	ev_async_start(side->loop, &side->async);
+	/* Publishes the loop and the started watcher, along with libev's wakeup
+	 * pipe, to the thread waking us up */
+	__atomic_store_n(&side->parked, 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!xbuffer_ready(xbuffer, side, size))
+		fbr_async_wait(FBR_A_ &side->async);
+	ev_async_stop(side->loop, &side->async);
+	__atomic_store_n(&side->parked, 0, __ATOMIC_RELAXED);
+}
+
+/* Pairs with the fence in xbuffer_park: either the parked side sees the index
+ * update, or we see it parked. Acquiring the parked flag pairs with its
+ * release store there */
+static void xbuffer_wakeup(struct fbr_xbuffer_side *side)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&side->parked, __ATOMIC_RELAXED) &&
+			__atomic_exchange_n(&side->parked, 0, __ATOMIC_ACQ_REL))
+		ev_async_send(side->loop, &side->async);
+}
+
+void *fbr_xbuffer_alloc_prepare(FBR_P_ struct fbr_xbuffer *xbuffer,
+		size_t size)
+{
+	if (size > xbuffer->capacity)
+		return_error(NULL, FBR_EINVAL);
+	while (!xbuffer_ready(xbuffer, &xbuffer->writer, size))
+		xbuffer_park(FBR_A_ xbuffer, &xbuffer->writer, size);
+	xbuffer->prepared_bytes = size;
+	return_success((char *)xbuffer->vrb.lower_ptr +
+			xbuffer->head % xbuffer->capacity);
+}
+
+void fbr_xbuffer_alloc_commit(struct fbr_xbuffer *xbuffer)
+{
+	__atomic_store_n(&xbuffer->head,
+			xbuffer->head + xbuffer->prepared_bytes,
+			__ATOMIC_RELEASE);
+	xbuffer->prepared_bytes = 0;
+	xbuffer_wakeup(&xbuffer->reader);
+}
+
+void *fbr_xbuffer_read_address(FBR_P_ struct fbr_xbuffer *xbuffer,
+		size_t size)
+{
+	if (size > xbuffer->capacity)
+		return_error(NULL, FBR_EINVAL);
+	while (!xbuffer_ready(xbuffer, &xbuffer->reader, size))
+		xbuffer_park(FBR_A_ xbuffer, &xbuffer->reader, size);
+	xbuffer->waiting_bytes = size;
+	return_success((char *)xbuffer->vrb.lower_ptr +
+			xbuffer->tail % xbuffer->capacity);
+}
+
+void fbr_xbuffer_read_advance(struct fbr_xbuffer *xbuffer)
+{
+	__atomic_store_n(&xbuffer->tail,
+			xbuffer->tail + xbuffer->waiting_bytes,
+			__ATOMIC_RELEASE);
+	xbuffer->waiting_bytes = 0;
+	xbuffer_wakeup(&xbuffer->writer);
+}
+
+void fbr_xbuffer_destroy(struct fbr_xbuffer *xbuffer)
+{
+	fbr_vrb_destroy(&xbuffer->vrb);
+	free(xbuffer);
+}
+
+static struct fbr_iobuf_seg *iobuf_seg_get(FBR_P)
+{
+	struct fbr_iobuf_seg *seg;
+
+	if (!SLIST_EMPTY(&fctx->__p->free_iobuf_segs)) {
+		seg = SLIST_FIRST(&fctx->__p->free_iobuf_segs);
+		SLIST_REMOVE_HEAD(&fctx->__p->free_iobuf_segs, entries);
+		fctx->__p->n_free_iobuf_segs--;
+	} else {
+		seg = malloc(FBR_IOBUF_SEG_SIZE);
+		if (NULL == seg)
+			err(EXIT_FAILURE, "malloc failed");
+	}
+	seg->refs = 1;
+	seg->used = 0;
+	return seg;
+}
+
+static void iobuf_seg_release(FBR_P_ struct fbr_iobuf_seg *seg)
+{
+	assert(seg->refs > 0);
+	if (--seg->refs > 0)
+		return;
+	if (fctx->__p->n_free_iobuf_segs >= FBR_IOBUF_POOL_SIZE) {
+		free(seg);
+		return;
+	}
+	SLIST_INSERT_HEAD(&fctx->__p->free_iobuf_segs, seg, entries);
+	fctx->__p->n_free_iobuf_segs++;
+}
+
+/* Takes over the reference to seg */
+static struct fbr_iobuf_node *iobuf_node_get(FBR_P_ struct fbr_iobuf_seg *seg,
+		size_t off, size_t len)
+{
+	struct fbr_iobuf_node *node;
+
+	if (!SLIST_EMPTY(&fctx->__p->free_iobuf_nodes)) {
+		node = SLIST_FIRST(&fctx->__p->free_iobuf_nodes);
+		SLIST_REMOVE_HEAD(&fctx->__p->free_iobuf_nodes, free_entries);
+		fctx->__p->n_free_iobuf_nodes--;
+	} else {
+		node = malloc(sizeof(*node));
+		if (NULL == node)
+			err(EXIT_FAILURE, "malloc failed");
+	}
+	node->seg = seg;
+	node->off = off;
+	node->len = len;
+	return node;
+}
+
+static void iobuf_node_release(FBR_P_ struct fbr_iobuf_node *node)
+{
+	iobuf_seg_release(FBR_A_ node->seg);
+	if (fctx->__p->n_free_iobuf_nodes >= FBR_IOBUF_POOL_SIZE) {
+		free(node);
+		return;
+	}
+	SLIST_INSERT_HEAD(&fctx->__p->free_iobuf_nodes, node, free_entries);
+	fctx->__p->n_free_iobuf_nodes++;
+}
+
+static void iobuf_insert_tail(struct fbr_iobuf *iobuf,
+		struct fbr_iobuf_node *node)
+{
+	TAILQ_INSERT_TAIL(&iobuf->nodes, node, entries);
+	iobuf->len += node->len;
+	iobuf->n_nodes++;
+}
+
+static void iobuf_remove(FBR_P_ struct fbr_iobuf *iobuf,
+		struct fbr_iobuf_node *node)
+{
+	TAILQ_REMOVE(&iobuf->nodes, node, entries);
+	iobuf->len -= node->len;
+	iobuf->n_nodes--;
+	iobuf_node_release(FBR_A_ node);
+}
+
+void fbr_iobuf_init(_unused_ FBR_P_ struct fbr_iobuf *iobuf)
+{
+	TAILQ_INIT(&iobuf->nodes);
+	iobuf->len = 0;
+	iobuf->n_nodes = 0;
+}
 
-	ptr = mmap(vrb->lower_ptr, vrb->ptr_size, PROT_READ | PROT_WRITE,
-			MAP_FIXED | MAP_SHARED, fd, 0);
-	if (MAP_FAILED == ptr)
-		goto error;
-	if (ptr != vrb->lower_ptr)
-		goto error;
+void fbr_iobuf_destroy(FBR_P_ struct fbr_iobuf *iobuf)
+{
+	while (!TAILQ_EMPTY(&iobuf->nodes))
+		iobuf_remove(FBR_A_ iobuf, TAILQ_FIRST(&iobuf->nodes));
+}
 
-	ptr = mmap(vrb->upper_ptr, vrb->ptr_size, PROT_READ | PROT_WRITE,
-			MAP_FIXED | MAP_SHARED, fd, 0);
-	if (MAP_FAILED == ptr)
-		goto error;
-	if (ptr != vrb->upper_ptr)
-		goto error;
+void fbr_iobuf_append(FBR_P_ struct fbr_iobuf *iobuf, const void *data,
+		size_t len)
+{
+	struct fbr_iobuf_node *node;
+	struct fbr_iobuf_seg *seg;
+	size_t chunk;
 
-	close(fd);
-	return 0;
+	node = TAILQ_LAST(&iobuf->nodes, fbr_iobuf_node_tailq);
+	/* Room past the last view is owned by nobody yet, even if the segment
+	 * is shared */
+	if (node && node->off + node->len == node->seg->used &&
+			node->seg->used < FBR_IOBUF_SEG_DATA_SIZE) {
+		seg = node->seg;
+		chunk = FBR_IOBUF_SEG_DATA_SIZE - seg->used;
+		if (chunk > len)
+			chunk = len;
+		memcpy(seg->data + seg->used, data, chunk);
+		seg->used += chunk;
+		node->len += chunk;
+		iobuf->len += chunk;
+		data = (const char *)data + chunk;
+		len -= chunk;
+	}
+	while (len > 0) {
+		seg = iobuf_seg_get(FBR_A);
+		chunk = FBR_IOBUF_SEG_DATA_SIZE;
+		if (chunk > len)
+			chunk = len;
+		memcpy(seg->data, data, chunk);
+		seg->used = chunk;
+		iobuf_insert_tail(iobuf, iobuf_node_get(FBR_A_ seg, 0, chunk));
+		data = (const char *)data + chunk;
+		len -= chunk;
+	}
+}
 
-error:
-	if (MAP_FAILED != ptr)
-		munmap(ptr, size);
-	if (0 < fd)
-		close(fd);
-	if (vrb->mem_ptr)
-		munmap(vrb->mem_ptr, vrb->mem_ptr_size);
-	if (temp_name)
-		free(temp_name);
-	return -1;
+void fbr_iobuf_concat(_unused_ FBR_P_ struct fbr_iobuf *iobuf,
+		struct fbr_iobuf *other)
+{
+	TAILQ_CONCAT(&iobuf->nodes, &other->nodes, entries);
+	iobuf->len += other->len;
+	iobuf->n_nodes += other->n_nodes;
+	other->len = 0;
+	other->n_nodes = 0;
 }
 
-int fbr_buffer_init(FBR_P_ struct fbr_buffer *buffer, size_t size)
+int fbr_iobuf_split(FBR_P_ struct fbr_iobuf *iobuf, size_t at,
+		struct fbr_iobuf *tail)
 {
-	int rv;
-	rv = fbr_vrb_init(&buffer->vrb, size, fctx->__p->buffer_file_pattern);
-	if (rv)
-		return_error(-1, FBR_EBUFFERMMAP);
+	struct fbr_iobuf_node *node, *next;
+	size_t off = 0;
 
-	buffer->prepared_bytes = 0;
-	buffer->waiting_bytes = 0;
-	fbr_cond_init(FBR_A_ &buffer->committed_cond);
-	fbr_cond_init(FBR_A_ &buffer->bytes_freed_cond);
-	fbr_mutex_init(FBR_A_ &buffer->write_mutex);
-	fbr_mutex_init(FBR_A_ &buffer->read_mutex);
+	if (at > iobuf->len)
+		return_error(-1, FBR_EINVAL);
+
+	TAILQ_FOREACH(node, &iobuf->nodes, entries) {
+		if (off + node->len > at)
+			break;
+		off += node->len;
+	}
+	if (node && off < at) {
+		/* Straddling view is cut in two sharing the segment */
+		node->seg->refs++;
+		next = iobuf_node_get(FBR_A_ node->seg,
+				node->off + (at - off),
+				node->len - (at - off));
+		node->len = at - off;
+		TAILQ_INSERT_AFTER(&iobuf->nodes, node, next, entries);
+		iobuf->n_nodes++;
+		node = next;
+	}
+	while (node) {
+		next = TAILQ_NEXT(node, entries);
+		TAILQ_REMOVE(&iobuf->nodes, node, entries);
+		iobuf->len -= node->len;
+		iobuf->n_nodes--;
+		iobuf_insert_tail(tail, node);
+		node = next;
+	}
 	return_success(0);
 }
 
-void fbr_vrb_destroy(struct fbr_vrb *vrb)
+void fbr_iobuf_clone(FBR_P_ struct fbr_iobuf *iobuf, struct fbr_iobuf *clone)
 {
-	munmap(vrb->upper_ptr, vrb->ptr_size);
-	munmap(vrb->lower_ptr, vrb->ptr_size);
-	munmap(vrb->mem_ptr, vrb->mem_ptr_size);
+	struct fbr_iobuf_node *node;
+
+	TAILQ_FOREACH(node, &iobuf->nodes, entries) {
+		node->seg->refs++;
+		iobuf_insert_tail(clone, iobuf_node_get(FBR_A_ node->seg,
+					node->off, node->len));
+	}
 }
 
-void fbr_buffer_destroy(FBR_P_ struct fbr_buffer *buffer)
+void fbr_iobuf_trim_front(FBR_P_ struct fbr_iobuf *iobuf, size_t len)
 {
-	fbr_vrb_destroy(&buffer->vrb);
+	struct fbr_iobuf_node *node;
 
-	fbr_mutex_destroy(FBR_A_ &buffer->read_mutex);
-	fbr_mutex_destroy(FBR_A_ &buffer->write_mutex);
-	fbr_cond_destroy(FBR_A_ &buffer->committed_cond);
-	fbr_cond_destroy(FBR_A_ &buffer->bytes_freed_cond);
+	while (len > 0 && (node = TAILQ_FIRST(&iobuf->nodes))) {
+		if (node->len > len) {
+			node->off += len;
+			node->len -= len;
+			iobuf->len -= len;
+			return;
+		}
+		len -= node->len;
+		iobuf_remove(FBR_A_ iobuf, node);
+	}
 }
 
-void *fbr_buffer_alloc_prepare(FBR_P_ struct fbr_buffer *buffer, size_t size)
+void fbr_iobuf_trim_back(FBR_P_ struct fbr_iobuf *iobuf, size_t len)
 {
-	if (size > fbr_buffer_size(FBR_A_ buffer))
-		return_error(NULL, FBR_EINVAL);
-
-	fbr_mutex_lock(FBR_A_ &buffer->write_mutex);
+	struct fbr_iobuf_node *node;
 
-	while (buffer->prepared_bytes > 0)
-		fbr_cond_wait(FBR_A_ &buffer->committed_cond,
-				&buffer->write_mutex);
+	while (len > 0 &&
+			(node = TAILQ_LAST(&iobuf->nodes, fbr_iobuf_node_tailq))) {
+		if (node->len > len) {
+			node->len -= len;
+			iobuf->len -= len;
+			return;
+		}
+		len -= node->len;
+		iobuf_remove(FBR_A_ iobuf, node);
+	}
+}
 
-	assert(0 == buffer->prepared_bytes);
+size_t fbr_iobuf_peek(struct fbr_iobuf *iobuf, void *buf, size_t len)
+{
+	struct fbr_iobuf_node *node;
+	size_t copied = 0, chunk;
 
-	buffer->prepared_bytes = size;
+	TAILQ_FOREACH(node, &iobuf->nodes, entries) {
+		if (copied == len)
+			break;
+		chunk = node->len;
+		if (chunk > len - copied)
+			chunk = len - copied;
+		memcpy((char *)buf + copied, node->seg->data + node->off,
+				chunk);
+		copied += chunk;
+	}
+	return copied;
+}
 
-	while (fbr_buffer_free_bytes(FBR_A_ buffer) < size)
-		fbr_cond_wait(FBR_A_ &buffer->bytes_freed_cond,
-				&buffer->write_mutex);
+int fbr_iobuf_iov(struct fbr_iobuf *iobuf, struct iovec *iov, int iovcnt)
+{
+	struct fbr_iobuf_node *node;
+	int i = 0;
 
-	return fbr_buffer_space_ptr(FBR_A_ buffer);
+	TAILQ_FOREACH(node, &iobuf->nodes, entries) {
+		if (i == iovcnt)
+			break;
+		iov[i].iov_base = node->seg->data + node->off;
+		iov[i].iov_len = node->len;
+		i++;
+	}
+	return i;
 }
 
-void fbr_buffer_alloc_commit(FBR_P_ struct fbr_buffer *buffer)
+static void conn_close(struct fbr_conn *conn)
 {
-	fbr_vrb_give(&buffer->vrb, buffer->prepared_bytes);
-	buffer->prepared_bytes = 0;
-	fbr_cond_signal(FBR_A_ &buffer->committed_cond);
-	fbr_mutex_unlock(FBR_A_ &buffer->write_mutex);
+	close(conn->fd);
+	conn->bucket->n_total--;
+	free(conn);
 }
 
-void fbr_buffer_alloc_abort(FBR_P_ struct fbr_buffer *buffer)
+static void conn_pool_reap(EV_P_ ev_timer *w, _unused_ int revents)
 {
-	buffer->prepared_bytes = 0;
-	fbr_cond_signal(FBR_A_ &buffer->committed_cond);
-	fbr_mutex_unlock(FBR_A_ &buffer->write_mutex);
+	struct fbr_conn_pool *pool = w->data;
+	struct conn_bucket *bucket;
+	struct fbr_conn *conn;
+	ev_tstamp now = ev_now(EV_A);
+
+	LIST_FOREACH(bucket, &pool->buckets, entries) {
+		/* Idle list is ordered by the time of return, oldest last */
+		while (!TAILQ_EMPTY(&bucket->idle)) {
+			conn = TAILQ_LAST(&bucket->idle, conn_tailq);
+			if (now - conn->idle_since < pool->idle_timeout)
+				break;
+			TAILQ_REMOVE(&bucket->idle, conn, entries);
+			conn_close(conn);
+		}
+	}
 }
 
-void *fbr_buffer_read_address(FBR_P_ struct fbr_buffer *buffer, size_t size)
+struct fbr_conn_pool *fbr_conn_pool_create(FBR_P_ size_t max_conns,
+		ev_tstamp idle_timeout)
 {
-	int retval;
-	if (size > fbr_buffer_size(FBR_A_ buffer))
+	struct fbr_conn_pool *pool;
+
+	if (0 == max_conns || idle_timeout <= 0.)
 		return_error(NULL, FBR_EINVAL);
 
-	fbr_mutex_lock(FBR_A_ &buffer->read_mutex);
+	pool = calloc(1, sizeof(*pool));
+	if (NULL == pool)
+		err(EXIT_FAILURE, "calloc failed");
+	pool->fctx = fctx;
+	pool->max_conns = max_conns;
+	pool->idle_timeout = idle_timeout;
+	LIST_INIT(&pool->buckets);
 
-	while (fbr_buffer_bytes(FBR_A_ buffer) < size) {
-		retval = fbr_cond_wait(FBR_A_ &buffer->committed_cond,
-				&buffer->read_mutex);
-		assert(0 == retval);
-		(void)retval;
-	}
+	ev_timer_init(&pool->reaper, conn_pool_reap, idle_timeout / 2.,
+			idle_timeout / 2.);
+	pool->reaper.data = pool;
+	ev_timer_start(fctx->__p->loop, &pool->reaper);
+	/* Idle connections should not keep the loop running */
+	ev_unref(fctx->__p->loop);
+	return_success(pool);
+}
 
-	buffer->waiting_bytes = size;
+static struct conn_bucket *conn_bucket_get(struct fbr_conn_pool *pool,
+		const struct sockaddr *addr, socklen_t addrlen)
+{
+	struct conn_bucket *bucket;
 
-	return_success(fbr_buffer_data_ptr(FBR_A_ buffer));
+	LIST_FOREACH(bucket, &pool->buckets, entries) {
+		if (bucket->addrlen == addrlen &&
+				0 == memcmp(&bucket->addr, addr, addrlen))
+			return bucket;
+	}
+	bucket = calloc(1, sizeof(*bucket));
+	if (NULL == bucket)
+		err(EXIT_FAILURE, "calloc failed");
+	memcpy(&bucket->addr, addr, addrlen);
+	bucket->addrlen = addrlen;
+	TAILQ_INIT(&bucket->idle);
+	fbr_cond_init(pool->fctx, &bucket->slot_cond);
+	LIST_INSERT_HEAD(&pool->buckets, bucket, entries);
+	return bucket;
+}
+
+static int conn_is_healthy(int fd)
+{
+	char c;
+	ssize_t retval;
+
+	retval = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	/* Peer has closed the connection (0), sent something nobody has asked
+	 * for (> 0) or the socket is in error state */
+	if (-1 == retval && (EAGAIN == errno || EWOULDBLOCK == errno))
+		return 1;
+	return 0;
 }
 
-void fbr_buffer_read_advance(FBR_P_ struct fbr_buffer *buffer)
+static struct fbr_conn *conn_connect(FBR_P_ struct conn_bucket *bucket,
+		ev_tstamp timeout)
 {
-	fbr_vrb_take(&buffer->vrb, buffer->waiting_bytes);
+	struct fbr_conn *conn;
+	int fd;
+	int retval;
+	int saved_errno;
 
-	fbr_cond_signal(FBR_A_ &buffer->bytes_freed_cond);
-	fbr_mutex_unlock(FBR_A_ &buffer->read_mutex);
+	fd = socket(bucket->addr.ss_family, SOCK_STREAM, 0);
+	if (-1 == fd)
+		return_error(NULL, FBR_ESYSTEM);
+	if (-1 == fbr_fd_nonblock(FBR_A_ fd) ||
+			-1 == fcntl(fd, F_SETFD, FD_CLOEXEC))
+		goto error;
+	if (timeout < 0.)
+		retval = fbr_connect(FBR_A_ fd,
+				(struct sockaddr *)&bucket->addr,
+				bucket->addrlen);
+	else
+		retval = fbr_connect_wto(FBR_A_ fd,
+				(struct sockaddr *)&bucket->addr,
+				bucket->addrlen, timeout);
+	if (-1 == retval) {
+		if (ETIMEDOUT == errno && timeout >= 0.) {
+			close(fd);
+			return_error(NULL, FBR_ETIMEDOUT);
+		}
+		goto error;
+	}
+
+	conn = calloc(1, sizeof(*conn));
+	if (NULL == conn)
+		err(EXIT_FAILURE, "calloc failed");
+	conn->fd = fd;
+	conn->bucket = bucket;
+	return_success(conn);
+
+error:
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return_error(NULL, FBR_ESYSTEM);
 }
 
-void fbr_buffer_read_discard(FBR_P_ struct fbr_buffer *buffer)
+struct fbr_conn *fbr_conn_pool_get(FBR_P_ struct fbr_conn_pool *pool,
+		const struct sockaddr *addr, socklen_t addrlen,
+		ev_tstamp timeout)
 {
-	fbr_mutex_unlock(FBR_A_ &buffer->read_mutex);
+	struct conn_bucket *bucket;
+	struct fbr_conn *conn;
+	struct fbr_ev_cond_var ev;
+	struct fbr_ev_base *events[] = {&ev.ev_base, NULL};
+	ev_tstamp deadline = ev_now(fctx->__p->loop) + timeout;
+	ev_tstamp remaining = -1.;
+
+	if (addrlen > sizeof(bucket->addr))
+		return_error(NULL, FBR_EINVAL);
+
+	bucket = conn_bucket_get(pool, addr, addrlen);
+	for (;;) {
+		while (!TAILQ_EMPTY(&bucket->idle)) {
+			conn = TAILQ_FIRST(&bucket->idle);
+			TAILQ_REMOVE(&bucket->idle, conn, entries);
+			if (conn_is_healthy(conn->fd))
+				return_success(conn);
+			conn_close(conn);
+		}
+
+		if (timeout >= 0.) {
+			remaining = deadline - ev_now(fctx->__p->loop);
+			if (remaining <= 0.)
+				return_error(NULL, FBR_ETIMEDOUT);
+		}
+
+		if (bucket->n_total < pool->max_conns) {
+			/* Slot is reserved while we're connecting */
+			bucket->n_total++;
+			conn = conn_connect(FBR_A_ bucket, remaining);
+			if (NULL == conn) {
+				bucket->n_total--;
+				fbr_cond_signal(FBR_A_ &bucket->slot_cond);
+			}
+			return conn;
+		}
+
+		fbr_ev_cond_var_init(FBR_A_ &ev, &bucket->slot_cond, NULL);
+		if (timeout < 0.)
+			fbr_ev_wait_one(FBR_A_ &ev.ev_base);
+		else
+			fbr_ev_wait_to(FBR_A_ events, remaining);
+	}
 }
 
-int fbr_buffer_resize(FBR_P_ struct fbr_buffer *buffer, size_t size)
+int fbr_conn_fd(struct fbr_conn *conn)
 {
-	int rv;
-	fbr_mutex_lock(FBR_A_ &buffer->read_mutex);
-	fbr_mutex_lock(FBR_A_ &buffer->write_mutex);
-	rv = fbr_vrb_resize(&buffer->vrb, size, fctx->__p->buffer_file_pattern);
-	fbr_mutex_unlock(FBR_A_ &buffer->write_mutex);
-	fbr_mutex_unlock(FBR_A_ &buffer->read_mutex);
-	if (rv)
-		return_error(-1, FBR_EBUFFERMMAP);
-	return_success(0);
+	return conn->fd;
 }
 
-struct fbr_mq *fbr_mq_create(FBR_P_ size_t size, int flags)
+void fbr_conn_pool_put(FBR_P_ _unused_ struct fbr_conn_pool *pool,
+		struct fbr_conn *conn, int reuse)
 {
-	struct fbr_mq *mq;
-
-	mq = calloc(1, sizeof(*mq));
-	mq->fctx = fctx;
-	mq->max = size + 1; /* One element is always unused */
-	mq->rb = calloc(mq->max, sizeof(void *));
-	mq->flags = flags;
-
-	fbr_cond_init(FBR_A_ &mq->bytes_available_cond);
-	fbr_cond_init(FBR_A_ &mq->bytes_freed_cond);
+	struct conn_bucket *bucket = conn->bucket;
 
-	return mq;
+	if (reuse) {
+		conn->idle_since = ev_now(fctx->__p->loop);
+		TAILQ_INSERT_HEAD(&bucket->idle, conn, entries);
+	} else {
+		conn_close(conn);
+	}
+	fbr_cond_signal(FBR_A_ &bucket->slot_cond);
 }
 
-void fbr_mq_clear(struct fbr_mq *mq, int wake_up_writers)
+void fbr_conn_pool_destroy(FBR_P_ struct fbr_conn_pool *pool)
 {
-	memset(mq->rb, 0x00, mq->max * sizeof(void *));
-	mq->head = 0;
-	mq->tail = 0;
+	struct conn_bucket *bucket, *x;
+	struct fbr_conn *conn;
 
-	if (wake_up_writers)
-		fbr_cond_signal(mq->fctx, &mq->bytes_available_cond);
+	ev_ref(fctx->__p->loop);
+	ev_timer_stop(fctx->__p->loop, &pool->reaper);
+
+	LIST_FOREACH_SAFE(bucket, &pool->buckets, entries, x) {
+		while (!TAILQ_EMPTY(&bucket->idle)) {
+			conn = TAILQ_FIRST(&bucket->idle);
+			TAILQ_REMOVE(&bucket->idle, conn, entries);
+			conn_close(conn);
+		}
+		assert(0 == bucket->n_total &&
+				"All connections should be returned to the pool");
+		fbr_cond_destroy(FBR_A_ &bucket->slot_cond);
+		free(bucket);
+	}
+	free(pool);
 }
 
-void fbr_mq_push(struct fbr_mq *mq, void *obj)
+#define ALIGN_AI(size) (((size) + __alignof__(struct addrinfo) - 1) & \
+		~(__alignof__(struct addrinfo) - 1))
+
+/* Copies addrinfo list into a single memory block, which is released with a
+ * single free() */
+static struct addrinfo *addrinfo_pack(const struct addrinfo *src)
 {
-	unsigned next;
+	const struct addrinfo *ai;
+	struct addrinfo *head, *dst, *prev = NULL;
+	size_t size = 0;
+	size_t len;
+	char *ptr;
 
-	while ((next = ((mq->head + 1) % mq->max )) == mq->tail)
-		fbr_cond_wait(mq->fctx, &mq->bytes_freed_cond, NULL);
+	for (ai = src; ai; ai = ai->ai_next) {
+		size += ALIGN_AI(sizeof(struct addrinfo));
+		size += ALIGN_AI(ai->ai_addrlen);
+		if (ai->ai_canonname)
+			size += ALIGN_AI(strlen(ai->ai_canonname) + 1);
+	}
+	if (0 == size)
+		return NULL;
+	head = malloc(size);
+	if (NULL == head)
+		err(EXIT_FAILURE, "malloc failed");
+
+	ptr = (char *)head;
+	for (ai = src; ai; ai = ai->ai_next) {
+		dst = (struct addrinfo *)ptr;
+		ptr += ALIGN_AI(sizeof(struct addrinfo));
+		*dst = *ai;
+		dst->ai_next = NULL;
+		dst->ai_addr = (struct sockaddr *)ptr;
+		memcpy(ptr, ai->ai_addr, ai->ai_addrlen);
+		ptr += ALIGN_AI(ai->ai_addrlen);
+		if (ai->ai_canonname) {
+			len = strlen(ai->ai_canonname) + 1;
+			dst->ai_canonname = ptr;
+			memcpy(ptr, ai->ai_canonname, len);
+			ptr += ALIGN_AI(len);
+		}
+		if (prev)
+			prev->ai_next = dst;
+		prev = dst;
+	}
+	return head;
+}
 
-	mq->rb[mq->head] = obj;
-	mq->head = next;
+static char *dns_key(const char *node, const char *service,
+		const struct addrinfo *hints, unsigned *hash_ptr)
+{
+	char *key;
+	int len;
+	unsigned hash = 2166136261u;
+	const unsigned char *p;
+	struct addrinfo no_hints;
 
-	fbr_cond_signal(mq->fctx, &mq->bytes_available_cond);
+	if (NULL == hints) {
+		memset(&no_hints, 0x00, sizeof(no_hints));
+		no_hints.ai_flags = -1;
+		hints = &no_hints;
+	}
+	/* Strings are length-prefixed to keep the key unambiguous */
+	len = asprintf(&key, "%d %d %d %d %zd:%s %zd:%s", hints->ai_flags,
+			hints->ai_family, hints->ai_socktype,
+			hints->ai_protocol,
+			node ? (ssize_t)strlen(node) : -1, node ? node : "",
+			service ? (ssize_t)strlen(service) : -1,
+			service ? service : "");
+	if (-1 == len)
+		err(EXIT_FAILURE, "asprintf failed");
+
+	/* FNV-1a */
+	for (p = (const unsigned char *)key; *p; p++) {
+		hash ^= *p;
+		hash *= 16777619u;
+	}
+	*hash_ptr = hash;
+	return key;
 }
 
-int fbr_mq_try_push(struct fbr_mq *mq, void *obj)
+static void dns_entry_free(FBR_P_ struct dns_entry *entry)
 {
-	unsigned next = mq->head + 1;
-	if (next >= mq->max)
-		next = 0;
+	fbr_cond_destroy(FBR_A_ &entry->cond);
+	free(entry->key);
+	free(entry->node);
+	free(entry->service);
+	free(entry->result);
+	free(entry);
+}
 
-	/* Cicular buffer is full */
-	if (next == mq->tail)
-		return -1;
+static void dns_entry_unref(FBR_P_ struct dns_entry *entry)
+{
+	assert(entry->refs > 0);
+	if (0 == --entry->refs)
+		dns_entry_free(FBR_A_ entry);
+}
 
-	mq->rb[mq->head] = obj;
-	mq->head = next;
+static void dns_entry_unlink(FBR_P_ struct fbr_resolver *resolver,
+		struct dns_entry *entry)
+{
+	if (!entry->hashed)
+		return;
+	LIST_REMOVE(entry, hash_entries);
+	entry->hashed = 0;
+	if (entry->in_lru) {
+		TAILQ_REMOVE(&resolver->lru, entry, lru_entries);
+		entry->in_lru = 0;
+		resolver->n_cached--;
+	}
+	dns_entry_unref(FBR_A_ entry);
+}
 
-	fbr_cond_signal(mq->fctx, &mq->bytes_available_cond);
+static int dns_error_is_cacheable(int error)
+{
+	if (EAI_NONAME == error)
+		return 1;
+#ifdef EAI_NODATA
+	if (EAI_NODATA == error)
+		return 1;
+#endif
 	return 0;
 }
 
-void fbr_mq_wait_push(struct fbr_mq *mq)
+static void dns_entry_complete(FBR_P_ struct fbr_resolver *resolver,
+		struct dns_entry *entry)
 {
-	while (((mq->head + 1) % mq->max) == mq->tail)
-		fbr_cond_wait(mq->fctx, &mq->bytes_freed_cond, NULL);
+	ev_tstamp ttl;
+
+	entry->pending = 0;
+	if (0 == entry->error)
+		ttl = fctx->__p->dns_positive_ttl;
+	else if (dns_error_is_cacheable(entry->error))
+		ttl = fctx->__p->dns_negative_ttl;
+	else
+		ttl = 0.;
+
+	if (ttl > 0. && entry->hashed) {
+		entry->expires = ev_now(fctx->__p->loop) + ttl;
+		TAILQ_INSERT_TAIL(&resolver->lru, entry, lru_entries);
+		entry->in_lru = 1;
+		resolver->n_cached++;
+		if (resolver->n_cached > FBR_DNS_CACHE_SIZE)
+			dns_entry_unlink(FBR_A_ resolver,
+					TAILQ_FIRST(&resolver->lru));
+	} else {
+		dns_entry_unlink(FBR_A_ resolver, entry);
+	}
 }
 
-static void *mq_do_pop(struct fbr_mq *mq)
+static void *resolver_thread(void *_arg)
 {
-	void *obj;
-	unsigned next;
+	struct fbr_resolver *resolver = _arg;
+	struct dns_entry *entry;
+	struct addrinfo *res;
 
-	obj = mq->rb[mq->tail];
-	mq->rb[mq->tail] = NULL;
+	pthread_mutex_lock(&resolver->lock);
+	for (;;) {
+		while (TAILQ_EMPTY(&resolver->queue) && !resolver->stop)
+			pthread_cond_wait(&resolver->cond, &resolver->lock);
+		if (resolver->stop)
+			break;
+		entry = TAILQ_FIRST(&resolver->queue);
+		TAILQ_REMOVE(&resolver->queue, entry, queue_entries);
+		pthread_mutex_unlock(&resolver->lock);
+
+		res = NULL;
+		entry->error = getaddrinfo(entry->node, entry->service,
+				entry->has_hints ? &entry->hints : NULL, &res);
+		entry->sys_errno = errno;
+		if (0 == entry->error) {
+			entry->result = addrinfo_pack(res);
+			freeaddrinfo(res);
+		}
 
-	next = mq->tail + 1;
-	if (next >= mq->max)
-		next = 0;
+		pthread_mutex_lock(&resolver->lock);
+		TAILQ_INSERT_TAIL(&resolver->done, entry, queue_entries);
+		ev_async_send(resolver->fctx->__p->loop, &resolver->done_async);
+	}
+	pthread_mutex_unlock(&resolver->lock);
+	return NULL;
+}
+
+static void resolver_done_cb(EV_P_ ev_async *w, _unused_ int revents)
+{
+	struct fbr_resolver *resolver = w->data;
+	struct fbr_context *fctx = resolver->fctx;
+	struct dns_entry_tailq done;
+	struct dns_entry *entry;
+
+	TAILQ_INIT(&done);
+	pthread_mutex_lock(&resolver->lock);
+	TAILQ_CONCAT(&done, &resolver->done, queue_entries);
+	pthread_mutex_unlock(&resolver->lock);
+
+	while (!TAILQ_EMPTY(&done)) {
+		entry = TAILQ_FIRST(&done);
+		TAILQ_REMOVE(&done, entry, queue_entries);
+		resolver->in_flight--;
+		dns_entry_complete(FBR_A_ resolver, entry);
+		fbr_cond_broadcast(FBR_A_ &entry->cond);
+		/* Reference held by the request itself */
+		dns_entry_unref(FBR_A_ entry);
+	}
 
-	mq->tail = next;
+	/* Nothing more to wait for, let the loop finish if it wants to */
+	if (0 == resolver->in_flight)
+		ev_async_stop(EV_A_ w);
+}
 
-	fbr_cond_signal(mq->fctx, &mq->bytes_freed_cond);
-	return obj;
+static struct fbr_resolver *resolver_get(FBR_P)
+{
+	struct fbr_resolver *resolver;
+	sigset_t all, old;
+	unsigned i;
+	int retval;
+
+	if (fctx->__p->resolver)
+		return fctx->__p->resolver;
+
+	resolver = calloc(1, sizeof(*resolver));
+	if (NULL == resolver)
+		err(EXIT_FAILURE, "calloc failed");
+	resolver->fctx = fctx;
+	pthread_mutex_init(&resolver->lock, NULL);
+	pthread_cond_init(&resolver->cond, NULL);
+	TAILQ_INIT(&resolver->queue);
+	TAILQ_INIT(&resolver->done);
+	TAILQ_INIT(&resolver->lru);
+	for (i = 0; i < FBR_DNS_CACHE_BUCKETS; i++)
+		LIST_INIT(&resolver->buckets[i]);
+	ev_async_init(&resolver->done_async, resolver_done_cb);
+	resolver->done_async.data = resolver;
+
+	/* Resolver threads should never handle signals, libev expects them to
+	 * be delivered to the loop thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (i = 0; i < FBR_RESOLVER_THREADS; i++) {
+		retval = pthread_create(&resolver->threads[i], NULL,
+				resolver_thread, resolver);
+		if (retval)
+			break;
+		resolver->n_threads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (0 == resolver->n_threads) {
+		pthread_cond_destroy(&resolver->cond);
+		pthread_mutex_destroy(&resolver->lock);
+		free(resolver);
+		errno = retval;
+		return NULL;
+	}
+	fctx->__p->resolver = resolver;
+	return resolver;
 }
 
-void *fbr_mq_pop(struct fbr_mq *mq)
+static void resolver_destroy(FBR_P)
 {
+	struct fbr_resolver *resolver = fctx->__p->resolver;
+	struct dns_entry *entry;
+	unsigned i;
 
-	/* if the head isn't ahead of the tail, we don't have any emelemnts */
-	while (mq->head == mq->tail)
-		fbr_cond_wait(mq->fctx, &mq->bytes_available_cond, NULL);
+	if (NULL == resolver)
+		return;
 
-	return mq_do_pop(mq);
+	pthread_mutex_lock(&resolver->lock);
+	resolver->stop = 1;
+	pthread_cond_broadcast(&resolver->cond);
+	pthread_mutex_unlock(&resolver->lock);
+	for (i = 0; i < resolver->n_threads; i++)
+		pthread_join(resolver->threads[i], NULL);
+	ev_async_stop(fctx->__p->loop, &resolver->done_async);
+
+	/* Requests still queued or completed but not yet processed */
+	TAILQ_CONCAT(&resolver->queue, &resolver->done, queue_entries);
+	while (!TAILQ_EMPTY(&resolver->queue)) {
+		entry = TAILQ_FIRST(&resolver->queue);
+		TAILQ_REMOVE(&resolver->queue, entry, queue_entries);
+		dns_entry_unref(FBR_A_ entry);
+	}
+	for (i = 0; i < FBR_DNS_CACHE_BUCKETS; i++) {
+		while (!LIST_EMPTY(&resolver->buckets[i]))
+			dns_entry_unlink(FBR_A_ resolver,
+					LIST_FIRST(&resolver->buckets[i]));
+	}
+
+	pthread_cond_destroy(&resolver->cond);
+	pthread_mutex_destroy(&resolver->lock);
+	free(resolver);
+	fctx->__p->resolver = NULL;
+}
+
+static struct dns_entry *dns_entry_submit(FBR_P_
+		struct fbr_resolver *resolver, char *key, unsigned hash,
+		const char *node, const char *service,
+		const struct addrinfo *hints)
+{
+	struct dns_entry *entry;
+
+	entry = calloc(1, sizeof(*entry));
+	if (NULL == entry)
+		err(EXIT_FAILURE, "calloc failed");
+	entry->key = key;
+	entry->hash = hash;
+	if (node && NULL == (entry->node = strdup(node)))
+		err(EXIT_FAILURE, "strdup failed");
+	if (service && NULL == (entry->service = strdup(service)))
+		err(EXIT_FAILURE, "strdup failed");
+	if (hints) {
+		entry->hints.ai_flags = hints->ai_flags;
+		entry->hints.ai_family = hints->ai_family;
+		entry->hints.ai_socktype = hints->ai_socktype;
+		entry->hints.ai_protocol = hints->ai_protocol;
+		entry->has_hints = 1;
+	}
+	entry->pending = 1;
+	fbr_cond_init(FBR_A_ &entry->cond);
+
+	/* Hashed while pending so that concurrent lookups of the same name
+	 * share the request */
+	LIST_INSERT_HEAD(&resolver->buckets[hash % FBR_DNS_CACHE_BUCKETS],
+			entry, hash_entries);
+	entry->hashed = 1;
+	entry->refs++;
+
+	/* Reference held by the request itself */
+	entry->refs++;
+	if (0 == resolver->in_flight++)
+		ev_async_start(fctx->__p->loop, &resolver->done_async);
+	pthread_mutex_lock(&resolver->lock);
+	TAILQ_INSERT_TAIL(&resolver->queue, entry, queue_entries);
+	pthread_cond_signal(&resolver->cond);
+	pthread_mutex_unlock(&resolver->lock);
+	return entry;
 }
 
-int fbr_mq_try_pop(struct fbr_mq *mq, void **obj)
+static void dns_entry_dtor(FBR_P_ void *_arg)
 {
-	/* if the head isn't ahead of the tail, we don't have any emelemnts */
-	if (mq->head == mq->tail)
-		return -1;
+	dns_entry_unref(FBR_A_ _arg);
+}
 
-	*obj = mq_do_pop(mq);
-	return 0;
+int fbr_getaddrinfo(FBR_P_ const char *node, const char *service,
+		const struct addrinfo *hints, struct addrinfo **res)
+{
+	struct fbr_resolver *resolver;
+	struct dns_entry *entry;
+	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
+	char *key;
+	unsigned hash;
+	int retval;
+	int saved_errno;
+
+	*res = NULL;
+	resolver = resolver_get(FBR_A);
+	if (NULL == resolver)
+		return EAI_SYSTEM;
+
+	key = dns_key(node, service, hints, &hash);
+	LIST_FOREACH(entry, &resolver->buckets[hash % FBR_DNS_CACHE_BUCKETS],
+			hash_entries) {
+		if (entry->hash == hash && 0 == strcmp(entry->key, key))
+			break;
+	}
+	if (entry && !entry->pending &&
+			entry->expires <= ev_now(fctx->__p->loop)) {
+		dns_entry_unlink(FBR_A_ resolver, entry);
+		entry = NULL;
+	}
+	if (entry) {
+		free(key);
+		if (entry->in_lru) {
+			TAILQ_REMOVE(&resolver->lru, entry, lru_entries);
+			TAILQ_INSERT_TAIL(&resolver->lru, entry, lru_entries);
+		}
+	} else {
+		entry = dns_entry_submit(FBR_A_ resolver, key, hash, node,
+				service, hints);
+	}
+
+	entry->refs++;
+	dtor.func = dns_entry_dtor;
+	dtor.arg = entry;
+	fbr_destructor_add(FBR_A_ &dtor);
+	while (entry->pending)
+		fbr_cond_wait(FBR_A_ &entry->cond, NULL);
+
+	retval = entry->error;
+	saved_errno = entry->sys_errno;
+	if (0 == retval)
+		*res = addrinfo_pack(entry->result);
+	fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
+	if (EAI_SYSTEM == retval)
+		errno = saved_errno;
+	return retval;
 }
 
-void fbr_mq_wait_pop(struct fbr_mq *mq)
+void fbr_freeaddrinfo(_unused_ FBR_P_ struct addrinfo *res)
 {
-	/* if the head isn't ahead of the tail, we don't have any emelemnts */
-	while (mq->head == mq->tail)
-		fbr_cond_wait(mq->fctx, &mq->bytes_available_cond, NULL);
+	free(res);
 }
 
-void fbr_mq_destroy(struct fbr_mq *mq)
+void fbr_getaddrinfo_set_ttl(FBR_P_ ev_tstamp positive_ttl,
+		ev_tstamp negative_ttl)
 {
-	fbr_cond_destroy(mq->fctx, &mq->bytes_freed_cond);
-	fbr_cond_destroy(mq->fctx, &mq->bytes_available_cond);
-	free(mq->rb);
-	free(mq);
+	fctx->__p->dns_positive_ttl = positive_ttl;
+	fctx->__p->dns_negative_ttl = negative_ttl;
 }
 
 void *fbr_get_user_data(FBR_P_ fbr_id_t id)
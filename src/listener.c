@@ -0,0 +1,260 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <evfibers/config.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <evfibers/listener.h>
+#include <evfibers_private/fiber.h>
+
+struct listener_worker {
+	struct fbr_listener *listener;
+	pthread_t thread;
+	int thread_started;
+	struct ev_loop *loop;
+	ev_async stop_async;
+	int fd;
+	int cpu;
+};
+
+struct fbr_listener {
+	fbr_accept_handler_t handler;
+	void *arg;
+	unsigned n_workers;
+	struct listener_worker *workers;
+};
+
+static int listener_socket(const struct sockaddr *addr, socklen_t addrlen)
+{
+	int fd;
+	int yes = 1;
+	int flags;
+
+	fd = socket(addr->sa_family, SOCK_STREAM, 0);
+	if (-1 == fd)
+		return -1;
+	if (-1 == setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)))
+		goto error;
+#ifdef SO_REUSEPORT
+	if (-1 == setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)))
+		goto error;
+#endif
+	flags = fcntl(fd, F_GETFL, 0);
+	if (-1 == flags || -1 == fcntl(fd, F_SETFL, flags | O_NONBLOCK))
+		goto error;
+	if (-1 == fcntl(fd, F_SETFD, FD_CLOEXEC))
+		goto error;
+	if (-1 == bind(fd, addr, addrlen))
+		goto error;
+	if (-1 == listen(fd, SOMAXCONN))
+		goto error;
+	return fd;
+
+error:
+	flags = errno;
+	close(fd);
+	errno = flags;
+	return -1;
+}
+
+static void listener_acceptor(FBR_P_ void *_arg)
+{
+	struct listener_worker *worker = _arg;
+	struct fbr_listener *listener = worker->listener;
+	int retval;
+
+	for (;;) {
+		retval = fbr_accept_spawn(FBR_A_ worker->fd,
+				FBR_LISTENER_BUDGET, "handler",
+				listener->handler, listener->arg, 0);
+		if (-1 == retval) {
+			/* Most likely we're out of descriptors, let the
+			 * handlers close some */
+			fbr_log_w(FBR_A_ "libevfibers: listener accept failed:"
+					" %s", strerror(errno));
+			fbr_sleep(FBR_A_ 0.1);
+		}
+	}
+}
+
+static void stop_cb(EV_P_ _unused_ ev_async *w, _unused_ int revents)
+{
+	ev_break(EV_A_ EVBREAK_ALL);
+}
+
+static void *listener_worker_main(void *_arg)
+{
+	struct listener_worker *worker = _arg;
+	struct fbr_context context;
+	fbr_id_t id;
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	cpu_set_t cpuset;
+
+	if (worker->cpu >= 0) {
+		CPU_ZERO(&cpuset);
+		CPU_SET(worker->cpu, &cpuset);
+		/* Pinning is merely an optimization, ignore failures */
+		(void)pthread_setaffinity_np(pthread_self(), sizeof(cpuset),
+				&cpuset);
+	}
+#endif
+
+	fbr_init(&context, worker->loop);
+	id = fbr_create(&context, "acceptor", listener_acceptor, worker, 0);
+	fbr_transfer(&context, id);
+
+	ev_run(worker->loop, 0);
+
+	fbr_destroy(&context);
+	return NULL;
+}
+
+static void listener_free(struct fbr_listener *listener)
+{
+	struct listener_worker *worker;
+	unsigned i;
+
+	for (i = 0; i < listener->n_workers; i++) {
+		worker = listener->workers + i;
+		if (worker->thread_started) {
+			ev_async_send(worker->loop, &worker->stop_async);
+			pthread_join(worker->thread, NULL);
+		}
+		if (worker->loop)
+			ev_loop_destroy(worker->loop);
+		/* Without SO_REUSEPORT socket of the first worker is shared */
+		if (worker->fd >= 0 && (0 == i ||
+					worker->fd != listener->workers[0].fd))
+			close(worker->fd);
+	}
+	free(listener->workers);
+	free(listener);
+}
+
+struct fbr_listener *fbr_listener_create(const struct sockaddr *addr,
+		socklen_t addrlen, unsigned workers, int flags,
+		fbr_accept_handler_t handler, void *arg)
+{
+	struct fbr_listener *listener;
+	struct listener_worker *worker;
+	struct sockaddr_storage bound;
+	socklen_t bound_len = sizeof(bound);
+	long n_cpus;
+	unsigned i;
+	int retval;
+
+	if (NULL == handler || addrlen > sizeof(bound)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_cpus < 1)
+		n_cpus = 1;
+	if (0 == workers)
+		workers = n_cpus;
+
+	listener = calloc(1, sizeof(*listener));
+	if (NULL == listener)
+		return NULL;
+	listener->handler = handler;
+	listener->arg = arg;
+	listener->workers = calloc(workers, sizeof(*listener->workers));
+	if (NULL == listener->workers) {
+		free(listener);
+		return NULL;
+	}
+	listener->n_workers = workers;
+	for (i = 0; i < workers; i++)
+		listener->workers[i].fd = -1;
+
+	for (i = 0; i < workers; i++) {
+		worker = listener->workers + i;
+		worker->listener = listener;
+		worker->cpu = (flags & FBR_LISTENER_PIN_CPU) ? (int)(i % n_cpus)
+			: -1;
+		if (0 == i) {
+			worker->fd = listener_socket(addr, addrlen);
+			if (-1 == worker->fd)
+				goto error;
+			/* Rest of the workers bind to the very same port, which
+			 * matters when port 0 has been requested */
+			retval = getsockname(worker->fd,
+					(struct sockaddr *)&bound, &bound_len);
+			if (-1 == retval)
+				goto error;
+		} else {
+#ifdef SO_REUSEPORT
+			worker->fd = listener_socket((struct sockaddr *)&bound,
+					bound_len);
+			if (-1 == worker->fd)
+				goto error;
+#else
+			worker->fd = listener->workers[0].fd;
+#endif
+		}
+	}
+
+	for (i = 0; i < workers; i++) {
+		worker = listener->workers + i;
+		worker->loop = ev_loop_new(EVFLAG_AUTO);
+		if (NULL == worker->loop) {
+			errno = ENOMEM;
+			goto error;
+		}
+		/* Started before the thread so that a stop request can not
+		 * be missed */
+		ev_async_init(&worker->stop_async, stop_cb);
+		ev_async_start(worker->loop, &worker->stop_async);
+		retval = pthread_create(&worker->thread, NULL,
+				listener_worker_main, worker);
+		if (retval) {
+			errno = retval;
+			goto error;
+		}
+		worker->thread_started = 1;
+	}
+
+	return listener;
+
+error:
+	retval = errno;
+	listener_free(listener);
+	errno = retval;
+	return NULL;
+}
+
+int fbr_listener_sockname(struct fbr_listener *listener,
+		struct sockaddr *addr, socklen_t *addrlen)
+{
+	return getsockname(listener->workers[0].fd, addr, addrlen);
+}
+
+void fbr_listener_destroy(struct fbr_listener *listener)
+{
+	listener_free(listener);
+}
@@ -21,11 +21,14 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <string.h>
+#include <unistd.h>
 #include <ev.h>
 #include <check.h>
 #include <evfibers_private/fiber.h>
 
 #include "buffer.h"
+#include "pattern.h"
 
 struct fiber_arg {
 	struct fbr_buffer buffer;
@@ -173,11 +176,551 @@ START_TEST(test_buffer_basic)
 }
 END_TEST
 
+START_TEST(test_vrb_hugetlb)
+{
+	struct fbr_vrb vrb;
+	size_t capacity;
+	size_t i;
+	char *ptr;
+	int retval;
+
+	/* Falls back to regular pages if no huge pages are reserved */
+	retval = fbr_vrb_init_flags(&vrb, 1, "/tmp/fbr_vrb_test.XXXXXX",
+			FBR_VRB_HUGETLB);
+	fail_unless(0 == retval, NULL);
+	capacity = fbr_vrb_capacity(&vrb);
+	fail_unless(capacity >= (size_t)sysconf(_SC_PAGESIZE), NULL);
+
+	/* Data written across the end is readable contiguously */
+	fail_unless(0 == fbr_vrb_give(&vrb, capacity - 10), NULL);
+	fail_unless(0 == fbr_vrb_take(&vrb, capacity - 10), NULL);
+	ptr = fbr_vrb_space_ptr(&vrb);
+	for (i = 0; i < 100; i++)
+		ptr[i] = i;
+	fail_unless(0 == fbr_vrb_give(&vrb, 100), NULL);
+	fail_unless(0 == fbr_vrb_take(&vrb, 10), NULL);
+	ptr = fbr_vrb_data_ptr(&vrb);
+	for (i = 0; i < 90; i++)
+		fail_unless(ptr[i] == (char)(i + 10), NULL);
+	fbr_vrb_destroy(&vrb);
+}
+END_TEST
+
+static void vrb_fill(struct fbr_vrb *vrb, size_t offset, size_t len)
+{
+	unsigned char *ptr;
+	size_t i;
+
+	fbr_vrb_reset(vrb);
+	fail_unless(0 == fbr_vrb_give(vrb, offset), NULL);
+	fail_unless(0 == fbr_vrb_take(vrb, offset), NULL);
+	ptr = fbr_vrb_space_ptr(vrb);
+	for (i = 0; i < len; i++)
+		ptr[i] = i % 251;
+	fail_unless(0 == fbr_vrb_give(vrb, len), NULL);
+}
+
+static void vrb_check(struct fbr_vrb *vrb, size_t len)
+{
+	unsigned char *ptr = fbr_vrb_data_ptr(vrb);
+	size_t i;
+
+	fail_unless(len == fbr_vrb_data_len(vrb), NULL);
+	for (i = 0; i < len; i++)
+		fail_unless(ptr[i] == i % 251, NULL);
+}
+
+START_TEST(test_vrb_resize)
+{
+	struct fbr_vrb vrb;
+	const char *pattern = "/tmp/fbr_vrb_test.XXXXXX";
+	size_t page = sysconf(_SC_PAGESIZE);
+	int retval;
+
+	retval = fbr_vrb_init_flags(&vrb, page, pattern, FBR_VRB_RESIZABLE);
+	fail_unless(0 == retval, NULL);
+	fail_unless(0 <= vrb.fd, NULL);
+
+	/* Grows in place, the wrapped part follows the rest of data */
+	vrb_fill(&vrb, page - 100, 300);
+	retval = fbr_vrb_resize(&vrb, 4 * page, pattern);
+	fail_unless(0 == retval, NULL);
+	fail_unless(4 * page == fbr_vrb_capacity(&vrb), NULL);
+	fail_unless(page - 100 == (size_t)(vrb.data_ptr - vrb.lower_ptr),
+			NULL);
+	vrb_check(&vrb, 300);
+
+	/* Shrinks past the data */
+	retval = fbr_vrb_resize(&vrb, page, pattern);
+	fail_unless(0 == retval, NULL);
+	fail_unless(page == fbr_vrb_capacity(&vrb), NULL);
+	vrb_check(&vrb, 300);
+
+	/* Does not shrink below the data */
+	vrb_fill(&vrb, 0, 0);
+	retval = fbr_vrb_resize(&vrb, 2 * page, pattern);
+	fail_unless(0 == retval, NULL);
+	vrb_fill(&vrb, 2 * page - 100, 2 * page - 50);
+	retval = fbr_vrb_resize(&vrb, 0, pattern);
+	fail_unless(0 == retval, NULL);
+	fail_unless(2 * page == fbr_vrb_capacity(&vrb), NULL);
+	vrb_check(&vrb, 2 * page - 50);
+
+	/* Wrapped part longer than the growth wraps again */
+	retval = fbr_vrb_resize(&vrb, 3 * page, pattern);
+	fail_unless(0 == retval, NULL);
+	vrb_check(&vrb, 2 * page - 50);
+	fbr_vrb_destroy(&vrb);
+
+	/* Non-resizable ones are copied */
+	retval = fbr_vrb_init(&vrb, page, pattern);
+	fail_unless(0 == retval, NULL);
+	fail_unless(-1 == vrb.fd, NULL);
+	vrb_fill(&vrb, page - 100, 300);
+	retval = fbr_vrb_resize(&vrb, 3 * page, pattern);
+	fail_unless(0 == retval, NULL);
+	vrb_check(&vrb, 300);
+	retval = fbr_vrb_resize(&vrb, 0, pattern);
+	fail_unless(0 == retval, NULL);
+	fail_unless(page == fbr_vrb_capacity(&vrb), NULL);
+	vrb_check(&vrb, 300);
+	fbr_vrb_destroy(&vrb);
+}
+END_TEST
+
+START_TEST(test_buffer_pool)
+{
+	struct fbr_context context;
+	struct fbr_buffer buffer, other;
+	void *mapping;
+	size_t page = sysconf(_SC_PAGESIZE);
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	retval = fbr_buffer_init(&context, &buffer, page);
+	fail_unless(0 == retval, NULL);
+	mapping = fbr_vrb_data_ptr(&buffer.vrb);
+	fbr_vrb_give(&buffer.vrb, 100);
+	fbr_buffer_destroy(&context, &buffer);
+	fail_unless(page == context.__p->vrb_pool_bytes, NULL);
+
+	/* Different capacity does not match */
+	retval = fbr_buffer_init(&context, &other, 2 * page);
+	fail_unless(0 == retval, NULL);
+	fail_unless(page == context.__p->vrb_pool_bytes, NULL);
+
+	/* Same capacity reuses the mapping, reset */
+	retval = fbr_buffer_init(&context, &buffer, 1);
+	fail_unless(0 == retval, NULL);
+	fail_unless(0 == context.__p->vrb_pool_bytes, NULL);
+	fail_unless(mapping == fbr_vrb_data_ptr(&buffer.vrb), NULL);
+	fail_unless(0 == fbr_buffer_bytes(&context, &buffer), NULL);
+	fail_unless(page == fbr_buffer_free_bytes(&context, &buffer), NULL);
+
+	fbr_buffer_destroy(&context, &buffer);
+	fbr_buffer_destroy(&context, &other);
+	fail_unless(3 * page == context.__p->vrb_pool_bytes, NULL);
+	fbr_buffer_pool_trim(&context, 2 * page);
+	fail_unless(2 * page >= context.__p->vrb_pool_bytes, NULL);
+	fail_unless(0 < context.__p->vrb_pool_bytes, NULL);
+
+	/* Pooling can be disabled */
+	fbr_buffer_pool_set_max(&context, 0);
+	fail_unless(0 == context.__p->vrb_pool_bytes, NULL);
+	retval = fbr_buffer_init(&context, &buffer, page);
+	fail_unless(0 == retval, NULL);
+	fbr_buffer_destroy(&context, &buffer);
+	fail_unless(0 == context.__p->vrb_pool_bytes, NULL);
+
+	fbr_destroy(&context);
+}
+END_TEST
+
+#define FD_IO_SIZE (256 * 1024)
+
+struct fd_io_arg {
+	struct fbr_buffer buffer;
+	int in[2];
+	int out[2];
+	size_t pumped;
+};
+
+static void fd_io_source_fiber(FBR_P_ void *_arg)
+{
+	struct fd_io_arg *arg = _arg;
+	unsigned char chunk[4096];
+	size_t i, j;
+	ssize_t retval;
+
+	for (i = 0; i < FD_IO_SIZE; i += sizeof(chunk)) {
+		for (j = 0; j < sizeof(chunk); j++)
+			chunk[j] = pattern_byte(i + j);
+		retval = fbr_write_all(FBR_A_ arg->in[0], chunk, sizeof(chunk));
+		fail_unless(sizeof(chunk) == retval, NULL);
+	}
+	close(arg->in[0]);
+}
+
+static void fd_io_pump_in_fiber(FBR_P_ void *_arg)
+{
+	struct fd_io_arg *arg = _arg;
+	ssize_t retval;
+
+	for (;;) {
+		retval = fbr_buffer_read_from_fd(FBR_A_ &arg->buffer,
+				arg->in[1], 1000, -1.);
+		fail_if(-1 == retval, NULL);
+		if (0 == retval)
+			break;
+		arg->pumped += retval;
+	}
+	fail_unless(FD_IO_SIZE == arg->pumped, NULL);
+}
+
+static void fd_io_pump_out_fiber(FBR_P_ void *_arg)
+{
+	struct fd_io_arg *arg = _arg;
+	size_t total = 0;
+	ssize_t retval;
+
+	while (total < FD_IO_SIZE) {
+		retval = fbr_buffer_write_to_fd(FBR_A_ &arg->buffer,
+				arg->out[1], SIZE_MAX, -1.);
+		fail_unless(0 < retval, NULL);
+		total += retval;
+	}
+	close(arg->out[1]);
+}
+
+static void fd_io_sink_fiber(FBR_P_ void *_arg)
+{
+	struct fd_io_arg *arg = _arg;
+	unsigned char chunk[3000];
+	size_t total = 0, j;
+	ssize_t retval;
+
+	for (;;) {
+		retval = fbr_read(FBR_A_ arg->out[0], chunk, sizeof(chunk));
+		fail_if(-1 == retval, NULL);
+		if (0 == retval)
+			break;
+		for (j = 0; j < (size_t)retval; j++)
+			fail_unless(pattern_byte(total + j) == chunk[j], NULL);
+		total += retval;
+	}
+	fail_unless(FD_IO_SIZE == total, NULL);
+}
+
+static void fd_io_timeout_fiber(FBR_P_ _unused_ void *_arg)
+{
+	struct fbr_buffer buffer;
+	int sv[2];
+	ssize_t retval;
+
+	retval = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_buffer_init(FBR_A_ &buffer, 0);
+	fail_unless(0 == retval, NULL);
+
+	/* Nothing to read, readiness wait times out */
+	retval = fbr_buffer_read_from_fd(FBR_A_ &buffer, sv[1], 100, 0.01);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_ETIMEDOUT == fctx->f_errno, NULL);
+	fail_unless(0 == fbr_buffer_bytes(FBR_A_ &buffer), NULL);
+
+	retval = write(sv[0], "abc", 3);
+	fail_unless(3 == retval, NULL);
+	retval = fbr_buffer_read_from_fd(FBR_A_ &buffer, sv[1], 100, 0.01);
+	fail_unless(3 == retval, NULL);
+	fail_unless(3 == fbr_buffer_bytes(FBR_A_ &buffer), NULL);
+
+	close(sv[0]);
+	close(sv[1]);
+	fbr_buffer_destroy(FBR_A_ &buffer);
+}
+
+START_TEST(test_buffer_fd_io)
+{
+	struct fbr_context context;
+	struct fd_io_arg arg;
+	fbr_id_t ids[5];
+	fbr_fiber_func_t funcs[5] = {
+		fd_io_source_fiber,
+		fd_io_pump_in_fiber,
+		fd_io_pump_out_fiber,
+		fd_io_sink_fiber,
+		fd_io_timeout_fiber,
+	};
+	int retval;
+	size_t i;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	memset(&arg, 0, sizeof(arg));
+	retval = socketpair(AF_UNIX, SOCK_STREAM, 0, arg.in);
+	fail_unless(0 == retval, NULL);
+	retval = pipe(arg.out);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_buffer_init(&context, &arg.buffer, 0);
+	fail_unless(0 == retval, NULL);
+
+	for (i = 0; i < 5; i++) {
+		ids[i] = fbr_create(&context, "fd_io", funcs[i], &arg, 0);
+		fail_if(fbr_id_isnull(ids[i]), NULL);
+		retval = fbr_transfer(&context, ids[i]);
+		fail_unless(0 == retval, NULL);
+	}
+
+	ev_run(EV_DEFAULT, 0);
+
+	for (i = 0; i < 5; i++)
+		fail_unless(fbr_is_reclaimed(&context, ids[i]), NULL);
+
+	close(arg.in[1]);
+	close(arg.out[0]);
+	fbr_buffer_destroy(&context, &arg.buffer);
+	fbr_destroy(&context);
+}
+END_TEST
+
+struct rsv_record {
+	uint32_t producer;
+	uint32_t seq;
+	char payload[56];
+};
+
+struct rsv_arg {
+	struct fbr_buffer buffer;
+	size_t count;
+	unsigned producers;
+	unsigned max_outstanding;
+};
+
+static void rsv_producer_fiber(FBR_P_ void *_arg)
+{
+	struct rsv_arg *arg = _arg;
+	struct fbr_buffer_rsv rsv;
+	struct rsv_record *rec;
+	uint32_t producer = arg->producers++;
+	size_t i, outstanding;
+
+	for (i = 0; i < arg->count; i++) {
+		rec = fbr_buffer_reserve(FBR_A_ &arg->buffer, &rsv,
+				sizeof(*rec));
+		fail_if(NULL == rec, NULL);
+		fail_unless(rsv.ptr == rec, NULL);
+		outstanding = arg->buffer.reserved_bytes / sizeof(*rec);
+		if (outstanding > arg->max_outstanding)
+			arg->max_outstanding = outstanding;
+		/* Let other producers reserve before this one commits */
+		fbr_cooperate(FBR_A);
+		rec->producer = producer;
+		rec->seq = i;
+		memset(rec->payload, 'a' + producer, sizeof(rec->payload));
+		fbr_buffer_reserve_commit(FBR_A_ &arg->buffer, &rsv);
+	}
+}
+
+static void rsv_reader_fiber(FBR_P_ void *_arg)
+{
+	struct rsv_arg *arg = _arg;
+	struct rsv_record *rec;
+	uint32_t next[3] = {0};
+	size_t i;
+
+	for (i = 0; i < 3 * arg->count; i++) {
+		rec = fbr_buffer_read_address(FBR_A_ &arg->buffer,
+				sizeof(*rec));
+		fail_if(NULL == rec, NULL);
+		fail_unless(rec->producer < 3, NULL);
+		fail_unless(next[rec->producer] == rec->seq, NULL);
+		fail_unless('a' + (int)rec->producer == rec->payload[0], NULL);
+		next[rec->producer]++;
+		fbr_buffer_read_advance(FBR_A_ &arg->buffer);
+	}
+}
+
+START_TEST(test_buffer_reserve)
+{
+	struct fbr_context context;
+	struct rsv_arg arg;
+	struct fbr_buffer_rsv a, b;
+	fbr_id_t ids[4];
+	char *pa, *pb;
+	int retval;
+	size_t i;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	memset(&arg, 0, sizeof(arg));
+	retval = fbr_buffer_init(&context, &arg.buffer, 0);
+	fail_unless(0 == retval, NULL);
+
+	/* Commits are published in reservation order */
+	pa = fbr_buffer_reserve(&context, &arg.buffer, &a, 3);
+	fail_if(NULL == pa, NULL);
+	pb = fbr_buffer_reserve(&context, &arg.buffer, &b, 3);
+	fail_unless(pa + 3 == pb, NULL);
+	fail_unless(fbr_buffer_size(&context, &arg.buffer) - 6 ==
+			fbr_buffer_free_bytes(&context, &arg.buffer), NULL);
+	memcpy(pb, "def", 3);
+	fbr_buffer_reserve_commit(&context, &arg.buffer, &b);
+	fail_unless(0 == fbr_buffer_bytes(&context, &arg.buffer), NULL);
+	memcpy(pa, "abc", 3);
+	fbr_buffer_reserve_commit(&context, &arg.buffer, &a);
+	fail_unless(6 == fbr_buffer_bytes(&context, &arg.buffer), NULL);
+	fail_unless(0 == memcmp("abcdef",
+			fbr_buffer_data_ptr(&context, &arg.buffer), 6), NULL);
+	fbr_buffer_reset(&context, &arg.buffer);
+
+	/* Producers fill their reservations concurrently */
+	arg.count = 1000;
+	for (i = 0; i < 3; i++)
+		ids[i] = fbr_create(&context, "rsv_producer",
+				rsv_producer_fiber, &arg, 0);
+	ids[3] = fbr_create(&context, "rsv_reader", rsv_reader_fiber, &arg, 0);
+	for (i = 0; i < 4; i++) {
+		fail_if(fbr_id_isnull(ids[i]), NULL);
+		retval = fbr_transfer(&context, ids[i]);
+		fail_unless(0 == retval, NULL);
+	}
+
+	ev_run(EV_DEFAULT, 0);
+
+	for (i = 0; i < 4; i++)
+		fail_unless(fbr_is_reclaimed(&context, ids[i]), NULL);
+	fail_unless(3 == arg.max_outstanding, NULL);
+	fail_unless(0 == fbr_buffer_bytes(&context, &arg.buffer), NULL);
+	fail_unless(0 == arg.buffer.reserved_bytes, NULL);
+
+	fbr_buffer_destroy(&context, &arg.buffer);
+	fbr_destroy(&context);
+}
+END_TEST
+
+struct mixed_arg {
+	struct fbr_buffer buffer;
+	int prepared;
+	int reserved;
+	int read;
+};
+
+static void mixed_preparer_fiber(FBR_P_ void *_arg)
+{
+	struct mixed_arg *arg = _arg;
+	char *ptr;
+
+	ptr = fbr_buffer_alloc_prepare(FBR_A_ &arg->buffer, 3);
+	fail_if(NULL == ptr, NULL);
+	arg->prepared = 1;
+	fbr_yield(FBR_A);
+	memcpy(ptr, "abc", 3);
+	fbr_buffer_alloc_commit(FBR_A_ &arg->buffer);
+}
+
+static void mixed_reserver_fiber(FBR_P_ void *_arg)
+{
+	struct mixed_arg *arg = _arg;
+	struct fbr_buffer_rsv rsv;
+	char *ptr;
+
+	ptr = fbr_buffer_reserve(FBR_A_ &arg->buffer, &rsv, 1);
+	fail_if(NULL == ptr, NULL);
+	arg->reserved = 1;
+	fbr_yield(FBR_A);
+	*ptr = 'x';
+	fbr_buffer_reserve_commit(FBR_A_ &arg->buffer, &rsv);
+}
+
+static void mixed_reader_fiber(FBR_P_ void *_arg)
+{
+	struct mixed_arg *arg = _arg;
+	size_t size = fbr_buffer_size(FBR_A_ &arg->buffer);
+	char *ptr;
+
+	/* Waits for the buffer to fill up completely */
+	ptr = fbr_buffer_read_address(FBR_A_ &arg->buffer, size);
+	fail_if(NULL == ptr, NULL);
+	fail_unless(0 == memcmp("abcx", ptr + size - 4, 4), NULL);
+	fbr_buffer_read_advance(FBR_A_ &arg->buffer);
+	arg->read = 1;
+}
+
+START_TEST(test_buffer_prepare_reserve)
+{
+	struct fbr_context context;
+	struct mixed_arg arg;
+	fbr_id_t preparer, reserver, reader;
+	size_t size;
+	char *ptr;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	memset(&arg, 0, sizeof(arg));
+	retval = fbr_buffer_init(&context, &arg.buffer, 0);
+	fail_unless(0 == retval, NULL);
+	size = fbr_buffer_size(&context, &arg.buffer);
+	ptr = fbr_buffer_alloc_prepare(&context, &arg.buffer, size - 2);
+	fail_if(NULL == ptr, NULL);
+	memset(ptr, 'a', size - 2);
+	fbr_buffer_alloc_commit(&context, &arg.buffer);
+
+	reader = fbr_create(&context, "reader", mixed_reader_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(reader), NULL);
+	retval = fbr_transfer(&context, reader);
+	fail_unless(0 == retval, NULL);
+	/* Does not fit, waits for the reader with prepared_bytes set */
+	preparer = fbr_create(&context, "preparer", mixed_preparer_fiber,
+			&arg, 0);
+	fail_if(fbr_id_isnull(preparer), NULL);
+	retval = fbr_transfer(&context, preparer);
+	fail_unless(0 == retval, NULL);
+	fail_if(arg.prepared, NULL);
+	/* Waits for the prepared chunk along with the reader */
+	reserver = fbr_create(&context, "reserver", mixed_reserver_fiber,
+			&arg, 0);
+	fail_if(fbr_id_isnull(reserver), NULL);
+	retval = fbr_transfer(&context, reserver);
+	fail_unless(0 == retval, NULL);
+	fail_if(arg.reserved, NULL);
+
+	ptr = fbr_buffer_read_address(&context, &arg.buffer, 2);
+	fail_if(NULL == ptr, NULL);
+	fbr_buffer_read_advance(&context, &arg.buffer);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(arg.prepared, NULL);
+
+	/* Commit wakes the reserver even though the reader is still short of
+	 * data */
+	retval = fbr_transfer(&context, preparer);
+	fail_unless(0 == retval, NULL);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(arg.reserved, NULL);
+	fail_if(arg.read, NULL);
+
+	retval = fbr_transfer(&context, reserver);
+	fail_unless(0 == retval, NULL);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(arg.read, NULL);
+	fail_unless(0 == fbr_buffer_bytes(&context, &arg.buffer), NULL);
+
+	fbr_buffer_destroy(&context, &arg.buffer);
+	fbr_destroy(&context);
+}
+END_TEST
 
 TCase * buffer_tcase(void)
 {
 	TCase *tc_buffer = tcase_create ("Buffer");
 	tcase_add_test(tc_buffer, test_buffer_basic);
 	tcase_add_test(tc_buffer, test_buffer);
+	tcase_add_test(tc_buffer, test_vrb_hugetlb);
+	tcase_add_test(tc_buffer, test_vrb_resize);
+	tcase_add_test(tc_buffer, test_buffer_pool);
+	tcase_add_test(tc_buffer, test_buffer_fd_io);
+	tcase_add_test(tc_buffer, test_buffer_reserve);
+	tcase_add_test(tc_buffer, test_buffer_prepare_reserve);
 	return tc_buffer;
 }
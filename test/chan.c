@@ -0,0 +1,236 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "chan.h"
+
+#define n_messages 100
+
+struct msg {
+	int seq;
+	char payload[12];
+};
+
+struct chan_arg {
+	struct fbr_chan *chan;
+	struct fbr_chan *other;
+	int received;
+	int done;
+};
+
+static void producer_fiber(FBR_P_ void *_arg)
+{
+	struct chan_arg *arg = _arg;
+	struct msg msg;
+	int retval;
+	int i;
+
+	for (i = 0; i < n_messages; i++) {
+		memset(&msg, 0x00, sizeof(msg));
+		msg.seq = i;
+		snprintf(msg.payload, sizeof(msg.payload), "msg %d", i);
+		retval = fbr_chan_send(FBR_A_ arg->chan, &msg);
+		fail_unless(0 == retval, NULL);
+	}
+	fbr_chan_close(FBR_A_ arg->chan);
+	retval = fbr_chan_send(FBR_A_ arg->chan, &msg);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_ECLOSED == fctx->f_errno, NULL);
+	arg->done++;
+}
+
+static void consumer_fiber(FBR_P_ void *_arg)
+{
+	struct chan_arg *arg = _arg;
+	struct msg msg;
+	char expected[12];
+
+	while (0 == fbr_chan_recv(FBR_A_ arg->chan, &msg)) {
+		fail_unless(msg.seq == arg->received, NULL);
+		snprintf(expected, sizeof(expected), "msg %d", msg.seq);
+		fail_unless(0 == strcmp(expected, msg.payload), NULL);
+		arg->received++;
+	}
+	fail_unless(FBR_ECLOSED == fctx->f_errno, NULL);
+	arg->done++;
+}
+
+static void run_pipe(size_t capacity)
+{
+	struct fbr_context context;
+	struct chan_arg arg;
+	fbr_id_t id;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	memset(&arg, 0x00, sizeof(arg));
+	arg.chan = fbr_chan_create(&context, sizeof(struct msg), capacity);
+	fail_if(NULL == arg.chan, NULL);
+
+	id = fbr_create(&context, "consumer", consumer_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(id), NULL);
+	retval = fbr_transfer(&context, id);
+	fail_unless(0 == retval, NULL);
+	id = fbr_create(&context, "producer", producer_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(id), NULL);
+	retval = fbr_transfer(&context, id);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(2 == arg.done, NULL);
+	fail_unless(n_messages == arg.received, NULL);
+
+	fbr_chan_destroy(&context, arg.chan);
+	fbr_destroy(&context);
+}
+
+START_TEST(test_chan_buffered)
+{
+	run_pipe(7);
+}
+END_TEST
+
+START_TEST(test_chan_unbuffered)
+{
+	struct fbr_context context;
+	struct fbr_chan *chan;
+	int value = 42;
+	int retval;
+
+	run_pipe(0);
+
+	fbr_init(&context, EV_DEFAULT);
+	fail_unless(NULL == fbr_chan_create(&context, 0, 1), NULL);
+	fail_unless(FBR_EINVAL == context.f_errno, NULL);
+	fail_unless(NULL == fbr_chan_create(&context, sizeof(int),
+				SIZE_MAX / 2), NULL);
+	fail_unless(FBR_EINVAL == context.f_errno, NULL);
+	/* Nobody to meet on an unbuffered channel */
+	chan = fbr_chan_create(&context, sizeof(int), 0);
+	retval = fbr_chan_try_send(&context, chan, &value);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_chan_try_recv(&context, chan, &value);
+	fail_unless(0 == retval, NULL);
+	fbr_chan_close(&context, chan);
+	retval = fbr_chan_try_recv(&context, chan, &value);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_ECLOSED == context.f_errno, NULL);
+	fbr_chan_destroy(&context, chan);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void selector_fiber(FBR_P_ void *_arg)
+{
+	struct chan_arg *arg = _arg;
+	struct fbr_ev_chan ev_a, ev_b;
+	struct fbr_ev_base *events[] = {&ev_a.ev_base, &ev_b.ev_base, NULL};
+	int a = 0, b = 0;
+	int retval;
+
+	fbr_ev_chan_init(FBR_A_ &ev_a, arg->chan, FBR_CHAN_RECV, &a);
+	fbr_ev_chan_init(FBR_A_ &ev_b, arg->other, FBR_CHAN_RECV, &b);
+
+	/* Nothing is ready yet */
+	retval = fbr_select(FBR_A_ events, 0.);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_ETIMEDOUT == fctx->f_errno, NULL);
+
+	/* Sender on the other channel shows up later */
+	retval = fbr_select(FBR_A_ events, -1.);
+	fail_unless(1 == retval, NULL);
+	fail_unless(0 == a && 2 == b, NULL);
+
+	/* Both are ready, exactly one is received */
+	retval = fbr_select(FBR_A_ events, 1.);
+	fail_unless(0 == retval, NULL);
+	fail_unless(1 == a, NULL);
+	fail_unless(1 == fbr_chan_len(FBR_A_ arg->other), NULL);
+
+	retval = fbr_select(FBR_A_ events, 1.);
+	fail_unless(1 == retval, NULL);
+	fail_unless(3 == b, NULL);
+
+	/* Closed channel wakes the selector up */
+	retval = fbr_select(FBR_A_ events, -1.);
+	fail_unless(0 == retval, NULL);
+	fail_unless(ev_a.closed, NULL);
+	arg->done++;
+}
+
+static void sender_fiber(FBR_P_ void *_arg)
+{
+	struct chan_arg *arg = _arg;
+	int value;
+
+	fbr_sleep(FBR_A_ 0.01);
+	value = 2;
+	fbr_chan_send(FBR_A_ arg->other, &value);
+	value = 1;
+	fbr_chan_send(FBR_A_ arg->chan, &value);
+	value = 3;
+	fbr_chan_send(FBR_A_ arg->other, &value);
+	fbr_sleep(FBR_A_ 0.01);
+	fbr_chan_close(FBR_A_ arg->chan);
+	arg->done++;
+}
+
+START_TEST(test_select)
+{
+	struct fbr_context context;
+	struct chan_arg arg;
+	fbr_id_t id;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	memset(&arg, 0x00, sizeof(arg));
+	arg.chan = fbr_chan_create(&context, sizeof(int), 1);
+	arg.other = fbr_chan_create(&context, sizeof(int), 1);
+
+	id = fbr_create(&context, "selector", selector_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(id), NULL);
+	retval = fbr_transfer(&context, id);
+	fail_unless(0 == retval, NULL);
+	id = fbr_create(&context, "sender", sender_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(id), NULL);
+	retval = fbr_transfer(&context, id);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(2 == arg.done, NULL);
+
+	fbr_chan_destroy(&context, arg.chan);
+	fbr_chan_destroy(&context, arg.other);
+	fbr_destroy(&context);
+}
+END_TEST
+
+#undef n_messages
+
+TCase * chan_tcase(void)
+{
+	TCase *tc_chan = tcase_create ("Chan");
+	tcase_add_test(tc_chan, test_chan_buffered);
+	tcase_add_test(tc_chan, test_chan_unbuffered);
+	tcase_add_test(tc_chan, test_select);
+	return tc_chan;
+}
@@ -305,6 +305,169 @@ START_TEST(test_premature_cond)
 }
 END_TEST
 
+START_TEST(test_cond_broadcast_batch)
+{
+	struct fbr_context context;
+	fbr_id_t fiber = FBR_ID_NULL;
+	struct fbr_mutex mutex;
+	struct fbr_cond_var cond;
+	struct fbr_id_tailq_i *item;
+	int flag = 0;
+	int i;
+	const int num_fibers = 3 * FBR_COND_BROADCAST_BATCH;
+	int queued = 0;
+	int retval;
+	struct fiber_arg arg = {
+		.flag_ptr = &flag
+	};
+
+	fbr_init(&context, EV_DEFAULT);
+
+	fbr_mutex_init(&context, &mutex);
+	arg.mutex = &mutex;
+
+	fbr_cond_init(&context, &cond);
+	arg.cond = &cond;
+
+	for(i = 0; i < num_fibers; i++) {
+		fiber = fbr_create(&context, "cond_i", cond_fiber1, &arg, 0);
+		fail_if(fbr_id_isnull(fiber));
+		retval = fbr_transfer(&context, fiber);
+		fail_unless(0 == retval, NULL);
+	}
+
+	fbr_cond_broadcast(&context, &cond);
+	fail_unless(TAILQ_EMPTY(&cond.waiting), NULL);
+	TAILQ_FOREACH(item, &context.__p->pending_fibers, entries)
+		queued++;
+	fail_unless(FBR_COND_BROADCAST_BATCH == queued, NULL);
+
+	/* Signal is not delivered to already woken fibers */
+	fbr_cond_signal(&context, &cond);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(flag == num_fibers, NULL);
+	fail_unless(TAILQ_EMPTY(&context.__p->cond_woken), NULL);
+
+	fbr_cond_destroy(&context, &cond);
+	fbr_mutex_destroy(&context, &mutex);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void cond_fiber_nomutex(FBR_P_ void *_arg)
+{
+	struct fiber_arg *arg = _arg;
+	int *flag_ptr = arg->flag_ptr;
+
+	fbr_cond_wait(FBR_A_ arg->cond, NULL);
+	*flag_ptr += 1;
+}
+
+START_TEST(test_cond_broadcast_free)
+{
+	struct fbr_context context;
+	fbr_id_t fiber = FBR_ID_NULL;
+	struct fbr_cond_var *cond;
+	int flag = 0;
+	int i;
+	const int num_fibers = 3 * FBR_COND_BROADCAST_BATCH;
+	int retval;
+	struct fiber_arg arg = {
+		.flag_ptr = &flag
+	};
+
+	fbr_init(&context, EV_DEFAULT);
+
+	cond = malloc(sizeof(*cond));
+	fail_if(NULL == cond, NULL);
+	fbr_cond_init(&context, cond);
+	arg.cond = cond;
+
+	for(i = 0; i < num_fibers; i++) {
+		fiber = fbr_create(&context, "cond_i", cond_fiber_nomutex,
+				&arg, 0);
+		fail_if(fbr_id_isnull(fiber));
+		retval = fbr_transfer(&context, fiber);
+		fail_unless(0 == retval, NULL);
+	}
+
+	/* Woken fibers must not need the condition variable any more */
+	fbr_cond_broadcast(&context, cond);
+	fbr_cond_destroy(&context, cond);
+	memset(cond, 0x00, sizeof(*cond));
+	free(cond);
+	arg.cond = NULL;
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(flag == num_fibers, NULL);
+
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void cond_fiber_wto(FBR_P_ void *_arg)
+{
+	struct fiber_arg *arg = _arg;
+	int retval;
+
+	fbr_mutex_lock(FBR_A_ arg->mutex);
+	retval = fbr_cond_wait_wto(FBR_A_ arg->cond, arg->mutex, 0.05);
+	if (-1 == retval) {
+		fail_unless(FBR_ETIMEDOUT == fctx->f_errno, NULL);
+		*arg->flag_ptr -= 1;
+	} else {
+		*arg->flag_ptr += 1;
+	}
+	fail_unless(fbr_id_eq(arg->mutex->locked_by, fbr_self(FBR_A)), NULL);
+	fbr_mutex_unlock(FBR_A_ arg->mutex);
+}
+
+START_TEST(test_cond_signal_n_wto)
+{
+	struct fbr_context context;
+	fbr_id_t fiber = FBR_ID_NULL;
+	struct fbr_mutex mutex;
+	struct fbr_cond_var cond;
+	int flag = 0;
+	int i;
+	int retval;
+	struct fiber_arg arg = {
+		.flag_ptr = &flag
+	};
+
+	fbr_init(&context, EV_DEFAULT);
+
+	fbr_mutex_init(&context, &mutex);
+	arg.mutex = &mutex;
+
+	fbr_cond_init(&context, &cond);
+	arg.cond = &cond;
+
+	for(i = 0; i < 5; i++) {
+		fiber = fbr_create(&context, "cond_wto", cond_fiber_wto, &arg,
+				0);
+		fail_if(fbr_id_isnull(fiber));
+		retval = fbr_transfer(&context, fiber);
+		fail_unless(0 == retval, NULL);
+	}
+
+	/* Three fibers are signaled, two time out */
+	fbr_cond_signal_n(&context, &cond, 3);
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(1 == flag, NULL);
+	fail_unless(TAILQ_EMPTY(&cond.waiting), NULL);
+	fail_unless(fbr_id_isnull(mutex.locked_by), NULL);
+
+	fbr_cond_destroy(&context, &cond);
+	fbr_mutex_destroy(&context, &mutex);
+	fbr_destroy(&context);
+}
+END_TEST
+
 TCase * cond_tcase(void)
 {
 	TCase *tc_cond = tcase_create ("Cond");
@@ -313,6 +476,9 @@ TCase * cond_tcase(void)
 	tcase_add_test(tc_cond, test_cond_bad_mutex);
 	tcase_add_test(tc_cond, test_two_conds);
 	tcase_add_test(tc_cond, test_premature_cond);
+	tcase_add_test(tc_cond, test_cond_broadcast_batch);
+	tcase_add_test(tc_cond, test_cond_broadcast_free);
+	tcase_add_test(tc_cond, test_cond_signal_n_wto);
 	return tc_cond;
 }
 
@@ -0,0 +1,182 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "conn-pool.h"
+
+#define n_clients 4
+
+struct pool_arg {
+	int listen_fd;
+	struct sockaddr_in addr;
+	struct fbr_conn_pool *pool;
+	int accepted;
+	int server_fds[16];
+	int done;
+};
+
+static void pool_server(FBR_P_ void *_arg)
+{
+	struct pool_arg *arg = _arg;
+	int fd;
+
+	for (;;) {
+		fd = fbr_accept(FBR_A_ arg->listen_fd, NULL, NULL);
+		fail_if(fd < 0);
+		fail_unless(arg->accepted < 16);
+		arg->server_fds[arg->accepted++] = fd;
+	}
+}
+
+static void pool_borrower(FBR_P_ void *_arg)
+{
+	struct pool_arg *arg = _arg;
+	struct fbr_conn *conn;
+
+	conn = fbr_conn_pool_get(FBR_A_ arg->pool,
+			(struct sockaddr *)&arg->addr, sizeof(arg->addr), 1.);
+	fail_if(NULL == conn);
+	fbr_sleep(FBR_A_ 0.05);
+	fbr_conn_pool_put(FBR_A_ arg->pool, conn, 1);
+	arg->done++;
+}
+
+static void pool_client(FBR_P_ void *_arg)
+{
+	struct pool_arg *arg = _arg;
+	struct fbr_conn *conn, *conn2;
+	fbr_id_t id;
+	int fd;
+	int i;
+
+	/* Sequential requests reuse the very same connection */
+	for (i = 0; i < 3; i++) {
+		conn = fbr_conn_pool_get(FBR_A_ arg->pool,
+				(struct sockaddr *)&arg->addr,
+				sizeof(arg->addr), -1.);
+		fail_if(NULL == conn);
+		if (0 == i)
+			fd = fbr_conn_fd(conn);
+		fail_unless(fd == fbr_conn_fd(conn));
+		fbr_conn_pool_put(FBR_A_ arg->pool, conn, 1);
+	}
+	fbr_sleep(FBR_A_ 0.01);
+	fail_unless(1 == arg->accepted);
+
+	/* Connection closed by the peer is not lent out */
+	close(arg->server_fds[0]);
+	fbr_sleep(FBR_A_ 0.01);
+	conn = fbr_conn_pool_get(FBR_A_ arg->pool,
+			(struct sockaddr *)&arg->addr, sizeof(arg->addr), -1.);
+	fail_if(NULL == conn);
+	fbr_sleep(FBR_A_ 0.01);
+	fail_unless(2 == arg->accepted);
+
+	/* Pool is limited to 2 connections, the third borrower waits */
+	conn2 = fbr_conn_pool_get(FBR_A_ arg->pool,
+			(struct sockaddr *)&arg->addr, sizeof(arg->addr), -1.);
+	fail_if(NULL == conn2);
+	fail_unless(NULL == fbr_conn_pool_get(FBR_A_ arg->pool,
+			(struct sockaddr *)&arg->addr, sizeof(arg->addr), 0.1));
+	fail_unless(FBR_ETIMEDOUT == fctx->f_errno);
+	fbr_conn_pool_put(FBR_A_ arg->pool, conn, 1);
+	fbr_conn_pool_put(FBR_A_ arg->pool, conn2, 1);
+
+	for (i = 0; i < n_clients; i++) {
+		id = fbr_create(FBR_A_ "borrower", pool_borrower, arg, 0);
+		fbr_transfer(FBR_A_ id);
+	}
+	while (arg->done < n_clients)
+		fbr_sleep(FBR_A_ 0.01);
+	fail_unless(3 == arg->accepted);
+
+	/* Idle connections are reaped */
+	fbr_sleep(FBR_A_ 0.5);
+	conn = fbr_conn_pool_get(FBR_A_ arg->pool,
+			(struct sockaddr *)&arg->addr, sizeof(arg->addr), -1.);
+	fail_if(NULL == conn);
+	fbr_sleep(FBR_A_ 0.01);
+	fail_unless(4 == arg->accepted);
+	fbr_conn_pool_put(FBR_A_ arg->pool, conn, 0);
+}
+
+START_TEST(test_conn_pool)
+{
+	struct fbr_context context;
+	fbr_id_t server, client;
+	struct pool_arg arg;
+	socklen_t addrlen = sizeof(arg.addr);
+	int retval;
+	int i;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	memset(&arg, 0x00, sizeof(arg));
+	arg.addr.sin_family = AF_INET;
+	arg.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	arg.listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	fail_if(arg.listen_fd < 0);
+	retval = bind(arg.listen_fd, (struct sockaddr *)&arg.addr,
+			sizeof(arg.addr));
+	fail_unless(0 == retval);
+	retval = listen(arg.listen_fd, 16);
+	fail_unless(0 == retval);
+	retval = getsockname(arg.listen_fd, (struct sockaddr *)&arg.addr,
+			&addrlen);
+	fail_unless(0 == retval);
+
+	arg.pool = fbr_conn_pool_create(&context, 2, 0.2);
+	fail_if(NULL == arg.pool);
+
+	server = fbr_create(&context, "server", pool_server, &arg, 0);
+	fail_if(fbr_id_isnull(server), NULL);
+	client = fbr_create(&context, "client", pool_client, &arg, 0);
+	fail_if(fbr_id_isnull(client), NULL);
+
+	retval = fbr_transfer(&context, server);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_transfer(&context, client);
+	fail_unless(0 == retval, NULL);
+
+	while (!fbr_is_reclaimed(&context, client))
+		ev_run(EV_DEFAULT, EVRUN_ONCE);
+
+	fbr_conn_pool_destroy(&context, arg.pool);
+	fbr_reclaim(&context, server);
+	for (i = 0; i < arg.accepted; i++)
+		close(arg.server_fds[i]);
+	close(arg.listen_fd);
+	fbr_destroy(&context);
+}
+END_TEST
+
+#undef n_clients
+
+TCase * conn_pool_tcase(void)
+{
+	TCase *tc_conn_pool = tcase_create ("Conn_pool");
+	tcase_add_test(tc_conn_pool, test_conn_pool);
+	return tc_conn_pool;
+}
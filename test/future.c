@@ -0,0 +1,167 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "future.h"
+
+#define n_waiters 5
+
+struct future_arg {
+	struct fbr_future *future;
+	struct fbr_future *failed;
+	int done;
+};
+
+static void producer_fiber(FBR_P_ void *_arg)
+{
+	struct future_arg *arg = _arg;
+	int retval;
+
+	fbr_sleep(FBR_A_ 0.01);
+	retval = fbr_future_set(FBR_A_ arg->future, arg);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_future_set(FBR_A_ arg->future, NULL);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_EINVAL == fctx->f_errno, NULL);
+	fbr_future_release(FBR_A_ arg->future);
+
+	retval = fbr_future_set_error(FBR_A_ arg->failed, 42);
+	fail_unless(0 == retval, NULL);
+	fbr_future_release(FBR_A_ arg->failed);
+}
+
+static void waiter_fiber(FBR_P_ void *_arg)
+{
+	struct future_arg *arg = _arg;
+	struct fbr_future *future = arg->future;
+	void *value = NULL;
+	int retval;
+
+	retval = fbr_future_wait(FBR_A_ future, &value, -1.);
+	fail_unless(0 == retval, NULL);
+	fail_unless(value == arg, NULL);
+	fbr_future_release(FBR_A_ future);
+
+	retval = fbr_future_wait(FBR_A_ arg->failed, &value, 1.);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_EFUTURE == fctx->f_errno, NULL);
+	fail_unless(42 == fbr_future_error(FBR_A_ arg->failed), NULL);
+	fbr_future_release(FBR_A_ arg->failed);
+	arg->done++;
+}
+
+START_TEST(test_future)
+{
+	struct fbr_context context;
+	struct future_arg arg;
+	fbr_id_t id;
+	int retval;
+	int i;
+
+	fbr_init(&context, EV_DEFAULT);
+	memset(&arg, 0x00, sizeof(arg));
+	arg.future = fbr_future_create(&context);
+	arg.failed = fbr_future_create(&context);
+
+	for (i = 0; i < n_waiters; i++) {
+		fbr_future_retain(&context, arg.future);
+		fbr_future_retain(&context, arg.failed);
+		id = fbr_create(&context, "waiter", waiter_fiber, &arg, 0);
+		fail_if(fbr_id_isnull(id), NULL);
+		retval = fbr_transfer(&context, id);
+		fail_unless(0 == retval, NULL);
+	}
+	id = fbr_create(&context, "producer", producer_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(id), NULL);
+	retval = fbr_transfer(&context, id);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(n_waiters == arg.done, NULL);
+
+	/* Released futures are reused */
+	fail_unless(2 == context.__p->n_free_futures, NULL);
+	arg.future = fbr_future_create(&context);
+	fail_unless(1 == context.__p->n_free_futures, NULL);
+	fail_if(fbr_future_is_ready(&context, arg.future), NULL);
+	fbr_future_release(&context, arg.future);
+
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void timeout_fiber(FBR_P_ void *_arg)
+{
+	struct future_arg *arg = _arg;
+	struct fbr_ev_future ev_future;
+	struct fbr_ev_base *events[] = {&ev_future.ev_base, NULL};
+	int retval;
+
+	retval = fbr_future_wait(FBR_A_ arg->future, NULL, 0.02);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_ETIMEDOUT == fctx->f_errno, NULL);
+
+	fbr_ev_future_init(FBR_A_ &ev_future, arg->future);
+	retval = fbr_ev_wait_to(FBR_A_ events, 5.);
+	fail_unless(1 == retval, NULL);
+	fail_unless(fbr_future_is_ready(FBR_A_ arg->future), NULL);
+	arg->done++;
+}
+
+START_TEST(test_future_timeout)
+{
+	struct fbr_context context;
+	struct future_arg arg;
+	fbr_id_t id;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	memset(&arg, 0x00, sizeof(arg));
+	arg.future = fbr_future_create(&context);
+
+	id = fbr_create(&context, "timeout", timeout_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(id), NULL);
+	retval = fbr_transfer(&context, id);
+	fail_unless(0 == retval, NULL);
+
+	/* Lets the first wait time out */
+	ev_run(EV_DEFAULT, EVRUN_ONCE);
+	fail_unless(0 == arg.done, NULL);
+	retval = fbr_future_set(&context, arg.future, NULL);
+	fail_unless(0 == retval, NULL);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(1 == arg.done, NULL);
+
+	fbr_future_release(&context, arg.future);
+	fbr_destroy(&context);
+}
+END_TEST
+
+#undef n_waiters
+
+TCase * future_tcase(void)
+{
+	TCase *tc_future = tcase_create ("Future");
+	tcase_add_test(tc_future, test_future);
+	tcase_add_test(tc_future, test_future_timeout);
+	return tc_future;
+}
@@ -16,6 +16,7 @@
 
  ********************************************************************/
 
+#include <string.h>
 #include <ev.h>
 #include <check.h>
 #include <evfibers_private/fiber.h>
@@ -42,10 +43,53 @@ START_TEST(test_init_evloop)
 }
 END_TEST
 
+static void stack_fiber(FBR_P_ void *_arg)
+{
+	char buf[128 * 1024];
+	int *done = _arg;
+
+	/* Touches most of the stack */
+	memset(buf, 0xaa, sizeof(buf));
+	fbr_cooperate(FBR_A);
+	*done = (unsigned char)buf[sizeof(buf) - 1] == 0xaa;
+}
+
+START_TEST(test_huge_page_stacks)
+{
+	struct fbr_context context;
+	struct fbr_fiber *fiber;
+	fbr_id_t id;
+	int done = 0;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	fbr_enable_huge_page_stacks(&context, 1);
+	id = fbr_create(&context, "stack", stack_fiber, &done, 256 * 1024);
+	fail_if(fbr_id_isnull(id), NULL);
+	fiber = LIST_FIRST(&context.__p->root.children);
+	fail_unless(fiber->stack_mapped, NULL);
+	fail_unless(256 * 1024 <= fiber->stack_size, NULL);
+	retval = fbr_transfer(&context, id);
+	fail_unless(0 == retval, NULL);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(done, NULL);
+	fail_unless(fbr_is_reclaimed(&context, id), NULL);
+
+	/* Reclaimed fiber keeps its stack, new ones are malloc'ed again */
+	fbr_enable_huge_page_stacks(&context, 0);
+	fbr_create(&context, "stack", stack_fiber, &done, 0);
+	fbr_create(&context, "stack", stack_fiber, &done, 0);
+	fiber = LIST_FIRST(&context.__p->root.children);
+	fail_if(fiber->stack_mapped, NULL);
+	fbr_destroy(&context);
+}
+END_TEST
+
 TCase * init_tcase(void)
 {
 	TCase *tc_init = tcase_create ("Init");
 	tcase_add_test(tc_init, test_init);
 	tcase_add_test(tc_init, test_init_evloop);
+	tcase_add_test(tc_init, test_huge_page_stacks);
 	return tc_init;
 }
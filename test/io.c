@@ -21,6 +21,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <ev.h>
 #include <check.h>
 #include <evfibers_private/fiber.h>
@@ -489,6 +490,164 @@ START_TEST(test_tcp)
 END_TEST
 
 
+#define n_clients 5
+
+struct accept_arg {
+	int listen_fd;
+	struct sockaddr_in addr;
+	int accepted;
+	int handled;
+};
+
+static int accept_listen(struct accept_arg *arg)
+{
+	int fd;
+	int retval;
+	socklen_t addrlen = sizeof(arg->addr);
+
+	memset(&arg->addr, 0x00, sizeof(arg->addr));
+	arg->addr.sin_family = AF_INET;
+	arg->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	arg->addr.sin_port = 0;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	fail_if(fd < 0);
+	retval = bind(fd, (struct sockaddr *) &arg->addr, sizeof(arg->addr));
+	fail_unless(0 == retval);
+	retval = listen(fd, n_clients);
+	fail_unless(0 == retval);
+	retval = getsockname(fd, (struct sockaddr *) &arg->addr, &addrlen);
+	fail_unless(0 == retval);
+	return fd;
+}
+
+static void accept_many_fiber(FBR_P_ void *_arg)
+{
+	struct accept_arg *arg = _arg;
+	int fds[n_clients];
+	int retval;
+	int i;
+
+	while (arg->accepted < n_clients) {
+		/* Budget of 2 is hit for the first batch */
+		retval = fbr_accept_many(FBR_A_ arg->listen_fd, fds, 2);
+		fail_unless(retval > 0 && retval <= 2);
+		for (i = 0; i < retval; i++) {
+			fail_unless(fcntl(fds[i], F_GETFL) & O_NONBLOCK);
+			fail_unless(fcntl(fds[i], F_GETFD) & FD_CLOEXEC);
+			close(fds[i]);
+		}
+		arg->accepted += retval;
+	}
+}
+
+static void accept_handler(FBR_P_ int fd, void *_arg)
+{
+	struct accept_arg *arg = _arg;
+	char c;
+	ssize_t retval;
+
+	retval = fbr_read(FBR_A_ fd, &c, 1);
+	fail_unless(1 == retval);
+	close(fd);
+	arg->handled++;
+}
+
+static void accept_spawn_fiber(FBR_P_ void *_arg)
+{
+	struct accept_arg *arg = _arg;
+	int retval;
+
+	while (arg->accepted < n_clients) {
+		retval = fbr_accept_spawn(FBR_A_ arg->listen_fd, n_clients,
+				"handler", accept_handler, arg, 0);
+		fail_unless(retval > 0);
+		arg->accepted += retval;
+	}
+	/* Keep the handlers, which are our children, alive */
+	while (arg->handled < n_clients)
+		fbr_sleep(FBR_A_ 0.01);
+}
+
+static void connect_fiber(FBR_P_ void *_arg)
+{
+	struct accept_arg *arg = _arg;
+	int fds[n_clients];
+	int retval;
+	int i;
+
+	for (i = 0; i < n_clients; i++) {
+		fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+		fail_if(fds[i] < 0);
+		retval = fbr_fd_nonblock(FBR_A_ fds[i]);
+		fail_unless(0 == retval);
+		retval = fbr_connect(FBR_A_ fds[i],
+				(struct sockaddr *) &arg->addr,
+				sizeof(arg->addr));
+		fail_unless(0 == retval);
+	}
+	for (i = 0; i < n_clients; i++) {
+		retval = fbr_write(FBR_A_ fds[i], "x", 1);
+		fail_unless(1 == retval);
+	}
+	while (arg->accepted < n_clients)
+		fbr_sleep(FBR_A_ 0.01);
+	for (i = 0; i < n_clients; i++)
+		close(fds[i]);
+}
+
+static void run_accept_test(fbr_fiber_func_t acceptor, int nonblock)
+{
+	struct fbr_context context;
+	fbr_id_t server, client;
+	struct accept_arg arg;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	memset(&arg, 0x00, sizeof(arg));
+	arg.listen_fd = accept_listen(&arg);
+	if (nonblock) {
+		retval = fbr_fd_nonblock(&context, arg.listen_fd);
+		fail_unless(0 == retval);
+	}
+
+	server = fbr_create(&context, "acceptor", acceptor, &arg, 0);
+	fail_if(fbr_id_isnull(server), NULL);
+	client = fbr_create(&context, "connector", connect_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(client), NULL);
+
+	retval = fbr_transfer(&context, server);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_transfer(&context, client);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(n_clients == arg.accepted);
+	fail_unless(fbr_is_reclaimed(&context, server));
+	fail_unless(fbr_is_reclaimed(&context, client));
+
+	close(arg.listen_fd);
+	fbr_destroy(&context);
+}
+
+START_TEST(test_accept_many)
+{
+	run_accept_test(accept_many_fiber, 1);
+	/* Blocking listening socket yields one connection per call */
+	run_accept_test(accept_many_fiber, 0);
+}
+END_TEST
+
+START_TEST(test_accept_spawn)
+{
+	run_accept_test(accept_spawn_fiber, 1);
+}
+END_TEST
+#undef n_clients
+
+
 TCase * io_tcase(void)
 {
 	TCase *tc_io = tcase_create ("IO");
@@ -498,5 +657,7 @@ TCase * io_tcase(void)
 	tcase_add_test(tc_io, test_udp);
 	tcase_add_test(tc_io, test_tcp);
 	tcase_add_test(tc_io, test_read_write_premature);
+	tcase_add_test(tc_io, test_accept_many);
+	tcase_add_test(tc_io, test_accept_spawn);
 	return tc_io;
 }
@@ -0,0 +1,170 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "iobuf.h"
+#include "pattern.h"
+
+#define n_bytes 40000
+
+/* Checks that iobuf holds pattern bytes [from, from + len) */
+static void iobuf_check(struct fbr_iobuf *iobuf, size_t from, size_t len)
+{
+	unsigned char *buf = malloc(len + 1);
+	size_t i;
+
+	fail_unless(len == fbr_iobuf_len(iobuf), NULL);
+	fail_unless(len == fbr_iobuf_peek(iobuf, buf, len + 1), NULL);
+	for (i = 0; i < len; i++)
+		fail_unless(pattern_byte(from + i) == buf[i], NULL);
+	free(buf);
+}
+
+START_TEST(test_iobuf)
+{
+	struct fbr_context context;
+	struct fbr_iobuf iobuf, clone, tail;
+	unsigned char data[n_bytes];
+	size_t i;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	for (i = 0; i < n_bytes; i++)
+		data[i] = pattern_byte(i);
+
+	fbr_iobuf_init(&context, &iobuf);
+	fbr_iobuf_init(&context, &clone);
+	fbr_iobuf_init(&context, &tail);
+
+	/* Appends fill the last segment before taking new ones */
+	fbr_iobuf_append(&context, &iobuf, data, 1000);
+	fbr_iobuf_append(&context, &iobuf, data + 1000, n_bytes - 1000 - 10);
+	fail_unless(3 == iobuf.n_nodes, NULL);
+	iobuf_check(&iobuf, 0, n_bytes - 10);
+
+	/* Appending to a shared segment does not disturb the clone */
+	fbr_iobuf_clone(&context, &iobuf, &clone);
+	fbr_iobuf_append(&context, &iobuf, data + n_bytes - 10, 10);
+	fail_unless(3 == iobuf.n_nodes, NULL);
+	fbr_iobuf_append(&context, &clone, "x", 1);
+	fail_unless(4 == clone.n_nodes, NULL);
+	iobuf_check(&iobuf, 0, n_bytes);
+	fbr_iobuf_trim_back(&context, &clone, 1);
+	iobuf_check(&clone, 0, n_bytes - 10);
+
+	/* Split in the middle of a segment */
+	retval = fbr_iobuf_split(&context, &iobuf, n_bytes + 1, &tail);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_EINVAL == context.f_errno, NULL);
+	retval = fbr_iobuf_split(&context, &iobuf, 20000, &tail);
+	fail_unless(0 == retval, NULL);
+	iobuf_check(&iobuf, 0, 20000);
+	iobuf_check(&tail, 20000, n_bytes - 20000);
+	fail_unless(2 == iobuf.n_nodes, NULL);
+	fail_unless(2 == tail.n_nodes, NULL);
+
+	fbr_iobuf_trim_front(&context, &tail, 5000);
+	iobuf_check(&tail, 25000, n_bytes - 25000);
+	fail_unless(2 == tail.n_nodes, NULL);
+	fbr_iobuf_trim_back(&context, &iobuf, 5000);
+	iobuf_check(&iobuf, 0, 15000);
+
+	/* Concatenation puts the split pieces back together */
+	fbr_iobuf_trim_front(&context, &clone, 15000);
+	fbr_iobuf_trim_back(&context, &clone, n_bytes - 10 - 25000);
+	fbr_iobuf_concat(&context, &iobuf, &clone);
+	fbr_iobuf_concat(&context, &iobuf, &tail);
+	fail_unless(0 == fbr_iobuf_len(&clone), NULL);
+	fail_unless(0 == fbr_iobuf_len(&tail), NULL);
+	iobuf_check(&iobuf, 0, n_bytes);
+
+	fbr_iobuf_trim_front(&context, &iobuf, n_bytes + 1);
+	fail_unless(0 == fbr_iobuf_len(&iobuf), NULL);
+	fail_unless(0 == iobuf.n_nodes, NULL);
+
+	fbr_iobuf_destroy(&context, &iobuf);
+	fbr_iobuf_destroy(&context, &clone);
+	fbr_iobuf_destroy(&context, &tail);
+	/* Three segments of data and one of the clone go back to the pool */
+	fail_unless(4 == context.__p->n_free_iobuf_segs, NULL);
+	fbr_destroy(&context);
+}
+END_TEST
+
+START_TEST(test_iobuf_writev)
+{
+	struct fbr_context context;
+	struct fbr_iobuf iobuf;
+	unsigned char data[n_bytes];
+	struct iovec iov[2];
+	int sv[2];
+	size_t i, total = 0;
+	ssize_t retval;
+	int iovcnt;
+
+	fbr_init(&context, EV_DEFAULT);
+	for (i = 0; i < n_bytes; i++)
+		data[i] = pattern_byte(i);
+	retval = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	fail_unless(0 == retval, NULL);
+
+	fbr_iobuf_init(&context, &iobuf);
+	fbr_iobuf_append(&context, &iobuf, data, n_bytes);
+	/* At most two views at a time, partial writes are trimmed */
+	while (fbr_iobuf_len(&iobuf) > 0) {
+		iovcnt = fbr_iobuf_iov(&iobuf, iov, 2);
+		fail_unless(iovcnt > 0 && iovcnt <= 2, NULL);
+		retval = writev(sv[0], iov, iovcnt);
+		fail_unless(0 < retval, NULL);
+		fbr_iobuf_trim_front(&context, &iobuf, retval);
+		while (total < n_bytes - fbr_iobuf_len(&iobuf)) {
+			retval = read(sv[1], data, sizeof(data));
+			fail_unless(0 < retval, NULL);
+			for (i = 0; i < (size_t)retval; i++)
+				fail_unless(pattern_byte(total + i) == data[i],
+						NULL);
+			total += retval;
+		}
+	}
+	fail_unless(n_bytes == total, NULL);
+
+	close(sv[0]);
+	close(sv[1]);
+	fbr_iobuf_destroy(&context, &iobuf);
+	fbr_destroy(&context);
+}
+END_TEST
+
+#undef n_bytes
+
+TCase * iobuf_tcase(void)
+{
+	TCase *tc_iobuf = tcase_create ("IOBuf");
+	tcase_add_test(tc_iobuf, test_iobuf);
+	tcase_add_test(tc_iobuf, test_iobuf_writev);
+	return tc_iobuf;
+}
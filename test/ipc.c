@@ -0,0 +1,139 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string.h>
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "ipc.h"
+#include "pattern.h"
+
+#define n_bytes (4 * 1024 * 1024)
+
+struct ipc_arg {
+	struct fbr_ipc_buffer ipc;
+	int failed;
+};
+
+/* Runs in the child process, where check assertions are not reported */
+static void ipc_writer_fiber(FBR_P_ void *_arg)
+{
+	struct ipc_arg *arg = _arg;
+	unsigned char *ptr;
+	size_t total = 0, chunk = 0, i;
+
+	while (total < n_bytes) {
+		chunk = chunk % 1000 + 1;
+		if (chunk > n_bytes - total)
+			chunk = n_bytes - total;
+		ptr = fbr_ipc_buffer_alloc_prepare(FBR_A_ &arg->ipc, chunk);
+		if (NULL == ptr) {
+			arg->failed = 1;
+			return;
+		}
+		for (i = 0; i < chunk; i++)
+			ptr[i] = pattern_byte(total + i);
+		fbr_ipc_buffer_alloc_commit(FBR_A_ &arg->ipc);
+		total += chunk;
+	}
+}
+
+static void ipc_reader_fiber(FBR_P_ void *_arg)
+{
+	struct ipc_arg *arg = _arg;
+	unsigned char *ptr;
+	size_t total = 0, chunk = 0, i;
+
+	while (total < n_bytes) {
+		chunk = chunk % 777 + 1;
+		if (chunk > n_bytes - total)
+			chunk = n_bytes - total;
+		ptr = fbr_ipc_buffer_read_address(FBR_A_ &arg->ipc, chunk);
+		fail_if(NULL == ptr, NULL);
+		for (i = 0; i < chunk; i++)
+			fail_unless(pattern_byte(total + i) == ptr[i], NULL);
+		fbr_ipc_buffer_read_advance(FBR_A_ &arg->ipc);
+		total += chunk;
+	}
+	fail_unless(0 == fbr_ipc_buffer_bytes(FBR_A_ &arg->ipc), NULL);
+}
+
+START_TEST(test_ipc_buffer)
+{
+	struct fbr_context context;
+	struct ipc_arg arg;
+	fbr_id_t id;
+	pid_t pid;
+	int retval, status;
+	void *ptr;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	memset(&arg, 0, sizeof(arg));
+	retval = fbr_ipc_buffer_init(&context, &arg.ipc, 0);
+	fail_unless(0 == retval, NULL);
+	fail_unless(sysconf(_SC_PAGESIZE) ==
+			(long)fbr_ipc_buffer_size(&context, &arg.ipc), NULL);
+	ptr = fbr_ipc_buffer_alloc_prepare(&context, &arg.ipc,
+			fbr_ipc_buffer_size(&context, &arg.ipc) + 1);
+	fail_unless(NULL == ptr, NULL);
+	fail_unless(FBR_EINVAL == context.f_errno, NULL);
+
+	pid = fork();
+	fail_if(-1 == pid, NULL);
+	if (0 == pid) {
+		ev_loop_fork(EV_DEFAULT);
+		id = fbr_create(&context, "ipc_writer", ipc_writer_fiber,
+				&arg, 0);
+		if (fbr_id_isnull(id) || fbr_transfer(&context, id))
+			_exit(1);
+		ev_run(EV_DEFAULT, 0);
+		fbr_ipc_buffer_destroy(&context, &arg.ipc);
+		_exit(arg.failed);
+	}
+
+	id = fbr_create(&context, "ipc_reader", ipc_reader_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(id), NULL);
+	retval = fbr_transfer(&context, id);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(fbr_is_reclaimed(&context, id), NULL);
+	retval = waitpid(pid, &status, 0);
+	fail_unless(pid == retval, NULL);
+	fail_unless(WIFEXITED(status) && 0 == WEXITSTATUS(status), NULL);
+
+	fbr_ipc_buffer_destroy(&context, &arg.ipc);
+	fbr_destroy(&context);
+}
+END_TEST
+
+#undef n_bytes
+
+TCase * ipc_tcase(void)
+{
+	TCase *tc_ipc = tcase_create ("IPC");
+	tcase_add_test(tc_ipc, test_ipc_buffer);
+	return tc_ipc;
+}
@@ -0,0 +1,140 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "join.h"
+
+struct join_arg {
+	fbr_id_t worker;
+	int done;
+};
+
+static void *worker_fiber(FBR_P_ void *_arg)
+{
+	fbr_sleep(FBR_A_ 0.01);
+	return _arg;
+}
+
+static void *quick_fiber(FBR_P_ void *_arg)
+{
+	fail_if(fbr_id_isnull(fbr_self(FBR_A)), NULL);
+	return _arg;
+}
+
+static void joiner_fiber(FBR_P_ void *_arg)
+{
+	struct join_arg *arg = _arg;
+	void *result = NULL;
+	int retval;
+
+	retval = fbr_join(FBR_A_ arg->worker, &result, 0.001);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_ETIMEDOUT == fctx->f_errno, NULL);
+
+	retval = fbr_join(FBR_A_ arg->worker, &result, -1.);
+	fail_unless(0 == retval, NULL);
+	fail_unless(result == arg, NULL);
+
+	/* Joined fiber is reclaimed */
+	retval = fbr_join(FBR_A_ arg->worker, &result, -1.);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_ENOFIBER == fctx->f_errno, NULL);
+	arg->done++;
+}
+
+START_TEST(test_join)
+{
+	struct fbr_context context;
+	struct join_arg arg;
+	fbr_id_t id;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	memset(&arg, 0x00, sizeof(arg));
+
+	arg.worker = fbr_create_joinable(&context, "worker", worker_fiber,
+			&arg, 0);
+	fail_if(fbr_id_isnull(arg.worker), NULL);
+	retval = fbr_transfer(&context, arg.worker);
+	fail_unless(0 == retval, NULL);
+
+	id = fbr_create(&context, "joiner", joiner_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(id), NULL);
+	retval = fbr_transfer(&context, id);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(1 == arg.done, NULL);
+
+	fbr_destroy(&context);
+}
+END_TEST
+
+START_TEST(test_join_finished)
+{
+	struct fbr_context context;
+	fbr_id_t id;
+	void *result = NULL;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	/* Non-joinable fibers can not be joined */
+	id = fbr_create(&context, "plain", NULL, NULL, 0);
+	fail_if(fbr_id_isnull(id), NULL);
+	retval = fbr_join(&context, id, &result, -1.);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_EINVAL == context.f_errno, NULL);
+	fbr_reclaim(&context, id);
+
+	/* Finished fiber keeps its result until joined */
+	id = fbr_create_joinable(&context, "quick", quick_fiber, &context, 0);
+	fail_if(fbr_id_isnull(id), NULL);
+	retval = fbr_transfer(&context, id);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_join(&context, id, &result, 0.);
+	fail_unless(0 == retval, NULL);
+	fail_unless(result == &context, NULL);
+	retval = fbr_join(&context, id, &result, 0.);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_ENOFIBER == context.f_errno, NULL);
+
+	/* Reclaiming a joinable fiber wakes up the joiner */
+	id = fbr_create_joinable(&context, "dropped", quick_fiber, NULL, 0);
+	fail_if(fbr_id_isnull(id), NULL);
+	retval = fbr_reclaim(&context, id);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_join(&context, id, &result, -1.);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_ENOFIBER == context.f_errno, NULL);
+
+	fbr_destroy(&context);
+}
+END_TEST
+
+TCase * join_tcase(void)
+{
+	TCase *tc_join = tcase_create ("Join");
+	tcase_add_test(tc_join, test_join);
+	tcase_add_test(tc_join, test_join_finished);
+	return tc_join;
+}
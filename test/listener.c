@@ -0,0 +1,96 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ev.h>
+#include <check.h>
+#include <evfibers/listener.h>
+#include <evfibers_private/fiber.h>
+
+#include "listener.h"
+
+#define n_clients 32
+
+static void echo_handler(FBR_P_ int fd, void *_arg)
+{
+	int *handled = _arg;
+	char c;
+	ssize_t retval;
+
+	retval = fbr_read(FBR_A_ fd, &c, 1);
+	fail_unless(1 == retval);
+	retval = fbr_write(FBR_A_ fd, &c, 1);
+	fail_unless(1 == retval);
+	close(fd);
+	__sync_fetch_and_add(handled, 1);
+}
+
+START_TEST(test_listener)
+{
+	struct fbr_listener *listener;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	int handled = 0;
+	int fd;
+	int retval;
+	int i;
+	char c;
+
+	memset(&addr, 0x00, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+
+	listener = fbr_listener_create((struct sockaddr *)&addr, sizeof(addr),
+			4, FBR_LISTENER_PIN_CPU, echo_handler, &handled);
+	fail_if(NULL == listener);
+	retval = fbr_listener_sockname(listener, (struct sockaddr *)&addr,
+			&addrlen);
+	fail_unless(0 == retval);
+	fail_if(0 == addr.sin_port);
+
+	for (i = 0; i < n_clients; i++) {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		fail_if(fd < 0);
+		retval = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+		fail_unless(0 == retval);
+		c = 'a' + i % 26;
+		retval = write(fd, &c, 1);
+		fail_unless(1 == retval);
+		retval = read(fd, &c, 1);
+		fail_unless(1 == retval);
+		fail_unless('a' + i % 26 == c);
+		close(fd);
+	}
+
+	fbr_listener_destroy(listener);
+	fail_unless(n_clients == handled);
+}
+END_TEST
+
+#undef n_clients
+
+TCase * listener_tcase(void)
+{
+	TCase *tc_listener = tcase_create ("Listener");
+	tcase_add_test(tc_listener, test_listener);
+	return tc_listener;
+}
@@ -32,12 +32,31 @@
 #include "eio.h"
 #include "async-wait.h"
 #include "popen3.h"
+#include "signal-wait.h"
+#include "listener.h"
+#include "conn-pool.h"
+#include "resolver.h"
+#include "rwlock.h"
+#include "sem.h"
+#include "waitgroup.h"
+#include "future.h"
+#include "join.h"
+#include "chan.h"
+#include "mq.h"
+#include "xmq.h"
+#include "ipc.h"
+#include "xbuffer.h"
+#include "iobuf.h"
 
 Suite *evfibers_suite(void)
 {
 	Suite *s;
 	TCase *tc_init, *tc_mutex, *tc_cond, *tc_reclaim, *tc_io, *tc_logger,
-	      *tc_buffer, *tc_key, *tc_eio, *tc_async_wait, *tc_popen3;
+	      *tc_buffer, *tc_key, *tc_eio, *tc_async_wait, *tc_popen3,
+	      *tc_signal_wait, *tc_listener, *tc_conn_pool, *tc_resolver,
+	      *tc_rwlock, *tc_sem, *tc_waitgroup,
+	      *tc_future, *tc_join, *tc_chan, *tc_mq, *tc_xmq,
+	      *tc_ipc, *tc_xbuffer, *tc_iobuf;
 
 	s = suite_create ("evfibers");
 	tc_init = init_tcase();
@@ -51,6 +70,21 @@ Suite *evfibers_suite(void)
 	tc_eio = eio_tcase();
 	tc_async_wait = async_wait_tcase();
 	tc_popen3 = popen3_tcase();
+	tc_signal_wait = signal_wait_tcase();
+	tc_listener = listener_tcase();
+	tc_conn_pool = conn_pool_tcase();
+	tc_resolver = resolver_tcase();
+	tc_rwlock = rwlock_tcase();
+	tc_sem = sem_tcase();
+	tc_waitgroup = waitgroup_tcase();
+	tc_future = future_tcase();
+	tc_join = join_tcase();
+	tc_chan = chan_tcase();
+	tc_mq = mq_tcase();
+	tc_xmq = xmq_tcase();
+	tc_ipc = ipc_tcase();
+	tc_xbuffer = xbuffer_tcase();
+	tc_iobuf = iobuf_tcase();
 	suite_add_tcase(s, tc_init);
 	suite_add_tcase(s, tc_mutex);
 	suite_add_tcase(s, tc_cond);
@@ -62,6 +96,21 @@ Suite *evfibers_suite(void)
 	suite_add_tcase(s, tc_eio);
 	suite_add_tcase(s, tc_async_wait);
 	suite_add_tcase(s, tc_popen3);
+	suite_add_tcase(s, tc_signal_wait);
+	suite_add_tcase(s, tc_listener);
+	suite_add_tcase(s, tc_conn_pool);
+	suite_add_tcase(s, tc_resolver);
+	suite_add_tcase(s, tc_rwlock);
+	suite_add_tcase(s, tc_sem);
+	suite_add_tcase(s, tc_waitgroup);
+	suite_add_tcase(s, tc_future);
+	suite_add_tcase(s, tc_join);
+	suite_add_tcase(s, tc_chan);
+	suite_add_tcase(s, tc_mq);
+	suite_add_tcase(s, tc_xmq);
+	suite_add_tcase(s, tc_ipc);
+	suite_add_tcase(s, tc_xbuffer);
+	suite_add_tcase(s, tc_iobuf);
 
 	return s;
 }
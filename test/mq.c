@@ -0,0 +1,165 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "mq.h"
+
+#define n_messages 1000
+#define n_consumers 3
+
+struct mq_arg {
+	struct fbr_mq *mq;
+	int received[n_messages];
+	int n_received;
+	int done;
+};
+
+static void mq_producer_fiber(FBR_P_ void *_arg)
+{
+	struct mq_arg *arg = _arg;
+	void *batch[7];
+	size_t sent = 0;
+	size_t pushed;
+	size_t i;
+
+	while (sent < n_messages) {
+		for (i = 0; i < 7; i++)
+			batch[i] = (void *)(sent + i + 1);
+		pushed = fbr_mq_push_n(arg->mq, batch,
+				n_messages - sent < 7 ? n_messages - sent : 7);
+		fail_unless(pushed > 0, NULL);
+		sent += pushed;
+		if (0 == sent % 3)
+			fbr_cooperate(FBR_A);
+	}
+	for (i = 0; i < n_consumers; i++)
+		fbr_mq_push(arg->mq, NULL);
+	arg->done++;
+}
+
+static void mq_consumer_fiber(FBR_P_ void *_arg)
+{
+	struct mq_arg *arg = _arg;
+	void *batch[5];
+	size_t popped;
+	size_t i;
+
+	for (;;) {
+		popped = fbr_mq_pop_n(arg->mq, batch, 5);
+		fail_unless(popped > 0 && popped <= 5, NULL);
+		for (i = 0; i < popped; i++) {
+			if (NULL == batch[i]) {
+				/* Hand the rest of end markers on */
+				for (i++; i < popped; i++)
+					fbr_mq_push(arg->mq, batch[i]);
+				arg->done++;
+				return;
+			}
+			arg->received[(size_t)batch[i] - 1]++;
+			arg->n_received++;
+		}
+		fbr_sleep(FBR_A_ 0.0001);
+	}
+}
+
+START_TEST(test_mq_batch)
+{
+	struct fbr_context context;
+	struct mq_arg *arg;
+	fbr_id_t id;
+	int retval;
+	int i;
+
+	fbr_init(&context, EV_DEFAULT);
+	arg = calloc(1, sizeof(*arg));
+	arg->mq = fbr_mq_create(&context, 10, 0);
+
+	for (i = 0; i < n_consumers; i++) {
+		id = fbr_create(&context, "consumer", mq_consumer_fiber, arg, 0);
+		fail_if(fbr_id_isnull(id), NULL);
+		retval = fbr_transfer(&context, id);
+		fail_unless(0 == retval, NULL);
+	}
+	id = fbr_create(&context, "producer", mq_producer_fiber, arg, 0);
+	fail_if(fbr_id_isnull(id), NULL);
+	retval = fbr_transfer(&context, id);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(n_consumers + 1 == arg->done, NULL);
+	fail_unless(n_messages == arg->n_received, NULL);
+	for (i = 0; i < n_messages; i++)
+		fail_unless(1 == arg->received[i], NULL);
+
+	fbr_mq_destroy(arg->mq);
+	free(arg);
+	fbr_destroy(&context);
+}
+END_TEST
+
+START_TEST(test_mq_ring)
+{
+	struct fbr_context context;
+	struct fbr_mq *mq;
+	void *objs[16];
+	void *obj;
+	size_t i, n;
+
+	fbr_init(&context, EV_DEFAULT);
+	fail_unless(NULL == fbr_mq_create(&context, SIZE_MAX, 0), NULL);
+	fail_unless(FBR_EINVAL == context.f_errno, NULL);
+	/* Capacity is rounded up to a power of two */
+	mq = fbr_mq_create(&context, 5, 0);
+	for (i = 0; i < 8; i++)
+		fail_unless(0 == fbr_mq_try_push(mq, (void *)(i + 1)), NULL);
+	fail_unless(-1 == fbr_mq_try_push(mq, objs), NULL);
+
+	/* Wraps around preserving the order */
+	for (i = 0; i < 3; i++) {
+		fail_unless(0 == fbr_mq_try_pop(mq, &obj), NULL);
+		fail_unless((void *)(i + 1) == obj, NULL);
+	}
+	for (i = 0; i < 16; i++)
+		objs[i] = (void *)(i + 9);
+	n = fbr_mq_push_n(mq, objs, 16);
+	fail_unless(3 == n, NULL);
+	n = fbr_mq_pop_n(mq, objs, 16);
+	fail_unless(8 == n, NULL);
+	for (i = 0; i < n; i++)
+		fail_unless((void *)(i + 4) == objs[i], NULL);
+	fail_unless(-1 == fbr_mq_try_pop(mq, &obj), NULL);
+
+	fbr_mq_destroy(mq);
+	fbr_destroy(&context);
+}
+END_TEST
+
+#undef n_messages
+#undef n_consumers
+
+TCase * mq_tcase(void)
+{
+	TCase *tc_mq = tcase_create ("MQ");
+	tcase_add_test(tc_mq, test_mq_ring);
+	tcase_add_test(tc_mq, test_mq_batch);
+	return tc_mq;
+}
@@ -231,10 +231,99 @@ START_TEST(test_mutex_evloop)
 }
 END_TEST
 
+static void mutex_fiber7(FBR_P_ void *_arg)
+{
+	struct fiber_arg *arg = _arg;
+	struct fbr_mutex *mutex = arg->mutex;
+	fbr_mutex_lock(FBR_A_ mutex);
+	*arg->flag_ptr += 1;
+	fbr_mutex_unlock(FBR_A_ mutex);
+}
+
+START_TEST(test_mutex_handoff)
+{
+	struct fbr_context context;
+	fbr_id_t fiber;
+	struct fbr_mutex mutex;
+	int flag = 0;
+	int retval;
+	struct fiber_arg arg = {
+		.flag_ptr = &flag
+	};
+
+	fbr_init(&context, EV_DEFAULT);
+
+	fbr_mutex_init(&context, &mutex);
+	fbr_mutex_set_mode(&context, &mutex, FBR_MUTEX_HANDOFF);
+	arg.mutex = &mutex;
+
+	fail_unless(fbr_mutex_trylock(&context, &mutex), NULL);
+	fiber = fbr_create(&context, "mutex7", mutex_fiber7, &arg, 0);
+	fail_if(fbr_id_isnull(fiber), NULL);
+	retval = fbr_transfer(&context, fiber);
+	fail_unless(0 == retval, NULL);
+	fail_unless(0 == flag, NULL);
+
+	/* Waiter runs before unlock returns */
+	fbr_mutex_unlock(&context, &mutex);
+	fail_unless(1 == flag, NULL);
+	fail_unless(fbr_id_isnull(mutex.locked_by), NULL);
+	fail_unless(fbr_is_reclaimed(&context, fiber), NULL);
+
+	fbr_mutex_destroy(&context, &mutex);
+	fbr_destroy(&context);
+}
+END_TEST
+
+START_TEST(test_mutex_barging)
+{
+	struct fbr_context context;
+	fbr_id_t fiber;
+	struct fbr_mutex mutex;
+	int flag = 0;
+	int retval;
+	struct fiber_arg arg = {
+		.flag_ptr = &flag
+	};
+
+	fbr_init(&context, EV_DEFAULT);
+
+	fbr_mutex_init(&context, &mutex);
+	fbr_mutex_set_mode(&context, &mutex, FBR_MUTEX_BARGING);
+	arg.mutex = &mutex;
+
+	fail_unless(fbr_mutex_trylock(&context, &mutex), NULL);
+	fiber = fbr_create(&context, "mutex7", mutex_fiber7, &arg, 0);
+	fail_if(fbr_id_isnull(fiber), NULL);
+	retval = fbr_transfer(&context, fiber);
+	fail_unless(0 == retval, NULL);
+
+	/* Mutex is free right after unlock, so it can be taken again */
+	fbr_mutex_unlock(&context, &mutex);
+	fail_unless(fbr_id_isnull(mutex.locked_by), NULL);
+	fail_unless(fbr_mutex_trylock(&context, &mutex), NULL);
+
+	/* Woken waiter loses the race and waits again */
+	ev_run(EV_DEFAULT, EVRUN_NOWAIT);
+	fail_unless(0 == flag, NULL);
+	fail_if(fbr_is_reclaimed(&context, fiber), NULL);
+
+	fbr_mutex_unlock(&context, &mutex);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(1 == flag, NULL);
+	fail_unless(fbr_is_reclaimed(&context, fiber), NULL);
+
+	fbr_mutex_destroy(&context, &mutex);
+	fbr_destroy(&context);
+}
+END_TEST
+
 TCase * mutex_tcase(void)
 {
 	TCase *tc_mutex = tcase_create ("Mutex");
 	tcase_add_test(tc_mutex, test_mutex);
 	tcase_add_test(tc_mutex, test_mutex_evloop);
+	tcase_add_test(tc_mutex, test_mutex_handoff);
+	tcase_add_test(tc_mutex, test_mutex_barging);
 	return tc_mutex;
 }
@@ -0,0 +1,32 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+
+#ifndef _PATTERN_H_
+#define _PATTERN_H_
+
+#include <stddef.h>
+
+/* Byte number i of the data stream shared by the buffer tests. Period is
+ * long enough for misplaced chunks not to compare equal by accident. */
+static inline unsigned char pattern_byte(size_t i)
+{
+	return (i * 7 + i / 251) & 0xff;
+}
+
+#endif
@@ -16,6 +16,7 @@
 
  ********************************************************************/
 
+#include <string.h>
 #include <ev.h>
 #include <check.h>
 #include <evfibers_private/fiber.h>
@@ -194,6 +195,116 @@ START_TEST(test_user_data)
 }
 END_TEST
 
+static void alloc_dtor(_unused_ FBR_P_ void *ptr, void *context)
+{
+	int *calls = context;
+	fail_unless(0xab == *(unsigned char *)ptr);
+	(*calls)++;
+}
+
+static size_t arena_chunks(struct fbr_fiber *fiber)
+{
+	struct fbr_arena_chunk *chunk;
+	size_t n = 0;
+
+	for (chunk = fiber->arena; chunk; chunk = chunk->next)
+		n++;
+	return n;
+}
+
+static void alloc_fiber(FBR_P_ void *_arg)
+{
+	int *calls = _arg;
+	struct fbr_arena_chunk *chunk;
+	unsigned char *ptr, *big;
+	unsigned char *fifo[8];
+	size_t i, n_chunks;
+
+	for (i = 0; i < 10000; i++) {
+		ptr = fbr_alloc(FBR_A_ i % 100 + 1);
+		fail_unless(0 == (uintptr_t)ptr % FBR_ARENA_ALIGN);
+		memset(ptr, 0xab, i % 100 + 1);
+	}
+	ptr = fbr_alloc(FBR_A_ 3 * FBR_ARENA_CHUNK_SIZE);
+	memset(ptr, 0xab, 3 * FBR_ARENA_CHUNK_SIZE);
+
+	/* Oversized chunk goes away as soon as it is freed */
+	chunk = CURRENT_FIBER->arena;
+	big = fbr_alloc(FBR_A_ 2 * FBR_ARENA_CHUNK_SIZE);
+	fail_unless(chunk->next == ((struct mem_pool *)big - 1)->chunk);
+	fbr_free(FBR_A_ big);
+	fail_unless(chunk->next == ((struct mem_pool *)ptr - 1)->chunk);
+
+	/* Freeing the most recent allocations rewinds the bump pointer */
+	ptr = fbr_alloc(FBR_A_ 10);
+	big = fbr_alloc(FBR_A_ 20);
+	fbr_free(FBR_A_ big);
+	fail_unless(big == fbr_alloc(FBR_A_ 20));
+	fbr_free(FBR_A_ big);
+	fbr_free(FBR_A_ ptr);
+	fail_unless(ptr == fbr_alloc(FBR_A_ 30));
+
+	/* Freeing in allocation order does not pile chunks up either */
+	n_chunks = arena_chunks(CURRENT_FIBER);
+	for (i = 0; i < 10000; i++) {
+		fifo[i % 8] = fbr_alloc(FBR_A_ 64);
+		if (i >= 7)
+			fbr_free(FBR_A_ fifo[(i + 1) % 8]);
+		ptr = fbr_alloc(FBR_A_ 64);
+		big = fbr_alloc(FBR_A_ 64);
+		fbr_free(FBR_A_ ptr);
+		fbr_free(FBR_A_ big);
+	}
+	/* Entries still queued may straddle two new chunks */
+	fail_unless(arena_chunks(CURRENT_FIBER) <= n_chunks + 2);
+
+	/* Freed explicitly, with and without the destructor */
+	ptr = fbr_calloc(FBR_A_ 1, 1);
+	*ptr = 0xab;
+	fbr_alloc_set_destructor(FBR_A_ ptr, alloc_dtor, calls);
+	fbr_free(FBR_A_ ptr);
+	fail_unless(1 == *calls);
+	ptr = fbr_alloc(FBR_A_ 1);
+	fbr_alloc_set_destructor(FBR_A_ ptr, alloc_dtor, calls);
+	fbr_free_nd(FBR_A_ ptr);
+
+	/* Left for the reclaim */
+	ptr = fbr_alloc(FBR_A_ 1);
+	*ptr = 0xab;
+	fbr_alloc_set_destructor(FBR_A_ ptr, alloc_dtor, calls);
+	ptr = fbr_alloc(FBR_A_ 1);
+	fbr_alloc_set_destructor(FBR_A_ ptr, alloc_dtor, calls);
+	fbr_alloc_set_destructor(FBR_A_ ptr, NULL, NULL);
+}
+
+START_TEST(test_alloc_arena)
+{
+	struct fbr_context context;
+	struct fbr_fiber *fiber;
+	fbr_id_t id;
+	int calls = 0;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	id = fbr_create(&context, "alloc_fiber", alloc_fiber, &calls, 0);
+	fail_if(fbr_id_isnull(id));
+	fiber = LIST_FIRST(&context.__p->root.children);
+	retval = fbr_transfer(&context, id);
+	fail_unless(0 == retval);
+	fail_unless(fbr_is_reclaimed(&context, id));
+	fail_unless(2 == calls);
+	fail_unless(LIST_EMPTY(&fiber->pool));
+
+	/* One chunk is kept for the next fiber */
+	fail_if(NULL == fiber->arena);
+	fail_unless(NULL == fiber->arena->next);
+	fail_unless(0 == fiber->arena->used);
+
+	fbr_destroy(&context);
+}
+END_TEST
+
 
 TCase * reclaim_tcase(void)
 {
@@ -202,5 +313,6 @@ TCase * reclaim_tcase(void)
 	tcase_add_test(tc_reclaim, test_no_reclaim);
 	tcase_add_test(tc_reclaim, test_disown);
 	tcase_add_test(tc_reclaim, test_user_data);
+	tcase_add_test(tc_reclaim, test_alloc_arena);
 	return tc_reclaim;
 }
@@ -0,0 +1,118 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "resolver.h"
+
+#define n_resolvers 8
+
+struct resolver_arg {
+	int done;
+};
+
+static void check_loopback(struct addrinfo *res)
+{
+	struct sockaddr_in *sin;
+
+	fail_if(NULL == res);
+	fail_unless(AF_INET == res->ai_family);
+	fail_unless(SOCK_STREAM == res->ai_socktype);
+	fail_unless(sizeof(*sin) == res->ai_addrlen);
+	sin = (struct sockaddr_in *)res->ai_addr;
+	fail_unless(htonl(INADDR_LOOPBACK) == sin->sin_addr.s_addr);
+	fail_unless(htons(8080) == sin->sin_port);
+}
+
+static void resolver_fiber(FBR_P_ void *_arg)
+{
+	struct resolver_arg *arg = _arg;
+	struct addrinfo hints, *res;
+	int retval;
+
+	memset(&hints, 0x00, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST;
+
+	retval = fbr_getaddrinfo(FBR_A_ "127.0.0.1", "8080", &hints, &res);
+	fail_unless(0 == retval, "%s", gai_strerror(retval));
+	check_loopback(res);
+	fbr_freeaddrinfo(FBR_A_ res);
+
+	retval = fbr_getaddrinfo(FBR_A_ "not an address", "8080", &hints,
+			&res);
+	fail_unless(EAI_NONAME == retval, "%s", gai_strerror(retval));
+	fail_unless(NULL == res);
+
+	arg->done++;
+}
+
+START_TEST(test_resolver)
+{
+	struct fbr_context context;
+	struct resolver_arg arg;
+	struct addrinfo hints, *res;
+	fbr_id_t fibers[n_resolvers];
+	int retval;
+	int i;
+
+	fbr_init(&context, EV_DEFAULT);
+	memset(&arg, 0x00, sizeof(arg));
+
+	for (i = 0; i < n_resolvers; i++) {
+		fibers[i] = fbr_create(&context, "resolver", resolver_fiber,
+				&arg, 0);
+		fail_if(fbr_id_isnull(fibers[i]), NULL);
+		retval = fbr_transfer(&context, fibers[i]);
+		fail_unless(0 == retval, NULL);
+	}
+
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(n_resolvers == arg.done);
+
+	/* Served from the cache, does not need the loop to run */
+	memset(&hints, 0x00, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST;
+	retval = fbr_getaddrinfo(&context, "127.0.0.1", "8080", &hints, &res);
+	fail_unless(0 == retval, "%s", gai_strerror(retval));
+	check_loopback(res);
+	fbr_freeaddrinfo(&context, res);
+
+	fbr_destroy(&context);
+}
+END_TEST
+
+#undef n_resolvers
+
+TCase * resolver_tcase(void)
+{
+	TCase *tc_resolver = tcase_create ("Resolver");
+	tcase_add_test(tc_resolver, test_resolver);
+	return tc_resolver;
+}
@@ -0,0 +1,262 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "rwlock.h"
+
+struct rwlock_arg {
+	struct fbr_rwlock rwlock;
+	int readers_in;
+	int writer_in;
+	int order[8];
+	int n_order;
+};
+
+static void reader_fiber(FBR_P_ void *_arg)
+{
+	struct rwlock_arg *arg = _arg;
+
+	fbr_rwlock_rdlock(FBR_A_ &arg->rwlock);
+	fail_if(arg->writer_in, NULL);
+	arg->readers_in++;
+	arg->order[arg->n_order++] = 'r';
+	fbr_yield(FBR_A);
+	arg->readers_in--;
+	fbr_rwlock_unlock(FBR_A_ &arg->rwlock);
+}
+
+static void writer_fiber(FBR_P_ void *_arg)
+{
+	struct rwlock_arg *arg = _arg;
+
+	fbr_rwlock_wrlock(FBR_A_ &arg->rwlock);
+	fail_if(arg->readers_in, NULL);
+	fail_if(arg->writer_in, NULL);
+	arg->writer_in = 1;
+	arg->order[arg->n_order++] = 'w';
+	fbr_yield(FBR_A);
+	arg->writer_in = 0;
+	fbr_rwlock_unlock(FBR_A_ &arg->rwlock);
+}
+
+START_TEST(test_rwlock)
+{
+	struct fbr_context context;
+	struct rwlock_arg arg;
+	fbr_id_t readers[3], writer;
+	int retval;
+	int i;
+
+	fbr_init(&context, EV_DEFAULT);
+	memset(&arg, 0x00, sizeof(arg));
+	fbr_rwlock_init(&context, &arg.rwlock);
+
+	for (i = 0; i < 3; i++) {
+		readers[i] = fbr_create(&context, "reader", reader_fiber, &arg,
+				0);
+		fail_if(fbr_id_isnull(readers[i]), NULL);
+	}
+	writer = fbr_create(&context, "writer", writer_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(writer), NULL);
+
+	/* Two readers hold the lock at the same time */
+	retval = fbr_transfer(&context, readers[0]);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_transfer(&context, readers[1]);
+	fail_unless(0 == retval, NULL);
+	fail_unless(2 == arg.readers_in, NULL);
+	fail_unless(2 == arg.rwlock.readers, NULL);
+
+	/* Writer has to wait for them */
+	retval = fbr_transfer(&context, writer);
+	fail_unless(0 == retval, NULL);
+	fail_if(arg.writer_in, NULL);
+
+	/* New reader is queued behind the waiting writer */
+	retval = fbr_transfer(&context, readers[2]);
+	fail_unless(0 == retval, NULL);
+	fail_unless(2 == arg.readers_in, NULL);
+	fail_if(fbr_rwlock_tryrdlock(&context, &arg.rwlock), NULL);
+
+	/* Readers release the lock, writer gets it */
+	retval = fbr_transfer(&context, readers[0]);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_transfer(&context, readers[1]);
+	fail_unless(0 == retval, NULL);
+	fail_unless(fbr_id_eq(arg.rwlock.writer, writer), NULL);
+	ev_run(EV_DEFAULT, EVRUN_NOWAIT);
+	fail_unless(arg.writer_in, NULL);
+
+	/* Writer releases the lock, last reader gets it */
+	retval = fbr_transfer(&context, writer);
+	fail_unless(0 == retval, NULL);
+	ev_run(EV_DEFAULT, EVRUN_NOWAIT);
+	fail_unless(1 == arg.readers_in, NULL);
+	retval = fbr_transfer(&context, readers[2]);
+	fail_unless(0 == retval, NULL);
+
+	fail_unless(4 == arg.n_order, NULL);
+	fail_unless(0 == memcmp(arg.order, (int []){'r', 'r', 'w', 'r'},
+				4 * sizeof(int)), NULL);
+	fail_unless(fbr_id_isnull(arg.rwlock.writer), NULL);
+	fail_unless(0 == arg.rwlock.readers, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+	fbr_rwlock_destroy(&context, &arg.rwlock);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void timeout_fiber(FBR_P_ void *_arg)
+{
+	struct rwlock_arg *arg = _arg;
+	struct fbr_ev_rwlock ev_rwlock;
+	struct fbr_ev_base *events[] = {&ev_rwlock.ev_base, NULL};
+	int retval;
+
+	retval = fbr_rwlock_wrlock_wto(FBR_A_ &arg->rwlock, 0.05);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_ETIMEDOUT == fctx->f_errno, NULL);
+	retval = fbr_rwlock_rdlock_wto(FBR_A_ &arg->rwlock, 0.05);
+	fail_unless(0 == retval, NULL);
+	fbr_rwlock_unlock(FBR_A_ &arg->rwlock);
+
+	/* Reader holding the lock goes away in a while */
+	fbr_ev_rwlock_init(FBR_A_ &ev_rwlock, &arg->rwlock, 1);
+	retval = fbr_ev_wait_to(FBR_A_ events, 5.);
+	fail_unless(1 == retval, NULL);
+	fail_unless(ev_rwlock.ev_base.arrived, NULL);
+	fail_unless(fbr_id_eq(arg->rwlock.writer, fbr_self(FBR_A)), NULL);
+	fbr_rwlock_unlock(FBR_A_ &arg->rwlock);
+	arg->writer_in = 1;
+}
+
+static void holder_fiber(FBR_P_ void *_arg)
+{
+	struct rwlock_arg *arg = _arg;
+
+	fail_unless(fbr_rwlock_tryrdlock(FBR_A_ &arg->rwlock), NULL);
+	fbr_sleep(FBR_A_ 0.2);
+	fbr_rwlock_unlock(FBR_A_ &arg->rwlock);
+}
+
+START_TEST(test_rwlock_timeout)
+{
+	struct fbr_context context;
+	struct rwlock_arg arg;
+	fbr_id_t holder, fiber;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	memset(&arg, 0x00, sizeof(arg));
+	fbr_rwlock_init(&context, &arg.rwlock);
+
+	holder = fbr_create(&context, "holder", holder_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(holder), NULL);
+	retval = fbr_transfer(&context, holder);
+	fail_unless(0 == retval, NULL);
+	fiber = fbr_create(&context, "timeout", timeout_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(fiber), NULL);
+	retval = fbr_transfer(&context, fiber);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(arg.writer_in, NULL);
+
+	fbr_rwlock_destroy(&context, &arg.rwlock);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void long_holder_fiber(FBR_P_ void *_arg)
+{
+	struct rwlock_arg *arg = _arg;
+
+	fail_unless(fbr_rwlock_tryrdlock(FBR_A_ &arg->rwlock), NULL);
+	fbr_sleep(FBR_A_ 1.0);
+	fbr_rwlock_unlock(FBR_A_ &arg->rwlock);
+}
+
+static void timed_writer_fiber(FBR_P_ void *_arg)
+{
+	struct rwlock_arg *arg = _arg;
+	int retval;
+
+	retval = fbr_rwlock_wrlock_wto(FBR_A_ &arg->rwlock, 0.05);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_ETIMEDOUT == fctx->f_errno, NULL);
+}
+
+static void late_reader_fiber(FBR_P_ void *_arg)
+{
+	struct rwlock_arg *arg = _arg;
+	int retval;
+
+	/* Has to get in long before the holder goes away */
+	retval = fbr_rwlock_rdlock_wto(FBR_A_ &arg->rwlock, 0.5);
+	fail_unless(0 == retval, NULL);
+	arg->readers_in++;
+	fbr_rwlock_unlock(FBR_A_ &arg->rwlock);
+}
+
+START_TEST(test_rwlock_writer_timeout)
+{
+	struct fbr_context context;
+	struct rwlock_arg arg;
+	fbr_id_t holder, writer, reader;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	memset(&arg, 0x00, sizeof(arg));
+	fbr_rwlock_init(&context, &arg.rwlock);
+
+	holder = fbr_create(&context, "holder", long_holder_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(holder), NULL);
+	retval = fbr_transfer(&context, holder);
+	fail_unless(0 == retval, NULL);
+	writer = fbr_create(&context, "writer", timed_writer_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(writer), NULL);
+	retval = fbr_transfer(&context, writer);
+	fail_unless(0 == retval, NULL);
+	/* Queued behind the waiting writer */
+	reader = fbr_create(&context, "reader", late_reader_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(reader), NULL);
+	retval = fbr_transfer(&context, reader);
+	fail_unless(0 == retval, NULL);
+	fail_unless(0 == arg.readers_in, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(1 == arg.readers_in, NULL);
+
+	fbr_rwlock_destroy(&context, &arg.rwlock);
+	fbr_destroy(&context);
+}
+END_TEST
+
+TCase * rwlock_tcase(void)
+{
+	TCase *tc_rwlock = tcase_create ("Rwlock");
+	tcase_add_test(tc_rwlock, test_rwlock);
+	tcase_add_test(tc_rwlock, test_rwlock_timeout);
+	tcase_add_test(tc_rwlock, test_rwlock_writer_timeout);
+	return tc_rwlock;
+}
@@ -0,0 +1,146 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "sem.h"
+
+struct sem_arg {
+	struct fbr_sem *sem;
+	unsigned count;
+	ev_tstamp timeout;
+	int acquired;
+	int timed_out;
+};
+
+static void sem_fiber(FBR_P_ void *_arg)
+{
+	struct sem_arg *arg = _arg;
+	int retval;
+
+	if (arg->timeout > 0.) {
+		retval = fbr_sem_acquire_wto(FBR_A_ arg->sem, arg->count,
+				arg->timeout);
+		if (-1 == retval) {
+			fail_unless(FBR_ETIMEDOUT == fctx->f_errno, NULL);
+			arg->timed_out = 1;
+			return;
+		}
+	} else {
+		fbr_sem_acquire(FBR_A_ arg->sem, arg->count);
+	}
+	arg->acquired = 1;
+}
+
+static fbr_id_t start_waiter(FBR_P_ struct sem_arg *arg)
+{
+	fbr_id_t id;
+	int retval;
+
+	id = fbr_create(FBR_A_ "sem", sem_fiber, arg, 0);
+	fail_if(fbr_id_isnull(id), NULL);
+	retval = fbr_transfer(FBR_A_ id);
+	fail_unless(0 == retval, NULL);
+	return id;
+}
+
+START_TEST(test_sem)
+{
+	struct fbr_context context;
+	struct fbr_sem sem;
+	struct sem_arg a = {.sem = &sem, .count = 2};
+	struct sem_arg b = {.sem = &sem, .count = 2};
+	struct sem_arg c = {.sem = &sem, .count = 1};
+	struct sem_arg d = {.sem = &sem, .count = 4};
+	int i;
+
+	fbr_init(&context, EV_DEFAULT);
+	fbr_sem_init(&context, &sem, 3);
+
+	start_waiter(&context, &a);
+	fail_unless(a.acquired, NULL);
+	fail_unless(1 == sem.value, NULL);
+
+	/* c could fit, but is queued behind b */
+	start_waiter(&context, &b);
+	start_waiter(&context, &c);
+	start_waiter(&context, &d);
+	fail_if(b.acquired || c.acquired || d.acquired, NULL);
+	fail_if(fbr_sem_try_acquire(&context, &sem, 1), NULL);
+
+	/* Both b and c fit now, d does not and is not woken up */
+	fbr_sem_release(&context, &sem, 2);
+	fail_unless(0 == sem.value, NULL);
+	for (i = 0; i < 4; i++)
+		ev_run(EV_DEFAULT, EVRUN_NOWAIT);
+	fail_unless(b.acquired && c.acquired, NULL);
+	fail_if(d.acquired, NULL);
+
+	fbr_sem_release(&context, &sem, 3);
+	fail_unless(3 == sem.value, NULL);
+	fbr_sem_release(&context, &sem, 1);
+	fail_unless(0 == sem.value, NULL);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(d.acquired, NULL);
+
+	fbr_sem_release(&context, &sem, 4);
+	fail_unless(fbr_sem_try_acquire(&context, &sem, 3), NULL);
+	fail_unless(1 == sem.value, NULL);
+
+	fbr_sem_destroy(&context, &sem);
+	fbr_destroy(&context);
+}
+END_TEST
+
+START_TEST(test_sem_timeout)
+{
+	struct fbr_context context;
+	struct fbr_sem sem;
+	struct sem_arg a = {.sem = &sem, .count = 3, .timeout = 0.05};
+	struct sem_arg b = {.sem = &sem, .count = 1};
+
+	fbr_init(&context, EV_DEFAULT);
+	fbr_sem_init(&context, &sem, 1);
+	fail_unless(fbr_sem_try_acquire(&context, &sem, 1), NULL);
+
+	start_waiter(&context, &a);
+	start_waiter(&context, &b);
+	fbr_sem_release(&context, &sem, 1);
+	fail_unless(1 == sem.value, NULL);
+
+	/* Once a gives up, b is no longer blocked behind it */
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(a.timed_out, NULL);
+	fail_unless(b.acquired, NULL);
+	fail_unless(0 == sem.value, NULL);
+
+	fbr_sem_destroy(&context, &sem);
+	fbr_destroy(&context);
+}
+END_TEST
+
+TCase * sem_tcase(void)
+{
+	TCase *tc_sem = tcase_create ("Sem");
+	tcase_add_test(tc_sem, test_sem);
+	tcase_add_test(tc_sem, test_sem_timeout);
+	return tc_sem;
+}
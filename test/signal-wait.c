@@ -0,0 +1,145 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <signal.h>
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "signal-wait.h"
+
+static void signal_waiter(FBR_P_ void *_arg)
+{
+	int *seen = _arg;
+	struct fbr_siginfo info[2];
+	sigset_t set;
+	int retval;
+	int i;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGUSR2);
+
+	while (seen[0] == 0 || seen[1] == 0) {
+		retval = fbr_signal_wait(FBR_A_ &set, 5., info, 2);
+		fail_unless(retval > 0, NULL);
+		for (i = 0; i < retval; i++) {
+			fail_unless(info[i].count > 0, NULL);
+			if (SIGUSR1 == info[i].signo)
+				seen[0] += info[i].count;
+			else if (SIGUSR2 == info[i].signo)
+				seen[1] += info[i].count;
+			else
+				fail("unexpected signal %d", info[i].signo);
+		}
+	}
+}
+
+static void signal_sender(FBR_P_ _unused_ void *_arg)
+{
+	int i;
+
+	fbr_sleep(FBR_A_ 0.1);
+	for (i = 0; i < 100; i++)
+		kill(getpid(), SIGUSR1);
+	kill(getpid(), SIGUSR2);
+}
+
+START_TEST(test_signal_wait)
+{
+	struct fbr_context context;
+	fbr_id_t waiter, sender;
+	int seen[2] = {0, 0};
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	waiter = fbr_create(&context, "signal_waiter", signal_waiter, seen, 0);
+	fail_if(fbr_id_isnull(waiter), NULL);
+	retval = fbr_transfer(&context, waiter);
+	fail_unless(0 == retval, NULL);
+
+	sender = fbr_create(&context, "signal_sender", signal_sender, NULL, 0);
+	fail_if(fbr_id_isnull(sender), NULL);
+	retval = fbr_transfer(&context, sender);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(seen[0] > 0, NULL);
+	/* Deliveries of SIGUSR1 are coalesced */
+	fail_unless(seen[0] <= 100, NULL);
+	fail_unless(1 == seen[1], NULL);
+	fail_unless(fbr_is_reclaimed(&context, waiter), NULL);
+
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void signal_timeout_waiter(FBR_P_ void *_arg)
+{
+	int *result = _arg;
+	struct fbr_siginfo info;
+	sigset_t set;
+	int retval;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR2);
+
+	retval = fbr_signal_wait(FBR_A_ &set, 0.1, &info, 1);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_ETIMEDOUT == fctx->f_errno, NULL);
+
+	sigaddset(&set, SIGKILL);
+	retval = fbr_signal_wait(FBR_A_ &set, 0.1, &info, 1);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_EINVAL == fctx->f_errno, NULL);
+
+	*result = 1;
+}
+
+START_TEST(test_signal_wait_timeout)
+{
+	struct fbr_context context;
+	fbr_id_t waiter;
+	int result = 0;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	waiter = fbr_create(&context, "signal_waiter", signal_timeout_waiter,
+			&result, 0);
+	fail_if(fbr_id_isnull(waiter), NULL);
+	retval = fbr_transfer(&context, waiter);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(1 == result, NULL);
+
+	fbr_destroy(&context);
+}
+END_TEST
+
+TCase * signal_wait_tcase(void)
+{
+	TCase *tc_signal_wait = tcase_create ("Signal_wait");
+	tcase_add_test(tc_signal_wait, test_signal_wait);
+	tcase_add_test(tc_signal_wait, test_signal_wait_timeout);
+	return tc_signal_wait;
+}
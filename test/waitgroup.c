@@ -0,0 +1,156 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "waitgroup.h"
+
+#define n_workers 10
+
+struct wg_arg {
+	struct fbr_waitgroup wg;
+	struct fbr_barrier barrier;
+	int done;
+	int serial;
+	int rounds[n_workers];
+	int index;
+};
+
+static void wg_worker(FBR_P_ void *_arg)
+{
+	struct wg_arg *arg = _arg;
+
+	fbr_sleep(FBR_A_ 0.001 * (rand() % 10));
+	arg->done++;
+	fbr_waitgroup_done(FBR_A_ &arg->wg);
+}
+
+static void wg_waiter(FBR_P_ void *_arg)
+{
+	struct wg_arg *arg = _arg;
+	fbr_id_t id;
+	int retval;
+	int i;
+
+	fbr_waitgroup_add(FBR_A_ &arg->wg, n_workers);
+	for (i = 0; i < n_workers; i++) {
+		id = fbr_create(FBR_A_ "wg_worker", wg_worker, arg, 0);
+		fail_if(fbr_id_isnull(id), NULL);
+		retval = fbr_transfer(FBR_A_ id);
+		fail_unless(0 == retval, NULL);
+	}
+	retval = fbr_waitgroup_wait(FBR_A_ &arg->wg, -1.);
+	fail_unless(0 == retval, NULL);
+	fail_unless(n_workers == arg->done, NULL);
+
+	/* Nothing outstanding, returns right away */
+	retval = fbr_waitgroup_wait(FBR_A_ &arg->wg, 0.);
+	fail_unless(0 == retval, NULL);
+
+	fbr_waitgroup_add(FBR_A_ &arg->wg, 1);
+	retval = fbr_waitgroup_wait(FBR_A_ &arg->wg, 0.05);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_ETIMEDOUT == fctx->f_errno, NULL);
+	fbr_waitgroup_done(FBR_A_ &arg->wg);
+	arg->done++;
+}
+
+START_TEST(test_waitgroup)
+{
+	struct fbr_context context;
+	struct wg_arg arg;
+	fbr_id_t waiter;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	memset(&arg, 0x00, sizeof(arg));
+	fbr_waitgroup_init(&context, &arg.wg);
+
+	waiter = fbr_create(&context, "wg_waiter", wg_waiter, &arg, 0);
+	fail_if(fbr_id_isnull(waiter), NULL);
+	retval = fbr_transfer(&context, waiter);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(n_workers + 1 == arg.done, NULL);
+
+	fbr_waitgroup_destroy(&context, &arg.wg);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void barrier_worker(FBR_P_ void *_arg)
+{
+	struct wg_arg *arg = _arg;
+	int index = arg->index++;
+	int round;
+	int i;
+
+	for (round = 0; round < 3; round++) {
+		fbr_sleep(FBR_A_ 0.001 * (rand() % 10));
+		arg->rounds[index] = round;
+		if (fbr_barrier_wait(FBR_A_ &arg->barrier))
+			arg->serial++;
+		/* Everybody has finished the round */
+		for (i = 0; i < n_workers; i++)
+			fail_unless(arg->rounds[i] >= round, NULL);
+	}
+	arg->done++;
+}
+
+START_TEST(test_barrier)
+{
+	struct fbr_context context;
+	struct wg_arg arg;
+	fbr_id_t id;
+	int retval;
+	int i;
+
+	fbr_init(&context, EV_DEFAULT);
+	memset(&arg, 0x00, sizeof(arg));
+	fbr_barrier_init(&context, &arg.barrier, n_workers);
+
+	for (i = 0; i < n_workers; i++) {
+		id = fbr_create(&context, "barrier_worker", barrier_worker,
+				&arg, 0);
+		fail_if(fbr_id_isnull(id), NULL);
+		retval = fbr_transfer(&context, id);
+		fail_unless(0 == retval, NULL);
+	}
+
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(n_workers == arg.done, NULL);
+	fail_unless(3 == arg.serial, NULL);
+
+	fbr_barrier_destroy(&context, &arg.barrier);
+	fbr_destroy(&context);
+}
+END_TEST
+
+#undef n_workers
+
+TCase * waitgroup_tcase(void)
+{
+	TCase *tc_waitgroup = tcase_create ("Waitgroup");
+	tcase_add_test(tc_waitgroup, test_waitgroup);
+	tcase_add_test(tc_waitgroup, test_barrier);
+	return tc_waitgroup;
+}
@@ -0,0 +1,143 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+
+#include <pthread.h>
+#include <string.h>
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "xbuffer.h"
+#include "pattern.h"
+
+#define n_bytes (16 * 1024 * 1024)
+
+struct xbuffer_arg {
+	struct fbr_xbuffer *xbuffer;
+	size_t received;
+};
+
+static void xbuffer_writer_fiber(FBR_P_ void *_arg)
+{
+	struct xbuffer_arg *arg = _arg;
+	unsigned char *ptr;
+	size_t total = 0, chunk = 0, i;
+
+	while (total < n_bytes) {
+		chunk = (chunk * 3 + 1) % 5000 + 1;
+		if (chunk > n_bytes - total)
+			chunk = n_bytes - total;
+		ptr = fbr_xbuffer_alloc_prepare(FBR_A_ arg->xbuffer, chunk);
+		fail_if(NULL == ptr, NULL);
+		for (i = 0; i < chunk; i++)
+			ptr[i] = pattern_byte(total + i);
+		fbr_xbuffer_alloc_commit(arg->xbuffer);
+		total += chunk;
+	}
+}
+
+static void *xbuffer_writer_thread(void *_arg)
+{
+	struct fbr_context context;
+	struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+	fbr_id_t id;
+	int retval;
+
+	fbr_init(&context, loop);
+	id = fbr_create(&context, "xbuffer_writer", xbuffer_writer_fiber,
+			_arg, 0);
+	fail_if(fbr_id_isnull(id), NULL);
+	retval = fbr_transfer(&context, id);
+	fail_unless(0 == retval, NULL);
+	ev_run(loop, 0);
+	fail_unless(fbr_is_reclaimed(&context, id), NULL);
+	fbr_destroy(&context);
+	ev_loop_destroy(loop);
+	return NULL;
+}
+
+static void xbuffer_reader_fiber(FBR_P_ void *_arg)
+{
+	struct xbuffer_arg *arg = _arg;
+	unsigned char *ptr;
+	size_t chunk = 0, i;
+
+	while (arg->received < n_bytes) {
+		chunk = chunk % 3000 + 1;
+		if (chunk > n_bytes - arg->received)
+			chunk = n_bytes - arg->received;
+		ptr = fbr_xbuffer_read_address(FBR_A_ arg->xbuffer, chunk);
+		fail_if(NULL == ptr, NULL);
+		for (i = 0; i < chunk; i++)
+			fail_unless(pattern_byte(arg->received + i) == ptr[i],
+					NULL);
+		fbr_xbuffer_read_advance(arg->xbuffer);
+		arg->received += chunk;
+	}
+}
+
+START_TEST(test_xbuffer)
+{
+	struct fbr_context context;
+	struct xbuffer_arg arg;
+	pthread_t thread;
+	fbr_id_t id;
+	int retval;
+	void *ptr;
+
+	fbr_init(&context, EV_DEFAULT);
+	memset(&arg, 0x00, sizeof(arg));
+	arg.xbuffer = fbr_xbuffer_create(&context, 16 * 1024);
+	fail_if(NULL == arg.xbuffer, NULL);
+	fail_unless(fbr_xbuffer_size(arg.xbuffer) ==
+			fbr_xbuffer_free_bytes(arg.xbuffer), NULL);
+	ptr = fbr_xbuffer_read_address(&context, arg.xbuffer,
+			fbr_xbuffer_size(arg.xbuffer) + 1);
+	fail_unless(NULL == ptr, NULL);
+	fail_unless(FBR_EINVAL == context.f_errno, NULL);
+
+	id = fbr_create(&context, "xbuffer_reader", xbuffer_reader_fiber,
+			&arg, 0);
+	fail_if(fbr_id_isnull(id), NULL);
+	retval = fbr_transfer(&context, id);
+	fail_unless(0 == retval, NULL);
+
+	retval = pthread_create(&thread, NULL, xbuffer_writer_thread, &arg);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+	pthread_join(thread, NULL);
+
+	fail_unless(fbr_is_reclaimed(&context, id), NULL);
+	fail_unless(n_bytes == arg.received, NULL);
+	fail_unless(0 == fbr_xbuffer_bytes(arg.xbuffer), NULL);
+
+	fbr_xbuffer_destroy(arg.xbuffer);
+	fbr_destroy(&context);
+}
+END_TEST
+
+#undef n_bytes
+
+TCase * xbuffer_tcase(void)
+{
+	TCase *tc_xbuffer = tcase_create ("XBuffer");
+	tcase_add_test(tc_xbuffer, test_xbuffer);
+	return tc_xbuffer;
+}
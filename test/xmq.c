@@ -0,0 +1,159 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+
+#include <pthread.h>
+#include <sched.h>
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "xmq.h"
+
+#define n_producers 4
+#define n_messages 20000
+
+struct xmq_arg {
+	struct fbr_xmq *xmq;
+	size_t next[n_producers];
+	size_t received;
+	int done;
+};
+
+struct xmq_producer_arg {
+	struct fbr_xmq *xmq;
+	size_t producer;
+};
+
+static void *xmq_producer_thread(void *_arg)
+{
+	struct xmq_producer_arg *arg = _arg;
+	size_t i;
+
+	for (i = 0; i < n_messages; i++) {
+		while (-1 == fbr_xmq_push(arg->xmq, (void *)(arg->producer +
+						i * n_producers + 1)))
+			sched_yield();
+		if (0 == i % 1000)
+			usleep(100);
+	}
+	return NULL;
+}
+
+static void xmq_consumer_fiber(FBR_P_ void *_arg)
+{
+	struct xmq_arg *arg = _arg;
+	void *batch[16];
+	size_t value;
+	size_t popped;
+	size_t i;
+
+	while (arg->received < n_producers * n_messages) {
+		popped = fbr_xmq_pop_n(arg->xmq, batch, 16);
+		fail_unless(popped > 0, NULL);
+		for (i = 0; i < popped; i++) {
+			value = (size_t)batch[i] - 1;
+			/* Order is preserved per producer */
+			fail_unless(value / n_producers ==
+					arg->next[value % n_producers], NULL);
+			arg->next[value % n_producers]++;
+		}
+		arg->received += popped;
+	}
+	fail_unless(-1 == fbr_xmq_try_pop(arg->xmq, batch), NULL);
+	fail_if(fbr_id_isnull(fbr_self(FBR_A)), NULL);
+	arg->done = 1;
+}
+
+START_TEST(test_xmq)
+{
+	struct fbr_context context;
+	struct xmq_arg arg;
+	struct xmq_producer_arg producer_args[n_producers];
+	pthread_t threads[n_producers];
+	fbr_id_t id;
+	int retval;
+	int i;
+
+	fbr_init(&context, EV_DEFAULT);
+	memset(&arg, 0x00, sizeof(arg));
+	arg.xmq = fbr_xmq_create(&context, 100);
+
+	id = fbr_create(&context, "consumer", xmq_consumer_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(id), NULL);
+	retval = fbr_transfer(&context, id);
+	fail_unless(0 == retval, NULL);
+
+	for (i = 0; i < n_producers; i++) {
+		producer_args[i].xmq = arg.xmq;
+		producer_args[i].producer = i;
+		retval = pthread_create(threads + i, NULL, xmq_producer_thread,
+				producer_args + i);
+		fail_unless(0 == retval, NULL);
+	}
+
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(arg.done, NULL);
+	fail_unless(n_producers * n_messages == arg.received, NULL);
+
+	for (i = 0; i < n_producers; i++)
+		pthread_join(threads[i], NULL);
+	fbr_xmq_destroy(arg.xmq);
+	fbr_destroy(&context);
+}
+END_TEST
+
+START_TEST(test_xmq_full)
+{
+	struct fbr_context context;
+	struct fbr_xmq *xmq;
+	void *obj;
+	size_t i;
+
+	fbr_init(&context, EV_DEFAULT);
+	fail_unless(NULL == fbr_xmq_create(&context, SIZE_MAX), NULL);
+	fail_unless(FBR_EINVAL == context.f_errno, NULL);
+	xmq = fbr_xmq_create(&context, 3);
+	for (i = 0; i < 4; i++)
+		fail_unless(0 == fbr_xmq_push(xmq, (void *)(i + 1)), NULL);
+	fail_unless(-1 == fbr_xmq_push(xmq, (void *)5), NULL);
+	for (i = 0; i < 4; i++) {
+		fail_unless(0 == fbr_xmq_try_pop(xmq, &obj), NULL);
+		fail_unless((void *)(i + 1) == obj, NULL);
+		fail_unless(0 == fbr_xmq_push(xmq, (void *)(i + 5)), NULL);
+	}
+	for (i = 0; i < 4; i++) {
+		fail_unless(0 == fbr_xmq_try_pop(xmq, &obj), NULL);
+		fail_unless((void *)(i + 5) == obj, NULL);
+	}
+	fail_unless(-1 == fbr_xmq_try_pop(xmq, &obj), NULL);
+	fbr_xmq_destroy(xmq);
+	fbr_destroy(&context);
+}
+END_TEST
+
+#undef n_producers
+#undef n_messages
+
+TCase * xmq_tcase(void)
+{
+	TCase *tc_xmq = tcase_create ("XMQ");
+	tcase_add_test(tc_xmq, test_xmq_full);
+	tcase_add_test(tc_xmq, test_xmq);
+	return tc_xmq;
+}